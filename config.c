@@ -0,0 +1,400 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+
+/* Run-time configuration: the values of nel_cfg_t can be set with
+ * `-o key=value' on the command line or in a configuration file with one
+ * `key = value' per line (`#' starts a comment). The CS sends its
+ * configuration to the CR as a TLV message (see nel_cfgmsg_t). */
+
+/* TLV types of the configuration message; never re-use a number */
+#define CFG_TLV_WARDEN_MODE		0x0001
+#define CFG_TLV_SIM_LIMIT		0x0002
+#define CFG_TLV_RELOAD_INTERVAL		0x0003
+#define CFG_TLV_INACTIVE2ACTIVE		0x0004
+#define CFG_TLV_NEL_WAIT		0x0005
+#define CFG_TLV_REQ_PKTS		0x0006
+#define CFG_TLV_COMM_PKTS		0x0007
+#define CFG_TLV_COMM_PKTS_P_PROT	0x0008
+#define CFG_TLV_NEL_PKTS_P_PROT		0x0009
+#define CFG_TLV_ADAPTIVE_WAIT		0x000a
+#define CFG_TLV_NEL_BATCH		0x000b
+#define CFG_TLV_SRC_ADDR		0x000c
+#define CFG_TLV_RULES			0x000d /* number of rules, digest (u64) */
+#define CFG_TLV_PROBE_POLICY		0x000e
+#define CFG_TLV_PROBE_DECAY		0x000f
+#define CFG_TLV_NONE			0x0000 /* local setting, not sent */
+
+static const struct {
+	const char	*key;
+	size_t		off;
+	u_int16_t	tlv;
+	const char	*desc;
+} cfg_keys[] = {
+	{ "warden", offsetof(nel_cfg_t, warden_mode), CFG_TLV_WARDEN_MODE,
+		"simulated warden: none|reg|dyn|adp" },
+	{ "sim_limit", offsetof(nel_cfg_t, sim_limit), CFG_TLV_SIM_LIMIT,
+		"number of non-blocked protocols (0..number of rules)" },
+	{ "reload_interval", offsetof(nel_cfg_t, reload_interval), CFG_TLV_RELOAD_INTERVAL,
+		"dyn/adp: seconds between rule reloads" },
+	{ "inactive_checked", offsetof(nel_cfg_t, inactive2active), CFG_TLV_INACTIVE2ACTIVE,
+		"adp: recently triggered inactive rules to activate" },
+	{ "nel_wait", offsetof(nel_cfg_t, nel_wait), CFG_TLV_NEL_WAIT,
+		"CR: seconds to wait for the probe packets" },
+	{ "req_pkts", offsetof(nel_cfg_t, req_pkts), CFG_TLV_REQ_PKTS,
+		"CC packets required through the warden" },
+	{ "comm_pkts", offsetof(nel_cfg_t, comm_pkts), CFG_TLV_COMM_PKTS,
+		"CS: max. number of COMM phase packets" },
+	{ "comm_pkts_per_proto", offsetof(nel_cfg_t, comm_pkts_p_prot), CFG_TLV_COMM_PKTS_P_PROT,
+		"CS: COMM phase packets per protocol in a row" },
+	{ "nel_pkts_per_proto", offsetof(nel_cfg_t, nel_pkts_p_prot), CFG_TLV_NEL_PKTS_P_PROT,
+		"CS: probe packets per protocol" },
+	{ "adaptive_wait", offsetof(nel_cfg_t, adaptive_wait), CFG_TLV_ADAPTIVE_WAIT,
+		"CR: early completion + adaptive probe timeout (0/1)" },
+	{ "nel_batch", offsetof(nel_cfg_t, nel_batch), CFG_TLV_NEL_BATCH,
+		"CS: protocols announced and probed at once" },
+	{ "src_addr", offsetof(nel_cfg_t, src_addr), CFG_TLV_SRC_ADDR,
+		"CS: warden-link source IPv4 address (0=auto)" },
+	{ "sessions", offsetof(nel_cfg_t, sessions), CFG_TLV_NONE,
+		"CR: exit after this many completed senders (0=never)" },
+	{ "probe_policy", offsetof(nel_cfg_t, probe_policy), CFG_TLV_PROBE_POLICY,
+		"CS: next protocols to probe: random|rr|stale|thompson" },
+	{ "probe_decay", offsetof(nel_cfg_t, probe_decay), CFG_TLV_PROBE_DECAY,
+		"CS: seconds until a verdict loses its weight (0=never)" },
+	{ "capture", offsetof(nel_cfg_t, capture), CFG_TLV_NONE,
+		"CR: capture with pcap|ring (TPACKET_V3)|ebpf (count in kernel)" },
+	{ "ring_size", offsetof(nel_cfg_t, ring_size), CFG_TLV_NONE,
+		"CR: ring: size in KiB" },
+	{ "ring_timeout", offsetof(nel_cfg_t, ring_timeout), CFG_TLV_NONE,
+		"CR: ring: ms until a block is passed on (0=kernel)" },
+	{ "ebpf_interval", offsetof(nel_cfg_t, ebpf_interval), CFG_TLV_NONE,
+		"CR: ebpf: ms between two reads of the counters" },
+	{ "pcap_immediate", offsetof(nel_cfg_t, pcap_immediate), CFG_TLV_NONE,
+		"CR: pcap: pass on every packet at once (0/1)" },
+	{ "pcap_buffer", offsetof(nel_cfg_t, pcap_buffer), CFG_TLV_NONE,
+		"CR: pcap: kernel buffer in KiB (0=libpcap)" },
+	{ "pcap_tstamp", offsetof(nel_cfg_t, pcap_tstamp), CFG_TLV_NONE,
+		"CR: pcap: time stamps in micro|nano seconds" },
+	{ NULL, 0, 0, NULL }
+};
+
+#define CFG_FIELD(cfg, i)	((u_int32_t *)((char *)(cfg) + cfg_keys[i].off))
+
+/* default configuration (see nel.h) */
+nel_cfg_t nel_cfg = {
+	.warden_mode = WARDEN_MODE,
+	.sim_limit = SIM_LIMIT_FOR_BLOCKED_SENDING,
+	.reload_interval = RELOAD_INTERVAL,
+	.inactive2active = SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE,
+	.nel_wait = CR_NEL_TESTPKT_WAITING_TIME,
+	.req_pkts = NUM_OVERALL_REQ_PKTS,
+	.comm_pkts = NUM_COMM_PHASE_PKTS,
+	.comm_pkts_p_prot = NUM_COMM_PHASE_SND_PKTS_P_PROT,
+	.nel_pkts_p_prot = NUM_NEL_TESTPKT_SND_PKTS_P_PROT,
+	.adaptive_wait = CR_NEL_ADAPTIVE_WAIT,
+	.nel_batch = NUM_NEL_BATCH_PROTOS,
+	.src_addr = 0,
+	.sessions = CR_EXIT_AFTER_SESSIONS,
+	.probe_policy = PROBE_POLICY,
+	.probe_decay = PROBE_DECAY,
+	.capture = CR_CAPTURE,
+	.ring_size = CR_RING_SIZE,
+	.ring_timeout = CR_RING_BLOCK_TIMEOUT,
+	.ebpf_interval = CR_EBPF_INTERVAL,
+	.pcap_immediate = CR_PCAP_IMMEDIATE,
+	.pcap_buffer = CR_PCAP_BUFFER,
+	.pcap_tstamp = CR_PCAP_TSTAMP
+};
+
+/* set `key' to `val'; returns NULL on success, otherwise an error message */
+const char *cfg_set(nel_cfg_t *cfg, const char *key, const char *val)
+{
+	unsigned long v;
+	char *end;
+	int i;
+
+	for (i = 0; cfg_keys[i].key != NULL; i++) {
+		if (strcmp(cfg_keys[i].key, key) == 0)
+			break;
+	}
+	if (cfg_keys[i].key == NULL)
+		return "unknown key";
+
+	if (cfg_keys[i].tlv == CFG_TLV_WARDEN_MODE) {
+		if (strcmp(val, "none") == 0) {
+			cfg->warden_mode = WARDEN_MODE_NO_WARDEN;
+			return NULL;
+		} else if (strcmp(val, "reg") == 0) {
+			cfg->warden_mode = WARDEN_MODE_REG_WARDEN;
+			return NULL;
+		} else if (strcmp(val, "dyn") == 0) {
+			cfg->warden_mode = WARDEN_MODE_DYN_WARDEN;
+			return NULL;
+		} else if (strcmp(val, "adp") == 0) {
+			cfg->warden_mode = WARDEN_MODE_ADP_WARDEN;
+			return NULL;
+		}
+		/* FALLTHROUGH: numeric WARDEN_MODE_* value */
+	}
+	if (cfg_keys[i].tlv == CFG_TLV_PROBE_POLICY) {
+		int policy;
+		
+		if ((policy = probe_policy_lookup(val)) >= 0) {
+			cfg->probe_policy = (u_int32_t) policy;
+			return NULL;
+		}
+		/* FALLTHROUGH: numeric PROBE_POLICY_* value */
+	}
+	if (cfg_keys[i].off == offsetof(nel_cfg_t, capture)) {
+		if (strcmp(val, "pcap") == 0) {
+			cfg->capture = CR_CAPTURE_PCAP;
+			return NULL;
+		} else if (strcmp(val, "ring") == 0) {
+			cfg->capture = CR_CAPTURE_RING;
+			return NULL;
+		} else if (strcmp(val, "ebpf") == 0) {
+			cfg->capture = CR_CAPTURE_EBPF;
+			return NULL;
+		}
+		/* FALLTHROUGH: numeric CR_CAPTURE_* value */
+	}
+	if (cfg_keys[i].off == offsetof(nel_cfg_t, pcap_tstamp)) {
+		if (strcmp(val, "micro") == 0) {
+			cfg->pcap_tstamp = CR_TSTAMP_MICRO;
+			return NULL;
+		} else if (strcmp(val, "nano") == 0) {
+			cfg->pcap_tstamp = CR_TSTAMP_NANO;
+			return NULL;
+		}
+		/* FALLTHROUGH: numeric CR_TSTAMP_* value */
+	}
+	if (cfg_keys[i].tlv == CFG_TLV_SRC_ADDR) {
+		struct in_addr addr;
+		
+		if (!inet_aton(val, &addr))
+			return "invalid IPv4 address";
+		cfg->src_addr = ntohl(addr.s_addr);
+		return NULL;
+	}
+	errno = 0;
+	v = strtoul(val, &end, 0);
+	if (errno != 0 || end == val || *end != '\0' || v > 0xffffffffUL)
+		return "invalid value";
+	*CFG_FIELD(cfg, i) = (u_int32_t) v;
+	return NULL;
+}
+
+/* read a configuration file; exits on errors */
+void cfg_load(nel_cfg_t *cfg, const char *path)
+{
+	FILE *fp;
+	char line[256], *key, *val, *p;
+	const char *err;
+	int lineno = 0;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		/* strip white space */
+		for (key = line; isspace((unsigned char) *key); key++)
+			;
+		for (p = key + strlen(key); p > key && isspace((unsigned char) p[-1]); p--)
+			;
+		*p = '\0';
+		if (*key == '\0')
+			continue;
+		if ((val = strchr(key, '=')) == NULL) {
+			fprintf(stderr, "%s:%i: `key = value' expected.\n", path, lineno);
+			exit(1);
+		}
+		for (p = val; p > key && isspace((unsigned char) p[-1]); p--)
+			;
+		*p = '\0';
+		for (val++; isspace((unsigned char) *val); val++)
+			;
+		if ((err = cfg_set(cfg, key, val)) != NULL) {
+			fprintf(stderr, "%s:%i: %s: %s.\n", path, lineno, key, err);
+			exit(1);
+		}
+	}
+	fclose(fp);
+}
+
+/* Same tests as config_chk.c for configurations that are only known at
+ * run-time. Returns NULL if `cfg' is fine, otherwise the problem. */
+const char *cfg_check(const nel_cfg_t *cfg)
+{
+	switch (cfg->warden_mode) {
+	case WARDEN_MODE_NO_WARDEN:
+	case WARDEN_MODE_REG_WARDEN:
+	case WARDEN_MODE_DYN_WARDEN:
+	case WARDEN_MODE_ADP_WARDEN:
+		break;
+	default:
+		return "invalid warden mode";
+	}
+	/* (NO warden does not block anything, whatever sim_limit is) */
+	if (cfg->warden_mode != WARDEN_MODE_NO_WARDEN
+	    && cfg->sim_limit > nel_nrules)
+		return "sim_limit must be <= the number of rules";
+	if (cfg->warden_mode == WARDEN_MODE_DYN_WARDEN
+	    && ((long) nel_nrules - (long) cfg->sim_limit) < 1)
+		return "too many blocked rules";
+	if (cfg->warden_mode == WARDEN_MODE_ADP_WARDEN
+	    && ((long) nel_nrules - (long) cfg->sim_limit
+		- (long) cfg->inactive2active) < 1)
+		return "too many inactive + blocked rules in combination";
+	if (cfg->nel_wait < 1 || cfg->req_pkts < 1 || cfg->comm_pkts_p_prot < 1
+	    || cfg->nel_pkts_p_prot < 1)
+		return "nel_wait, req_pkts and the packets per protocol must be >= 1";
+	if (cfg->comm_pkts < cfg->comm_pkts_p_prot)
+		return "comm_pkts must be >= comm_pkts_per_proto";
+	if (cfg->adaptive_wait > 1)
+		return "adaptive_wait must be 0 or 1";
+	if (cfg->nel_batch < 1 || cfg->nel_batch > nel_nrules)
+		return "nel_batch must be 1..number of rules";
+	if (cfg->probe_policy >= PROBE_POLICIES)
+		return "invalid probe policy";
+	if (cfg->capture > CR_CAPTURE_EBPF)
+		return "invalid capture";
+	if (cfg->ring_size % (CR_RING_BLOCK_SIZE / 1024) != 0
+	    || cfg->ring_size < 2 * (CR_RING_BLOCK_SIZE / 1024)
+	    || cfg->ring_size > 1024 * 1024)
+		return "ring_size must be a multiple of the block size, >= 2 blocks and <= 1 GiB";
+	if (cfg->ebpf_interval < 1 || cfg->ebpf_interval > 1000)
+		return "ebpf_interval must be 1..1000 ms";
+	if (cfg->pcap_immediate > 1)
+		return "pcap_immediate must be 0 or 1";
+	if (cfg->pcap_buffer > 1024 * 1024)
+		return "pcap_buffer must be <= 1 GiB";
+	if (cfg->pcap_tstamp > CR_TSTAMP_NANO)
+		return "invalid pcap_tstamp";
+	return NULL;
+}
+
+void cfg_usage(void)
+{
+	int i;
+
+	fprintf(stderr, "keys for -o key=value and config files (default):\n");
+	for (i = 0; cfg_keys[i].key != NULL; i++) {
+		fprintf(stderr, "       %-20s %s (%u)\n", cfg_keys[i].key,
+			cfg_keys[i].desc, *CFG_FIELD(&nel_cfg, i));
+	}
+}
+
+/* build the configuration message; returns its length. It also describes
+ * our ruleset, so that the CR can check that it uses the same. */
+int cfg_encode(const nel_cfg_t *cfg, u_int8_t *buf, int maxlen)
+{
+	nel_cfgmsg_t hdr;
+	nel_tlv_t tlv;
+	u_int32_t val, rules[3];
+	int i, len = sizeof(hdr);
+
+	for (i = 0; cfg_keys[i].key != NULL; i++) {
+		if (cfg_keys[i].tlv == CFG_TLV_NONE)
+			continue;
+		if (len + sizeof(tlv) + sizeof(val) > maxlen) {
+			fprintf(stderr, "configuration message exceeds %i bytes.\n", maxlen);
+			exit(1);
+		}
+		tlv.type = htons(cfg_keys[i].tlv);
+		tlv.len = htons(sizeof(val));
+		val = htonl(*CFG_FIELD(cfg, i));
+		memcpy(buf + len, &tlv, sizeof(tlv));
+		memcpy(buf + len + sizeof(tlv), &val, sizeof(val));
+		len += sizeof(tlv) + sizeof(val);
+	}
+	if (len + sizeof(tlv) + sizeof(rules) > maxlen) {
+		fprintf(stderr, "configuration message exceeds %i bytes.\n", maxlen);
+		exit(1);
+	}
+	tlv.type = htons(CFG_TLV_RULES);
+	tlv.len = htons(sizeof(rules));
+	rules[0] = htonl(nel_nrules);
+	rules[1] = htonl((u_int32_t) (nel_rules_digest >> 32));
+	rules[2] = htonl((u_int32_t) nel_rules_digest);
+	memcpy(buf + len, &tlv, sizeof(tlv));
+	memcpy(buf + len + sizeof(tlv), rules, sizeof(rules));
+	len += sizeof(tlv) + sizeof(rules);
+	hdr.magic = htonl(NEL_CFGMSG_MAGIC);
+	hdr.version = htons(NEL_CFGMSG_VERSION);
+	hdr.len = htons(len - sizeof(hdr));
+	memcpy(buf, &hdr, sizeof(hdr));
+	return len;
+}
+
+/* apply the TLVs of a configuration message (without its header) to
+ * `cfg'; returns -1 if the message is malformed */
+int cfg_decode(nel_cfg_t *cfg, const u_int8_t *buf, int len)
+{
+	nel_tlv_t tlv;
+	u_int32_t val, rules[3];
+	int i, pos = 0;
+
+	cfg->rules = 0;
+	cfg->rules_digest = 0;
+	while (pos + (int) sizeof(tlv) <= len) {
+		memcpy(&tlv, buf + pos, sizeof(tlv));
+		tlv.type = ntohs(tlv.type);
+		tlv.len = ntohs(tlv.len);
+		pos += sizeof(tlv);
+		if (pos + tlv.len > len)
+			return -1;
+		if (tlv.type == CFG_TLV_RULES) {
+			if (tlv.len != sizeof(rules))
+				return -1;
+			memcpy(rules, buf + pos, sizeof(rules));
+			cfg->rules = ntohl(rules[0]);
+			cfg->rules_digest = ((u_int64_t) ntohl(rules[1]) << 32)
+				| ntohl(rules[2]);
+			pos += tlv.len;
+			continue;
+		}
+		for (i = 0; cfg_keys[i].key != NULL; i++) {
+			if (cfg_keys[i].tlv == tlv.type && tlv.type != CFG_TLV_NONE)
+				break;
+		}
+		/* unknown types (newer senders) are skipped */
+		if (cfg_keys[i].key != NULL) {
+			if (tlv.len != sizeof(val))
+				return -1;
+			memcpy(&val, buf + pos, sizeof(val));
+			*CFG_FIELD(cfg, i) = ntohl(val);
+		}
+		pos += tlv.len;
+	}
+	return (pos == len ? 0 : -1);
+}
@@ -33,11 +33,16 @@
 	#error Please check source code: SIM_LIMIT_FOR_BLOCKED_SENDING must be set to 50 if in NO-warden mode in file nel.h!
 #endif
 
-#if (WARDEN_MODE == WARDEN_MODE_DYN_WARDEN) && (ANNOUNCED_PROTO_NUMBERS - SIM_LIMIT_FOR_BLOCKED_SENDING) < 1
-	#error Please check source code: too many blocked rules in file nel.h!
+/* the limits that depend on the number of rules are checked at run-time
+ * by cfg_check(), once the ruleset is loaded */
+#if (NUM_NEL_BATCH_PROTOS < 1)
+	#error Please check source code: NUM_NEL_BATCH_PROTOS must be >= 1 in file nel.h!
 #endif
 
-#if (WARDEN_MODE == WARDEN_MODE_ADP_WARDEN) && (ANNOUNCED_PROTO_NUMBERS - SIM_LIMIT_FOR_BLOCKED_SENDING - SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE) < 1
-	#error Please check source code: too many inactive + blocked rules in combination in file nel.h.
+#if (CR_RING_SIZE % (CR_RING_BLOCK_SIZE / 1024) != 0) || (CR_RING_SIZE < 2 * (CR_RING_BLOCK_SIZE / 1024))
+	#error Please check source code: CR_RING_SIZE must be a multiple of CR_RING_BLOCK_SIZE (in KiB) and >= 2 blocks in file nel.h!
 #endif
 
+#if (CR_EBPF_INTERVAL < 1) || (CR_EBPF_INTERVAL > 1000)
+	#error Please check source code: CR_EBPF_INTERVAL must be 1..1000 (ms) in file nel.h!
+#endif
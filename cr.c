@@ -28,149 +28,739 @@
 
 #include "nel.h"
 
-extern char *ruleset[ANNOUNCED_PROTO_NUMBERS][3];
-int test_traffic_pkt_cnt = 0;
-int stop_test_traffic_pcap_loop = 0;
-pcap_t *handle;
-u_int32_t goalcfg_cr;
-
-void cr_pcap_interrupt_alarm_handler(int a)
+/* The probe packets of a NEL time-slot were also counted as COMM packets.
+ * Subtract them from the COM counter; returns the number subtracted. */
+int cr_NEL_account(const nel_cfg_t *cfg, int test_pkt_cnt, int *com_pkt_cnt)
 {
-	extern int recv_through_warden_pkt_cnt;
+	int sub = 0;
+	int nel_pkts = (int) cfg->nel_pkts_p_prot;
 	
-	pcap_breakloop(handle);
-	stop_test_traffic_pcap_loop = 1; /* stop pcap_dispatch() loop */
-	if (test_traffic_pkt_cnt >= 1) {
-	    fprintf(stderr, "\tsuccess. Received %i test packets for this CC type!\n", test_traffic_pkt_cnt);
-	    
-	    /* If the NEL thread received more than NUM_NEL_TESTPKT_SND_PKTS_P_PROT test packets:
-	     * subtract the NUM_NEL_TESTPKT_SND_PKTS_P_PROT test packets also from the COM phase. */
-	    if (recv_through_warden_pkt_cnt >= NUM_NEL_TESTPKT_SND_PKTS_P_PROT
-	        /*&& (test_traffic_pkt_cnt - NUM_NEL_TESTPKT_SND_PKTS_P_PROT)*/) {
-		    fprintf(stderr, "\t\tNEL thread: subtracting %i packets from peer thread's COM counter\n",
-		    			min(test_traffic_pkt_cnt, NUM_NEL_TESTPKT_SND_PKTS_P_PROT));
-		    recv_through_warden_pkt_cnt -= min(test_traffic_pkt_cnt, NUM_NEL_TESTPKT_SND_PKTS_P_PROT);
-	    }
+	/* If the NEL thread received more than nel_pkts_per_proto test packets:
+	 * subtract the nel_pkts_per_proto test packets also from the COM phase. */
+	if (test_pkt_cnt >= 1 && *com_pkt_cnt >= nel_pkts
+	    /*&& (test_traffic_pkt_cnt - nel_pkts)*/) {
+		sub = min(test_pkt_cnt, nel_pkts);
+		*com_pkt_cnt -= sub;
+	}
+	return sub;
+}
+
+/* RFC 6298, sec. 2 */
+static void cr_rtt_add(nel_rtt_t *rtt, double r)
+{
+	if (rtt->samples++ == 0) {
+		rtt->srtt = r;
+		rtt->rttvar = r / 2;
 	} else {
-	    fprintf(stderr, "\ttimeout. Received 0 test packets for this CC type!\n");
+		rtt->rttvar = 0.75 * rtt->rttvar + 0.25 * fabs(rtt->srtt - r);
+		rtt->srtt = 0.875 * rtt->srtt + 0.125 * r;
+	}
+}
+
+/* add the measured announcement-to-capture time `r' of a probe at batch
+ * position `pos' (NEL_ANNOUNCE_POS()) to the estimators `rtt[NEL_ENGINES]' */
+void cr_rtt_sample(nel_rtt_t *rtt, u_int32_t pos, double r)
+{
+	u_int32_t native = NEL_ANNOUNCE_NATIVE(pos);
+	u_int32_t scapy = NEL_ANNOUNCE_SCAPY(pos);
+	
+	if (scapy == 0 && native > 0) {
+		cr_rtt_add(&rtt[NEL_ENGINE_NATIVE], r / native);
+	} else if (native == 0 && scapy > 0) {
+		cr_rtt_add(&rtt[NEL_ENGINE_SCAPY], r / scapy);
+	} else if (scapy > 0 && rtt[NEL_ENGINE_NATIVE].samples > 0) {
+		/* mixed: the scapy-sent probes took what the native ones
+		 * do not explain */
+		r -= native * rtt[NEL_ENGINE_NATIVE].srtt;
+		if (r > 0)
+			cr_rtt_add(&rtt[NEL_ENGINE_SCAPY], r / scapy);
+	}
+}
+
+/* how long one probe sent in the way of `rtt' may take */
+static double cr_rtt_unit(const nel_rtt_t *rtt)
+{
+	return rtt->srtt + (4 * rtt->rttvar > CR_NEL_WAIT_MARGIN
+		? 4 * rtt->rttvar : CR_NEL_WAIT_MARGIN);
+}
+
+/* how long to wait for the probe packets of an announced protocol at batch
+ * position `pos' (NEL_ANNOUNCE_POS()) */
+double cr_rtt_timeout(const nel_rtt_t *rtt, u_int32_t pos, const nel_cfg_t *cfg)
+{
+	u_int32_t native = NEL_ANNOUNCE_NATIVE(pos);
+	u_int32_t scapy = NEL_ANNOUNCE_SCAPY(pos);
+	double timeout;
+	
+	/* no estimate for a way of sending the CS uses: wait for nel_wait */
+	if (!cfg->adaptive_wait || native + scapy == 0
+	    || (native > 0 && rtt[NEL_ENGINE_NATIVE].samples == 0)
+	    || (scapy > 0 && rtt[NEL_ENGINE_SCAPY].samples == 0))
+		return cfg->nel_wait;
+	timeout = native * cr_rtt_unit(&rtt[NEL_ENGINE_NATIVE])
+		+ scapy * cr_rtt_unit(&rtt[NEL_ENGINE_SCAPY]);
+	return (timeout < cfg->nel_wait ? timeout : cfg->nel_wait);
+}
+
+/* The CR runs in one thread: an epoll loop watches the listening socket,
+ * the feedback channels to the CSs, the capture of cr_measure.c and a
+ * timerfd for the end of the earliest probe time-slot. Each CS is served in
+ * its own session; the capture attributes the CC packets to the sessions by
+ * their source address and counts them per rule, so a probe only needs to
+ * compare the rule's counter at the start and the end of its time-slot and
+ * a CS can have one announcement outstanding per rule. */
+#define CR_EV_LISTEN		0x01
+#define CR_EV_FEEDBACK		0x02
+#define CR_EV_PCAP		0x03
+#define CR_EV_TIMER		0x04
+/* epoll data: event type + session id (not the index: a closed session's
+ * slot can be reused while events for it are still pending) */
+#define CR_EV(type, id)		((u_int64_t) (id) << 32 | (type))
+
+static int cr_epfd = -1;
+static int cr_listenfd = -1;
+static int cr_timerfd = -1;
+static cr_session_t *cr_sess[CR_MAX_SESSIONS];	/* NULL: unused */
+static int cr_nsess = 0;		/* active sessions */
+static u_int32_t cr_sess_id = 0;	/* sessions accepted so far */
+static u_int32_t cr_sess_done = 0;	/* sessions that completed */
+
+/* The active probes of all sessions are kept in a min-heap by deadline:
+ * the timer is armed from its head and only the active probes are visited
+ * when the capture advanced (cr_probe_check()). */
+typedef struct {
+	double		deadline;
+	cr_session_t	*s;
+	int		rule;
+} cr_heap_t;
+static cr_heap_t *cr_heap = NULL;
+static cr_heap_t *cr_due = NULL;	/* cr_probe_check(): completed probes */
+static int cr_nheap = 0, cr_heap_max = 0;
+
+/* max. feedback channel output queued for a CS that does not read */
+#define CR_WBUF_MAX		(64 * 1024)
+
+double cr_now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+static void cr_epoll_ctl(int op, int fd, u_int32_t ev_type, u_int32_t id)
+{
+	struct epoll_event ev;
+	
+	bzero(&ev, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = CR_EV(ev_type, id);
+	if (epoll_ctl(cr_epfd, op, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(1);
 	}
 }
 
-void pkt_handler_NEL(u_char *user, const struct pcap_pkthdr *h, const u_char *byte)
+/* watch the session's feedback channel for writability (`out') too */
+static void cr_epoll_out(cr_session_t *s, int out)
 {
-	 /* increment NEL phase probe packet counter */
-	test_traffic_pkt_cnt++;
+	struct epoll_event ev;
+	
+	bzero(&ev, sizeof(ev));
+	ev.events = EPOLLIN | (out ? EPOLLOUT : 0);
+	ev.data.u64 = CR_EV(CR_EV_FEEDBACK, s->id);
+	if (epoll_ctl(cr_epfd, EPOLL_CTL_MOD, s->fd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
 }
 
-int rc_chk_for_test_pkts(u_int32_t announced_proto)
+/* arm (or, with `sec' = 0, disarm) the time-slot timer */
+static void cr_timer_set(double sec)
 {
-	extern char *net_if;
-	int snapshot_len = 100;
-	char *filter_str = NULL;
-	int promisc = 1;
-	int timeout = 100; /* this prevents pcap from blocking for too long
-			   * (in case we switch back to pcap_loop, which I
-			   * should not because of side-effects) */
-	struct bpf_program filter;
-	char err_buf[PCAP_ERRBUF_SIZE];
-	struct sigaction sa;
+	struct itimerspec its;
 	
-	filter_str = ruleset[announced_proto][2];
-	stop_test_traffic_pcap_loop = 0;
-	test_traffic_pkt_cnt = 0; /* reset packet counter for test traffic */
+	bzero(&its, sizeof(its));
+	its.it_value.tv_sec = (time_t) sec;
+	its.it_value.tv_nsec = (long) ((sec - (time_t) sec) * 1.0e9);
+	if (sec > 0 && its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1; /* 0 would disarm */
+	if (timerfd_settime(cr_timerfd, 0, &its, NULL) == -1) {
+		perror("timerfd_settime");
+		exit(1);
+	}
+}
+
+static void cr_heap_set(int i, cr_heap_t e)
+{
+	cr_heap[i] = e;
+	e.s->probe[e.rule].heap = i;
+}
+
+static void cr_heap_up(int i)
+{
+	cr_heap_t e = cr_heap[i];
 	
-	if ((handle = pcap_open_live(net_if, snapshot_len, promisc, timeout,
-	    err_buf)) == NULL) {
-	    	fprintf(stderr, "pcap_open_live() error in cr.c!\n");
-		perror("pcap_open_live");
-		sleep(1);
-		return 0;
+	while (i > 0 && cr_heap[(i - 1) / 2].deadline > e.deadline) {
+		cr_heap_set(i, cr_heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
 	}
+	cr_heap_set(i, e);
+}
+
+static void cr_heap_down(int i)
+{
+	cr_heap_t e = cr_heap[i];
+	int c;
 	
-	if (pcap_compile(handle, &filter, filter_str, 0,
-	    PCAP_NETMASK_UNKNOWN) != 0) {
-	    	fprintf(stderr, "pcap_compile() error in cr.c!\n");
-		pcap_perror(handle, "pcap_compile in CR");
-		sleep(1);
-		return 0;
+	while ((c = 2 * i + 1) < cr_nheap) {
+		if (c + 1 < cr_nheap && cr_heap[c + 1].deadline < cr_heap[c].deadline)
+			c++;
+		if (cr_heap[c].deadline >= e.deadline)
+			break;
+		cr_heap_set(i, cr_heap[c]);
+		i = c;
 	}
-	if (pcap_setfilter(handle, &filter) == -1) {
-		perror("pcap_setfilter");
-		fprintf(stderr, "pcap_setfilter() error in cr.c!\n");
-		sleep(1);
-		return 0;
+	cr_heap_set(i, e);
+}
+
+/* add the session's (just armed) probe of `rule' to the deadline heap */
+static void cr_heap_add(cr_session_t *s, int rule)
+{
+	if (cr_nheap == cr_heap_max) {
+		cr_heap_max = (cr_heap_max ? 2 * cr_heap_max : 64);
+		if ((cr_heap = realloc(cr_heap, cr_heap_max * sizeof(cr_heap_t))) == NULL
+		    || (cr_due = realloc(cr_due, cr_heap_max * sizeof(cr_heap_t))) == NULL) {
+			fprintf(stderr, "ERR: memory alloc (realloc())\n");
+			exit(1);
+		}
 	}
+	cr_heap[cr_nheap].deadline = s->probe[rule].deadline;
+	cr_heap[cr_nheap].s = s;
+	cr_heap[cr_nheap].rule = rule;
+	cr_heap_up(cr_nheap++);
+}
+
+/* remove the probe at position `i' from the deadline heap */
+static void cr_heap_del(int i)
+{
+	if (--cr_nheap == i)
+		return;
+	cr_heap_set(i, cr_heap[cr_nheap]);
+	if (i > 0 && cr_heap[(i - 1) / 2].deadline > cr_heap[i].deadline)
+		cr_heap_up(i);
+	else
+		cr_heap_down(i);
+}
+
+/* let the timer expire at the earliest deadline of all active probes */
+static void cr_timer_update(void)
+{
+	double left;
+	
+	if (cr_nheap == 0) {
+		cr_timer_set(0);
+		return;
+	}
+	left = cr_heap[0].deadline - cr_now();
+	cr_timer_set(left > 0 ? left : 1.0e-9);
+}
+
+/* the session whose CC packets have source address `src'. Packets with
+ * another source address (e.g. rules that forge it) belong to the only
+ * session if there is just one (CSs whose configuration message did not
+ * arrive yet are not counted). Returns NULL if the packet cannot be
+ * attributed or its session did not start measuring yet. */
+cr_session_t *cr_session_of(struct in_addr src)
+{
+	cr_session_t *only = NULL;
+	int i, n = 0;
 	
-	fprintf(stderr, "waiting for test pkts ... ");
-	alarm(CR_NEL_TESTPKT_WAITING_TIME);
-	/* reset alarm flags here, just in case, i.e. to prevent that SA_RESTART
-	 * is set and we receive unexpected side-effects when interrupting
-	 * pcap_dispatch() or pcap_loop() */
-	sa.sa_flags = 0; // never use: SA_RESTART;
-	sigaction(SIGALRM, &sa, NULL);
-	signal(SIGALRM, cr_pcap_interrupt_alarm_handler);
-	/* make pcap non-blocking so that pcap_dispatch() always returns
-	 * immediately */
-	if (pcap_setnonblock(handle, 1, err_buf) == -1) {
-		fprintf(stderr, "pcap_setnonblock() error in cr.c!\n");
-		perror("pcap_setnonblock()");
-		sleep(1);
-		return 0;
+	for (i = 0; i < CR_MAX_SESSIONS; i++) {
+		if (cr_sess[i] == NULL || !cr_sess[i]->configured)
+			continue;
+		if (cr_sess[i]->src.s_addr == src.s_addr)
+			return (cr_sess[i]->measuring ? cr_sess[i] : NULL);
+		only = cr_sess[i];
+		n++;
 	}
+	if (n == 1 && only->measuring)
+		return only;
+	return NULL;
+}
+
+/* the session in slot `i' (0..CR_MAX_SESSIONS-1), NULL if it is unused */
+cr_session_t *cr_session_slot(int i)
+{
+	return cr_sess[i];
+}
+
+/* a new session with counters and probes for all rules of the ruleset
+ * (no feedback channel yet) */
+cr_session_t *cr_session_new(void)
+{
+	cr_session_t *s = nel_calloc(1, sizeof(cr_session_t));
+	
+	s->fd = -1;
+	s->rule = nel_calloc(nel_nrules, sizeof(cr_rule_stat_t));
+	s->probe = nel_calloc(nel_nrules, sizeof(cr_probe_t));
+	return s;
+}
 
-	while(stop_test_traffic_pcap_loop == 0) {
-		pcap_dispatch(handle, 0 /* =inf */, pkt_handler_NEL, NULL);
-		usleep(10); /* prevent 100% cpu consumption */
+void cr_session_free(cr_session_t *s)
+{
+	free(s->rule);
+	free(s->probe);
+	free(s->wbuf);
+	free(s);
+}
+
+/* the active session with id `id', NULL if it was closed */
+static cr_session_t *cr_session_by_id(u_int32_t id)
+{
+	int i;
+	
+	for (i = 0; i < CR_MAX_SESSIONS; i++) {
+		if (cr_sess[i] != NULL && cr_sess[i]->id == id)
+			return cr_sess[i];
 	}
-	/* wait until timeout */
-	pcap_close(handle);
-	 /* return no. of recv'd test traffic pkts */
-	return test_traffic_pkt_cnt;
+	return NULL;
 }
 
-/* CR: receive announcements from sender + send back results (blocking I/O) */
-void *cr_NEL_handler(void *clifd_ptr)
+/* send the session's queued output as far as the socket takes it; a
+ * failed send marks the session for closing */
+static void cr_flush(cr_session_t *s)
 {
-	int n;
-	nel_proto_t buf;
-	int *clifd = (int *) clifd_ptr;
-	extern int global_measurement_start;
+	ssize_t n;
+	
+	while (s->wlen > 0 && !s->failed) {
+		n = send(s->fd, s->wbuf, s->wlen, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n < 0) {
+			perror("send()");
+			s->failed = 1;
+			break;
+		}
+		s->wlen -= n;
+		memmove(s->wbuf, s->wbuf + n, s->wlen);
+	}
+	if (s->pollout != (s->wlen > 0 && !s->failed)) {
+		s->pollout = !s->pollout;
+		cr_epoll_out(s, s->pollout);
+	}
+}
+
+/* send a message of the feedback channel to the session's CS. What the
+ * (non-blocking) socket does not take is queued and sent once it is
+ * writable again, so a CS that does not read cannot block the CR; if more
+ * than CR_WBUF_MAX bytes pile up, the session is marked for closing (the
+ * CR does not drop single messages: the CS would wait for them forever,
+ * and a partial message would break the framing). */
+static void cr_send(cr_session_t *s, u_int16_t type, u_int32_t seq,
+	u_int32_t announced_proto, u_int32_t result)
+{
+	nel_proto_t msg;
+	int queued = s->wlen;
+	
+	if (s->failed)
+		return;
+	if (s->wlen + (int) sizeof(msg) > CR_WBUF_MAX) {
+		fprintf(stderr, "session %u: CS does not read the feedback "
+			"channel.\n", s->id);
+		s->failed = 1;
+		return;
+	}
+	nel_msg_encode(&msg, type, seq, announced_proto, result);
+	while (s->wlen + (int) sizeof(msg) > s->wsize) {
+		s->wsize = (s->wsize ? 2 * s->wsize : 16 * sizeof(msg));
+		if ((s->wbuf = realloc(s->wbuf, s->wsize)) == NULL) {
+			fprintf(stderr, "ERR: memory alloc (realloc())\n");
+			exit(1);
+		}
+	}
+	memcpy(s->wbuf + s->wlen, &msg, sizeof(msg));
+	s->wlen += sizeof(msg);
+	/* otherwise EPOLLOUT flushes */
+	if (queued == 0)
+		cr_flush(s);
+}
+
+/* CR: take over the CS's configuration (the `len' bytes of TLVs of its
+ * configuration message), so that the session uses the same nel_wait,
+ * req_pkts, ... as its CS. Returns -1 if the configuration is invalid. */
+static int cr_session_config(cr_session_t *s, const u_int8_t *tlvs, int len)
+{
+	nel_cfg_t cfg = nel_cfg;
+	char src[INET_ADDRSTRLEN];
+	const char *err;
+	int i;
+	
+	if (cfg_decode(&cfg, tlvs, len) != 0) {
+		fprintf(stderr, "invalid configuration message from CS.\n");
+		return -1;
+	}
+	if ((err = cfg_check(&cfg)) != NULL) {
+		fprintf(stderr, "invalid configuration from CS: %s.\n", err);
+		return -1;
+	}
+	/* the announcements refer to the rules of the CS's ruleset */
+	if (cfg.rules != nel_nrules || cfg.rules_digest != nel_rules_digest) {
+		fprintf(stderr, "CS uses another ruleset (%u rules, digest %016"
+			PRIx64 "; ours: %u rules, digest %016" PRIx64 ").\n",
+			cfg.rules, cfg.rules_digest, nel_nrules, nel_rules_digest);
+		return -1;
+	}
+	s->cfg = cfg;
+	/* the CS's warden-link address, or the feedback channel's */
+	s->src.s_addr = (s->cfg.src_addr != 0 ? htonl(s->cfg.src_addr)
+		: s->peer.s_addr);
+	for (i = 0; i < CR_MAX_SESSIONS; i++) {
+		if (cr_sess[i] != NULL && cr_sess[i] != s && cr_sess[i]->configured
+		    && cr_sess[i]->src.s_addr == s->src.s_addr) {
+			fprintf(stderr, "session %u: a CS with warden-link address %s "
+				"is already served, closing.\n", s->id, inet_ntoa(s->src));
+			return -1;
+		}
+	}
+	s->configured = 1;
+	inet_ntop(AF_INET, &s->src, src, sizeof(src));
+	fprintf(stderr, "session %u: CS %s connected (warden-link address %s): "
+		"nel_wait=%u, req_pkts=%u, nel_pkts_per_proto=%u\n", s->id,
+		inet_ntoa(s->peer), src, s->cfg.nel_wait,
+		s->cfg.req_pkts, s->cfg.nel_pkts_p_prot);
+	cr_capture_sessions();
+	return 0;
+}
+
+/* close the session's feedback channel and free it */
+static void cr_session_close(cr_session_t *s)
+{
+	int i;
+	
+	cr_epoll_ctl(EPOLL_CTL_DEL, s->fd, CR_EV_FEEDBACK, 0);
+	close(s->fd);
+	for (i = 0; s->probes_active > 0 && i < nel_nrules; i++) {
+		if (s->probe[i].active) {
+			cr_heap_del(s->probe[i].heap);
+			s->probes_active--;
+		}
+	}
+	for (i = 0; i < CR_MAX_SESSIONS; i++) {
+		if (cr_sess[i] == s)
+			cr_sess[i] = NULL;
+	}
+	cr_session_free(s);
+	/* accept again if all sessions were in use */
+	if (cr_nsess-- == CR_MAX_SESSIONS)
+		cr_epoll_ctl(EPOLL_CTL_ADD, cr_listenfd, CR_EV_LISTEN, 0);
+	cr_timer_update();
+	cr_capture_sessions();
+}
+
+/* the session received req_pkts CC packets: report and close it (`s' is
+ * freed) */
+void cr_session_done(cr_session_t *s)
+{
+	s->t_end = cr_now();
+	cr_measure_report(s);
+	cr_session_close(s);
+	if (++cr_sess_done == nel_cfg.sessions) {
+		fflush(stderr);fflush(stdout);
+		exit(0);
+	}
+}
+
+/* close the sessions whose output was lost (see cr_send()); deferred to the
+ * event loop, as the senders of the messages still use the session */
+static void cr_reap(void)
+{
+	int i;
+	
+	for (i = 0; i < CR_MAX_SESSIONS; i++) {
+		if (cr_sess[i] != NULL && cr_sess[i]->failed) {
+			fprintf(stderr, "session %u: feedback channel failed, "
+				"closing.\n", cr_sess[i]->id);
+			cr_session_close(cr_sess[i]);
+		}
+	}
+}
+
+/* a CS connected: start a new session. Its feedback channel is
+ * non-blocking; the configuration message is processed by cr_feedback()
+ * once it arrived completely. */
+static void cr_accept(void)
+{
+	struct sockaddr_in cli;
+	socklen_t len = sizeof(cli);
+	cr_session_t *s;
+	int slot, fd;
+	
+	if ((fd = accept4(cr_listenfd, (struct sockaddr *)&cli, &len,
+	    SOCK_NONBLOCK)) < 0) {
+		perror("accept()");
+		return;
+	}
+	for (slot = 0; slot < CR_MAX_SESSIONS && cr_sess[slot] != NULL; slot++)
+		;
+	if (slot == CR_MAX_SESSIONS) {
+		close(fd);
+		return;
+	}
+	s = cr_session_new();
+	s->fd = fd;
+	s->id = cr_sess_id++;
+	s->peer = cli.sin_addr;
+	cr_sess[slot] = s;
+	cr_epoll_ctl(EPOLL_CTL_ADD, fd, CR_EV_FEEDBACK, s->id);
+	/* serve at most CR_MAX_SESSIONS CSs at a time */
+	if (++cr_nsess == CR_MAX_SESSIONS)
+		cr_epoll_ctl(EPOLL_CTL_DEL, cr_listenfd, CR_EV_LISTEN, 0);
+}
+
+/* the session's announcement `msg': start its time-slot */
+static void cr_announcement(cr_session_t *s, const nel_proto_t *msg)
+{
+	cr_probe_t *p;
+	double timeout;
+	u_int32_t id;
+	int rule;
+	
+	if (msg->type != NEL_MSG_ANNOUNCE
+	    || (rule = ruleset_lookup(msg->announced_proto)) < 0
+	    || s->probe[rule].active) {
+		fprintf(stderr, "session %u: invalid announcement (type=%u, seq=%u, "
+			"proto=%u) from CS, closing.\n", s->id, msg->type, msg->seq,
+			msg->announced_proto);
+		cr_session_close(s);
+		return;
+	}
+	fprintf(stderr, "session %u: protocol announcement #%u for "
+		"proto=='%s' (ar-elem=%i)\n", s->id, msg->seq,
+		nel_rules[rule].name, rule);
+	/* packets captured before the announcement do not belong to it; they
+	 * may also complete (and free) the session */
+	id = s->id;
+	cr_pcap_dispatch();
+	if ((s = cr_session_by_id(id)) == NULL)
+		return;
+	/* In case we do not measure time so far,
+	 * start measuring time NOW. */
+	if (!s->measuring) {
+		s->measuring = 1;
+		s->t_start = cr_now();
+		printf("session %u: Starting timer: 0.000\n", s->id);
+		cr_capture_sessions();
+	}
+	timeout = cr_rtt_timeout(s->rtt, msg->result, &s->cfg);
+	fprintf(stderr, "waiting for test pkts (max. %.3f sec)\n", timeout);
+	p = &s->probe[rule];
+	p->active = 1;
+	p->seq = msg->seq;
+	p->pos = msg->result;
+	p->start = s->rule[rule].recvd;
+	p->t0 = cr_now();
+	p->deadline = p->t0 + timeout;
+	/* COMM traffic of an already non-blocked protocol would complete the
+	 * probe before its probe packets arrive: only protocols that were
+	 * silent during the last time-slot length provide timing samples */
+	p->sample = (time(NULL) - s->rule[rule].last > s->cfg.nel_wait);
+	s->probes_active++;
+	cr_heap_add(s, rule);
+	cr_timer_update();
+	/* tell the CS that it can send the probe now */
+	cr_send(s, NEL_MSG_ARMED, msg->seq, msg->announced_proto, 0);
+}
+
+/* the session's feedback channel is readable: read what arrived and process
+ * the complete messages (first the configuration message, then the
+ * announcements). An incomplete message stays in the session's buffer
+ * until the rest arrives, so a slow CS cannot block the other sessions. */
+static void cr_feedback(cr_session_t *s)
+{
+	nel_cfgmsg_t hdr;
+	nel_proto_t msg;
+	u_int32_t id = s->id;
+	int n, len, off;
 	
 	while (1) {
-		if ((n = recv(*clifd, &buf, sizeof(buf), 0)) < 0) {
-			perror("recv()");
-			sleep(1);
-		} if (n == 0) {
-			fprintf(stderr, "%%");
-			sleep(1);
-		} else {
-			/* parse buffer */
-			fprintf(stderr, "received: protocol announcement for "
-				"proto=='%s' (ar-elem=%i), config=0x%X\n",
-				ruleset[buf.announced_proto][0],
-				buf.announced_proto, buf.goalcfg);
-			goalcfg_cr = buf.goalcfg; /* only required once but still updated in every iteration */
-			/* In case we do not measure time so far,
-			 * start measuring time NOW. */
-			global_measurement_start = 1;
+		n = recv(s->fd, s->rbuf + s->rlen, sizeof(s->rbuf) - s->rlen, 0);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n < 0)
+				perror("recv()");
+			fprintf(stderr, "session %u: CS closed the feedback channel.\n", s->id);
+			cr_session_close(s);
+			return;
 		}
-		
-		/* Check whether we receive the test packet(s) and send back
-		 * the result */
-		n = rc_chk_for_test_pkts(buf.announced_proto);
-		if (n) {
-			buf.result = RESULT_RECVD;
-		} else {
-			buf.result = RESULT_TIMEOUT;
+		s->rlen += n;
+		for (off = 0; ; off += len) {
+			if (!s->configured) {
+				if (s->rlen - off < (int) sizeof(hdr))
+					break;
+				memcpy(&hdr, s->rbuf + off, sizeof(hdr));
+				if (ntohl(hdr.magic) != NEL_CFGMSG_MAGIC) {
+					fprintf(stderr, "no configuration message received from CS "
+						"(different NEL version?).\n");
+					cr_session_close(s);
+					return;
+				}
+				if (ntohs(hdr.version) != NEL_CFGMSG_VERSION
+				    || ntohs(hdr.len) > NEL_CFGMSG_MAX) {
+					fprintf(stderr, "invalid configuration message from CS.\n");
+					cr_session_close(s);
+					return;
+				}
+				len = sizeof(hdr) + ntohs(hdr.len);
+				if (s->rlen - off < len)
+					break;
+				if (cr_session_config(s, s->rbuf + off + sizeof(hdr),
+				    ntohs(hdr.len)) != 0) {
+					cr_session_close(s);
+					return;
+				}
+			} else {
+				len = sizeof(msg);
+				if (s->rlen - off < len)
+					break;
+				if (nel_msg_decode(s->rbuf + off, &msg) != 0) {
+					fprintf(stderr, "session %u: invalid message from CS, "
+						"closing.\n", s->id);
+					cr_session_close(s);
+					return;
+				}
+				cr_announcement(s, &msg);
+				/* the announcement may have completed (and freed) the
+				 * session */
+				if ((s = cr_session_by_id(id)) == NULL)
+					return;
+			}
 		}
-		if (!send(*clifd, &buf, sizeof(buf), 0)) {
-			perror("send()");
-			sleep(1);
+		s->rlen -= off;
+		memmove(s->rbuf, s->rbuf + off, s->rlen);
+	}
+}
+
+/* the time-slot of the session's probe of `proto' is over: evaluate it and
+ * send back the result (the caller dispatched the capture) */
+static void cr_probe_verdict(cr_session_t *s, u_int32_t proto)
+{
+	int test_traffic_pkt_cnt, sub;
+	u_int32_t result;
+	cr_probe_t *p = &s->probe[proto];
+	
+	p->active = 0;
+	cr_heap_del(p->heap);
+	s->probes_active--;
+	test_traffic_pkt_cnt = (int) (s->rule[proto].recvd - p->start);
+	cr_rule_probed(s, proto, test_traffic_pkt_cnt);
+	
+	fprintf(stderr, "session %u: announcement #%u (proto=%u):", s->id, p->seq, proto);
+	if (test_traffic_pkt_cnt >= 1) {
+		fprintf(stderr, "\tsuccess. Received %i test packets for this CC type!\n", test_traffic_pkt_cnt);
+		if ((sub = cr_NEL_account(&s->cfg, test_traffic_pkt_cnt, &s->recvd)) > 0) {
+			fprintf(stderr, "\t\tNEL thread: subtracting %i packets from peer thread's COM counter\n",
+				sub);
 		}
-		
-		bzero(&buf, sizeof(buf));
+		result = RESULT_RECVD;
+	} else {
+		fprintf(stderr, "\ttimeout. Received 0 test packets for this CC type!\n");
+		result = RESULT_TIMEOUT;
 	}
+	cr_send(s, NEL_MSG_RESULT, p->seq, nel_rules[proto].id, result);
+}
 
-	return NULL;
+/* evaluate the probes whose time-slot is over and (early completion) those
+ * whose probe packets all arrived */
+static void cr_probe_check(void)
+{
+	cr_session_t *s;
+	double now;
+	int i, j, n;
+	
+	/* count what was captured until now */
+	cr_pcap_dispatch();
+	now = cr_now();
+	/* the heap holds all active probes; collect the complete ones first,
+	 * their verdicts reorder it */
+	for (i = n = 0; i < cr_nheap; i++) {
+		s = cr_heap[i].s;
+		j = cr_heap[i].rule;
+		if (s->cfg.adaptive_wait
+		    && s->rule[j].recvd - s->probe[j].start >= s->cfg.nel_pkts_p_prot)
+			cr_due[n++] = cr_heap[i];
+	}
+	for (i = 0; i < n; i++) {
+		s = cr_due[i].s;
+		j = cr_due[i].rule;
+		if (s->probe[j].sample)
+			cr_rtt_sample(s->rtt, s->probe[j].pos,
+				now - s->probe[j].t0);
+		cr_probe_verdict(s, j);
+	}
+	/* the time-slots that are over */
+	while (cr_nheap > 0 && cr_heap[0].deadline <= now)
+		cr_probe_verdict(cr_heap[0].s, cr_heap[0].rule);
+	cr_timer_update();
 }
 
+/* CR: serve the senders' announcements and count their CC packets */
+void cr_run(int listenfd)
+{
+	struct epoll_event ev[16];
+	u_int64_t expirations;
+	cr_session_t *s;
+	int i, n;
+	
+	cr_listenfd = listenfd;
+	if ((cr_epfd = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	if ((cr_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) {
+		perror("timerfd_create");
+		exit(1);
+	}
+	cr_epoll_ctl(EPOLL_CTL_ADD, cr_listenfd, CR_EV_LISTEN, 0);
+	cr_epoll_ctl(EPOLL_CTL_ADD, cr_timerfd, CR_EV_TIMER, 0);
+	cr_epoll_ctl(EPOLL_CTL_ADD, cr_pcap_fd(), CR_EV_PCAP, 0);
+	
+	while (1) {
+		if ((n = epoll_wait(cr_epfd, ev, sizeof(ev) / sizeof(ev[0]), -1)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (i = 0; i < n; i++) {
+			switch ((u_int32_t) ev[i].data.u64) {
+			case CR_EV_LISTEN:
+				cr_accept();
+				break;
+			case CR_EV_FEEDBACK:
+				/* the session may have been closed by an
+				 * earlier event of this round */
+				if ((s = cr_session_by_id((u_int32_t) (ev[i].data.u64 >> 32))) == NULL)
+					break;
+				if (ev[i].events & EPOLLOUT)
+					cr_flush(s);
+				if (ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+					cr_feedback(s);
+				break;
+			case CR_EV_PCAP:
+				cr_probe_check();
+				break;
+			case CR_EV_TIMER:
+				if (read(cr_timerfd, &expirations, sizeof(expirations)) > 0)
+					cr_probe_check();
+				break;
+			}
+			cr_reap();
+		}
+	}
+}
@@ -0,0 +1,972 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+
+/* eBPF counting: the CR's capture that copies no packet. The filter of
+ * every rule (compiled to classic BPF by libpcap) is translated to eBPF,
+ * and the resulting programs run in the kernel on an AF_PACKET socket of
+ * the warden link, one calling the next (tail calls). They run the
+ * combined filter, attribute a packet to a session by the source address
+ * (a hash map of the measuring sessions' addresses), run the filters of
+ * the rules and increment the counter of every matching rule of the
+ * session in an array map. The socket accepts no packet, i.e. it never
+ * queues one.
+ *
+ * The array (one row of nrules + 1 counters per session slot, plus a row
+ * for unattributed packets; the last counter of a row counts the packets
+ * that matched any rule) is mapped into the CR, which reads it every
+ * `ebpf_interval' ms and at every announcement, and adds the differences
+ * to its previous read to the sessions' counters. Time stamps of packets
+ * are thus only as precise as the interval.
+ *
+ * <linux/bpf.h> clashes with libpcap's `struct bpf_insn', so the few
+ * definitions needed are repeated here (they are kernel ABI). */
+
+typedef struct {
+	u_int8_t	code;
+	u_int8_t	regs;		/* dst (low nibble), src (high nibble) */
+	int16_t		off;
+	int32_t		imm;
+} cr_ebpf_insn_t;
+
+typedef union {
+	struct {			/* BPF_MAP_CREATE */
+		u_int32_t	map_type;
+		u_int32_t	key_size;
+		u_int32_t	value_size;
+		u_int32_t	max_entries;
+		u_int32_t	map_flags;
+	} map;
+	struct {			/* BPF_MAP_{UPDATE,DELETE}_ELEM */
+		u_int32_t	map_fd;
+		u_int32_t	pad;
+		u_int64_t	key;
+		u_int64_t	value;
+		u_int64_t	flags;
+	} elem;
+	struct {			/* BPF_PROG_LOAD */
+		u_int32_t	prog_type;
+		u_int32_t	insn_cnt;
+		u_int64_t	insns;
+		u_int64_t	license;
+		u_int32_t	log_level;
+		u_int32_t	log_size;
+		u_int64_t	log_buf;
+	} prog;
+	struct {			/* BPF_PROG_TEST_RUN */
+		u_int32_t	prog_fd;
+		u_int32_t	retval;
+		u_int32_t	data_size_in;
+		u_int32_t	data_size_out;
+		u_int64_t	data_in;
+		u_int64_t	data_out;
+	} test;
+	u_char		size[128];
+} cr_ebpf_attr_t;
+
+/* bpf(2) commands, map and program types */
+#define EBPF_MAP_CREATE		0
+#define EBPF_MAP_UPDATE_ELEM	2
+#define EBPF_MAP_DELETE_ELEM	3
+#define EBPF_PROG_LOAD		5
+#define EBPF_PROG_TEST_RUN	10
+#define EBPF_MAP_TYPE_HASH	1
+#define EBPF_MAP_TYPE_ARRAY	2
+#define EBPF_MAP_TYPE_PROG_ARRAY	3
+#define EBPF_F_MMAPABLE		(1U << 10)
+#define EBPF_PROG_TYPE_SOCKET_FILTER	1
+#ifndef SO_ATTACH_BPF
+#define SO_ATTACH_BPF		50
+#endif
+
+/* opcodes beyond classic BPF's (BPF_LD, BPF_W, BPF_ADD etc. are shared) */
+#define EBPF_ALU64		0x07
+#define EBPF_DW			0x18
+#define EBPF_ATOMIC		0xc0
+#define EBPF_MOV		0xb0
+#define EBPF_END		0xd0
+#define EBPF_TO_BE		0x08
+#define EBPF_JNE		0x50
+#define EBPF_CALL		0x80
+#define EBPF_EXIT		0x90
+#define EBPF_PSEUDO_MAP_FD	1
+#define EBPF_FN_MAP_LOOKUP_ELEM	1
+#define EBPF_FN_TAIL_CALL	12
+#define EBPF_FN_SKB_LOAD_BYTES	26
+
+/* registers: R0-R5 are clobbered by calls, R6-R9 are preserved */
+#define R0			0
+#define R1			1
+#define R2			2
+#define R3			3
+#define R4			4
+#define R_CTX			6	/* the packet (struct __sk_buff) */
+#define R_A			7	/* classic BPF's accumulator */
+#define R_X			8	/* classic BPF's index register */
+#define R_ROW			9	/* the session's first counter */
+#define R_FP			10
+
+/* stack: the bytes loaded from the packet, a map key and classic BPF's
+ * scratch memory M[] */
+#define FP_BUF			(-8)
+#define FP_KEY			(-16)
+#define FP_MEM(k)		(-20 - 4 * (k))
+#define FP_BOTTOM		FP_MEM(BPF_MEMWORDS - 1)
+
+/* struct __sk_buff; the stages pass the session's row and whether a rule
+ * matched in cb[] */
+#define SKB_LEN			0
+#define SKB_PKT_TYPE		4
+#define SKB_CB(i)		(48 + 4 * (i))
+#define CB_ROW			0
+#define CB_MATCHED		1
+
+#define EBPF_INSN_CHUNK		4096
+/* jumps span at most 32767 instructions: a larger combined filter is not
+ * run in front of the rules' filters */
+#define EBPF_GATE_MAX		2048
+#define EBPF_STAGE_MAX		16384	/* instructions of the rules' stages */
+#define EBPF_STAGES_MAX		33	/* tail calls: at most 33 in a row */
+#define EBPF_LOG_SIZE		(1024 * 1024)
+
+static struct {
+	int		fd;		/* AF_PACKET socket */
+	int		timer_fd;	/* ebpf_interval */
+	int		prog_fd;	/* attached program */
+	int		stages_fd;	/* the programs it calls */
+	int		cnt_fd, src_fd, row_fd;	/* maps */
+	u_int32_t	ncols;		/* counters per row: nrules + 1 */
+	volatile u_int64_t *cnt;	/* mapped counters */
+	size_t		cnt_size;
+	u_int64_t	*seen;		/* counters at the previous read */
+	u_int32_t	row;		/* default row (in the map `row_fd') */
+	struct {
+		int		active;
+		u_int32_t	id;
+		struct in_addr	src;
+	} slot[CR_MAX_SESSIONS];	/* the sessions known to the maps */
+	u_int32_t	nstages, insn_cnt;
+	u_int64_t	reads;
+} cr_ebpf = { .fd = -1, .timer_fd = -1, .prog_fd = -1, .stages_fd = -1,
+	      .cnt_fd = -1, .src_fd = -1, .row_fd = -1 };
+
+/* the program under construction; jumps refer to labels, which are
+ * resolved when all instructions were emitted */
+static struct {
+	cr_ebpf_insn_t	*insn;
+	u_int32_t	len, size;
+	int32_t		*label;		/* -> instruction, -1: not placed */
+	u_int32_t	nlabels, labels_size;
+	struct {
+		u_int32_t	at;
+		u_int32_t	label;
+	}		*fix;
+	u_int32_t	nfix, fix_size;
+} cr_prog;
+
+static void *cr_ebpf_grow(void *p, u_int32_t *size, size_t elem)
+{
+	*size = (*size == 0 ? EBPF_INSN_CHUNK : 2 * *size);
+	if ((p = realloc(p, *size * elem)) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (realloc())\n");
+		exit(1);
+	}
+	return p;
+}
+
+static void cr_emit(u_int8_t code, u_int8_t dst, u_int8_t src, int16_t off,
+	int32_t imm)
+{
+	if (cr_prog.len == cr_prog.size)
+		cr_prog.insn = cr_ebpf_grow(cr_prog.insn, &cr_prog.size,
+			sizeof(cr_ebpf_insn_t));
+	cr_prog.insn[cr_prog.len].code = code;
+	cr_prog.insn[cr_prog.len].regs = (u_int8_t) ((src << 4) | dst);
+	cr_prog.insn[cr_prog.len].off = off;
+	cr_prog.insn[cr_prog.len].imm = imm;
+	cr_prog.len++;
+}
+
+/* `n' new labels; returns the first */
+static u_int32_t cr_labels(u_int32_t n)
+{
+	u_int32_t first = cr_prog.nlabels;
+	
+	while (cr_prog.nlabels + n > cr_prog.labels_size)
+		cr_prog.label = cr_ebpf_grow(cr_prog.label, &cr_prog.labels_size,
+			sizeof(int32_t));
+	memset(cr_prog.label + first, 0xff, n * sizeof(int32_t));
+	cr_prog.nlabels += n;
+	return first;
+}
+
+static void cr_place(u_int32_t label)
+{
+	cr_prog.label[label] = (int32_t) cr_prog.len;
+}
+
+/* a jump to `label' (BPF_JA, or a conditional jump) */
+static void cr_jump(u_int8_t code, u_int8_t dst, u_int8_t src, int32_t imm,
+	u_int32_t label)
+{
+	if (cr_prog.nfix == cr_prog.fix_size)
+		cr_prog.fix = cr_ebpf_grow(cr_prog.fix, &cr_prog.fix_size,
+			sizeof(*cr_prog.fix));
+	cr_prog.fix[cr_prog.nfix].at = cr_prog.len;
+	cr_prog.fix[cr_prog.nfix].label = label;
+	cr_prog.nfix++;
+	cr_emit(code, dst, src, 0, imm);
+}
+
+/* -1 if a jump is out of the 16 bit range of eBPF's jumps */
+static int cr_resolve(void)
+{
+	u_int32_t i;
+	int32_t to, d;
+	
+	for (i = 0; i < cr_prog.nfix; i++) {
+		to = cr_prog.label[cr_prog.fix[i].label];
+		d = to - (int32_t) cr_prog.fix[i].at - 1;
+		if (to < 0 || d > INT16_MAX)
+			return -1;
+		cr_prog.insn[cr_prog.fix[i].at].off = (int16_t) d;
+	}
+	return 0;
+}
+
+static void cr_prog_free(void)
+{
+	free(cr_prog.insn);
+	free(cr_prog.label);
+	free(cr_prog.fix);
+	bzero(&cr_prog, sizeof(cr_prog));
+}
+
+static void cr_mov64(u_int8_t dst, u_int8_t src)
+{
+	cr_emit(EBPF_ALU64 | EBPF_MOV | BPF_X, dst, src, 0, 0);
+}
+
+static void cr_movk(u_int8_t dst, int32_t imm)
+{
+	cr_emit(BPF_ALU | EBPF_MOV | BPF_K, dst, 0, 0, imm);
+}
+
+static void cr_ld_map(u_int8_t dst, int fd)
+{
+	cr_emit(BPF_LD | EBPF_DW | BPF_IMM, dst, EBPF_PSEUDO_MAP_FD, 0, fd);
+	cr_emit(0, 0, 0, 0, 0);
+}
+
+/* R0 = the value of `key' (on the stack) in the map `fd'; jumps to `none'
+ * if there is none */
+static void cr_lookup(int fd, int16_t key, u_int32_t none)
+{
+	cr_ld_map(R1, fd);
+	cr_mov64(R2, R_FP);
+	cr_emit(EBPF_ALU64 | BPF_ADD | BPF_K, R2, 0, 0, key);
+	cr_emit(BPF_JMP | EBPF_CALL, 0, 0, 0, EBPF_FN_MAP_LOOKUP_ELEM);
+	cr_jump(BPF_JMP | BPF_JEQ | BPF_K, R0, 0, 0, none);
+}
+
+/* load `size' bytes at offset `k' (plus X if `ind') of the packet into
+ * FP_BUF; jumps to `fail' if the packet is too short */
+static void cr_load_bytes(int size, int ind, u_int32_t k, u_int32_t fail)
+{
+	cr_mov64(R1, R_CTX);
+	if (ind) {
+		cr_emit(BPF_ALU | EBPF_MOV | BPF_X, R2, R_X, 0, 0);
+		cr_emit(BPF_ALU | BPF_ADD | BPF_K, R2, 0, 0, (int32_t) k);
+	} else {
+		cr_movk(R2, (int32_t) k);
+	}
+	cr_mov64(R3, R_FP);
+	cr_emit(EBPF_ALU64 | BPF_ADD | BPF_K, R3, 0, 0, FP_BUF);
+	cr_emit(EBPF_ALU64 | EBPF_MOV | BPF_K, R4, 0, 0, size);
+	cr_emit(BPF_JMP | EBPF_CALL, 0, 0, 0, EBPF_FN_SKB_LOAD_BYTES);
+	cr_jump(BPF_JMP | EBPF_JNE | BPF_K, R0, 0, 0, fail);
+}
+
+/* counter `col' of the session's row += 1; leaves R1 = 1 */
+static void cr_count(u_int32_t col, u_int32_t done)
+{
+	cr_mov64(R1, R_ROW);
+	cr_emit(BPF_ALU | BPF_ADD | BPF_K, R1, 0, 0, (int32_t) col);
+	cr_emit(BPF_STX | BPF_MEM | BPF_W, R_FP, R1, FP_KEY, 0);
+	cr_lookup(cr_ebpf.cnt_fd, FP_KEY, done);
+	cr_emit(EBPF_ALU64 | EBPF_MOV | BPF_K, R1, 0, 0, 1);
+	cr_emit(BPF_STX | EBPF_ATOMIC | EBPF_DW, R0, R1, 0, BPF_ADD);
+}
+
+/* translate the classic BPF program `f' (libpcap's code for one filter);
+ * a packet it accepts continues at `match', others at `nomatch'. -1 if
+ * `f' uses what has no eBPF equivalent here (Linux' ancillary data) */
+static int cr_translate(const struct bpf_program *f, u_int32_t match,
+	u_int32_t nomatch)
+{
+	static const int size[] = { 4, 2, 1, 0 };	/* BPF_W, BPF_H, BPF_B */
+	const struct bpf_insn *p;
+	u_int32_t pc, l0, t, e;
+	u_int8_t reg;
+	
+	l0 = cr_labels(f->bf_len);
+	for (pc = 0; pc < f->bf_len; pc++) {
+		p = &f->bf_insns[pc];
+		cr_place(l0 + pc);
+		switch (BPF_CLASS(p->code)) {
+		case BPF_LD:
+		case BPF_LDX:
+			reg = (BPF_CLASS(p->code) == BPF_LD ? R_A : R_X);
+			switch (BPF_MODE(p->code)) {
+			case BPF_IMM:
+				cr_movk(reg, (int32_t) p->k);
+				break;
+			case BPF_LEN:
+				cr_emit(BPF_LDX | BPF_MEM | BPF_W, reg, R_CTX, SKB_LEN, 0);
+				break;
+			case BPF_MEM:
+				if (p->k >= BPF_MEMWORDS)
+					return -1;
+				cr_emit(BPF_LDX | BPF_MEM | BPF_W, reg, R_FP,
+					FP_MEM(p->k), 0);
+				break;
+			case BPF_ABS:
+			case BPF_IND:
+				/* negative offsets: ancillary data */
+				if (reg != R_A || p->k >= 0x80000000U
+				    || size[BPF_SIZE(p->code) >> 3] == 0)
+					return -1;
+				cr_load_bytes(size[BPF_SIZE(p->code) >> 3],
+					BPF_MODE(p->code) == BPF_IND, p->k, nomatch);
+				cr_emit(BPF_LDX | BPF_MEM | BPF_SIZE(p->code), R_A,
+					R_FP, FP_BUF, 0);
+				if (BPF_SIZE(p->code) != BPF_B)
+					cr_emit(BPF_ALU | EBPF_END | EBPF_TO_BE, R_A, 0, 0,
+						8 * size[BPF_SIZE(p->code) >> 3]);
+				break;
+			case BPF_MSH:	/* X = 4 * (P[k] & 0xf) */
+				if (reg != R_X || p->k >= 0x80000000U)
+					return -1;
+				cr_load_bytes(1, 0, p->k, nomatch);
+				cr_emit(BPF_LDX | BPF_MEM | BPF_B, R_X, R_FP, FP_BUF, 0);
+				cr_emit(BPF_ALU | BPF_AND | BPF_K, R_X, 0, 0, 0xf);
+				cr_emit(BPF_ALU | BPF_LSH | BPF_K, R_X, 0, 0, 2);
+				break;
+			default:
+				return -1;
+			}
+			break;
+		case BPF_ST:
+		case BPF_STX:
+			if (p->k >= BPF_MEMWORDS)
+				return -1;
+			cr_emit(BPF_STX | BPF_MEM | BPF_W, R_FP,
+				BPF_CLASS(p->code) == BPF_ST ? R_A : R_X, FP_MEM(p->k), 0);
+			break;
+		case BPF_ALU:
+			switch (BPF_OP(p->code)) {
+			case BPF_NEG:
+				cr_emit(BPF_ALU | BPF_NEG, R_A, 0, 0, 0);
+				break;
+			case BPF_DIV:
+			case BPF_MOD:
+				/* classic BPF rejects the packet on a division by 0 */
+				if (BPF_SRC(p->code) == BPF_X)
+					cr_jump(BPF_JMP | BPF_JEQ | BPF_K, R_X, 0, 0, nomatch);
+				else if (p->k == 0)
+					return -1;
+				/* FALLTHROUGH */
+			case BPF_ADD:
+			case BPF_SUB:
+			case BPF_MUL:
+			case BPF_OR:
+			case BPF_AND:
+			case BPF_XOR:
+			case BPF_LSH:
+			case BPF_RSH:
+				cr_emit(p->code, R_A, BPF_SRC(p->code) == BPF_X ? R_X : 0,
+					0, (int32_t) p->k);
+				break;
+			default:
+				return -1;
+			}
+			break;
+		case BPF_JMP:
+			if (BPF_OP(p->code) == BPF_JA) {
+				if (p->k >= f->bf_len - pc - 1)
+					return -1;
+				cr_jump(BPF_JMP | BPF_JA, 0, 0, 0, l0 + pc + 1 + p->k);
+				break;
+			}
+			if (pc + 1 + p->jt >= f->bf_len || pc + 1 + p->jf >= f->bf_len)
+				return -1;
+			t = l0 + pc + 1 + p->jt;
+			e = l0 + pc + 1 + p->jf;
+			if (BPF_SRC(p->code) == BPF_X) {
+				cr_jump(p->code, R_A, R_X, 0, t);
+			} else if (p->k < 0x80000000U) {
+				cr_jump(p->code, R_A, 0, (int32_t) p->k, t);
+			} else {
+				/* the immediate is sign-extended, A is not */
+				cr_movk(R1, (int32_t) p->k);
+				cr_jump(BPF_JMP | BPF_OP(p->code) | BPF_X, R_A, R1, 0, t);
+			}
+			if (p->jf != 0)
+				cr_jump(BPF_JMP | BPF_JA, 0, 0, 0, e);
+			break;
+		case BPF_RET:
+			switch (BPF_RVAL(p->code)) {
+			case BPF_K:
+				cr_jump(BPF_JMP | BPF_JA, 0, 0, 0, p->k ? match : nomatch);
+				break;
+			case BPF_A:
+			case BPF_X:
+				cr_jump(BPF_JMP | EBPF_JNE | BPF_K,
+					BPF_RVAL(p->code) == BPF_A ? R_A : R_X, 0, 0, match);
+				cr_jump(BPF_JMP | BPF_JA, 0, 0, 0, nomatch);
+				break;
+			default:
+				return -1;
+			}
+			break;
+		case BPF_MISC:
+			if (BPF_MISCOP(p->code) == BPF_TAX)
+				cr_emit(BPF_ALU | EBPF_MOV | BPF_X, R_X, R_A, 0, 0);
+			else
+				cr_emit(BPF_ALU | EBPF_MOV | BPF_X, R_A, R_X, 0, 0);
+			break;
+		default:
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int cr_bpf(int cmd, cr_ebpf_attr_t *attr)
+{
+	return (int) syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int cr_map_create(u_int32_t type, u_int32_t key_size,
+	u_int32_t value_size, u_int32_t max_entries, u_int32_t flags)
+{
+	cr_ebpf_attr_t attr;
+	
+	bzero(&attr, sizeof(attr));
+	attr.map.map_type = type;
+	attr.map.key_size = key_size;
+	attr.map.value_size = value_size;
+	attr.map.max_entries = max_entries;
+	attr.map.map_flags = flags;
+	return cr_bpf(EBPF_MAP_CREATE, &attr);
+}
+
+static int cr_map_update(int fd, u_int32_t key, u_int32_t value)
+{
+	cr_ebpf_attr_t attr;
+	
+	bzero(&attr, sizeof(attr));
+	attr.elem.map_fd = (u_int32_t) fd;
+	attr.elem.key = (u_int64_t) (uintptr_t) &key;
+	attr.elem.value = (u_int64_t) (uintptr_t) &value;
+	return cr_bpf(EBPF_MAP_UPDATE_ELEM, &attr);
+}
+
+static int cr_map_delete(int fd, u_int32_t key)
+{
+	cr_ebpf_attr_t attr;
+	
+	bzero(&attr, sizeof(attr));
+	attr.elem.map_fd = (u_int32_t) fd;
+	attr.elem.key = (u_int64_t) (uintptr_t) &key;
+	return cr_bpf(EBPF_MAP_DELETE_ELEM, &attr);
+}
+
+/* load the program again with the verifier's log, and print the reason
+ * why it refused the program */
+static void cr_ebpf_verifier_log(cr_ebpf_attr_t *attr, int err)
+{
+	static char log[EBPF_LOG_SIZE];
+	char *line;
+	int fd;
+	
+	if (err != EACCES && err != EINVAL)
+		return;
+	log[0] = '\0';
+	attr->prog.log_level = 1;
+	attr->prog.log_size = sizeof(log);
+	attr->prog.log_buf = (u_int64_t) (uintptr_t) log;
+	if ((fd = cr_bpf(EBPF_PROG_LOAD, attr)) >= 0)
+		close(fd);
+	log[sizeof(log) - 1] = '\0';
+	/* the reason is the last line before the statistics */
+	while ((line = strrchr(log, '\n')) != NULL
+	    && (line[1] == '\0' || strncmp(line + 1, "processed ", 10) == 0))
+		*line = '\0';
+	line = (line != NULL ? line + 1 : log);
+	if (*line != '\0')
+		fprintf(stderr, "verifier: %s\n", line);
+}
+
+/* load the program in cr_prog (and empty cr_prog); its fd, or -1 */
+static int cr_ebpf_load(void)
+{
+	cr_ebpf_attr_t attr;
+	int fd, err;
+	
+	if (cr_resolve() != 0) {
+		fprintf(stderr, "eBPF program: a jump is out of range.\n");
+		return -1;
+	}
+	bzero(&attr, sizeof(attr));
+	attr.prog.prog_type = EBPF_PROG_TYPE_SOCKET_FILTER;
+	attr.prog.insn_cnt = cr_prog.len;
+	attr.prog.insns = (u_int64_t) (uintptr_t) cr_prog.insn;
+	attr.prog.license = (u_int64_t) (uintptr_t) "GPL";
+	if ((fd = cr_bpf(EBPF_PROG_LOAD, &attr)) < 0) {
+		err = errno;
+		fprintf(stderr, "bpf(BPF_PROG_LOAD) of %u instructions: %s\n",
+			cr_prog.len, strerror(err));
+		cr_ebpf_verifier_log(&attr, err);
+	} else {
+		cr_ebpf.insn_cnt += cr_prog.len;
+	}
+	cr_prog.len = cr_prog.nlabels = cr_prog.nfix = 0;
+	return fd;
+}
+
+/* load the program in cr_prog as stage `i' */
+static int cr_ebpf_stage(u_int32_t i)
+{
+	int fd;
+	
+	if ((fd = cr_ebpf_load()) < 0)
+		return -1;
+	if (cr_map_update(cr_ebpf.stages_fd, i, (u_int32_t) fd) < 0) {
+		perror("bpf(BPF_MAP_UPDATE_ELEM)");
+		close(fd);
+		return -1;
+	}
+	close(fd);	/* the map holds the program */
+	cr_ebpf.nstages++;
+	return 0;
+}
+
+/* a stage starts with the packet in R_CTX and zeroed scratch memory */
+static void cr_stage_begin(void)
+{
+	int16_t off;
+	
+	cr_mov64(R_CTX, R1);
+	cr_emit(EBPF_ALU64 | EBPF_MOV | BPF_K, R0, 0, 0, 0);
+	for (off = FP_BOTTOM; off < FP_MEM(0); off += 8)
+		cr_emit(BPF_STX | BPF_MEM | EBPF_DW, R_FP, R0, off, 0);
+}
+
+/* the socket accepts no packet */
+static void cr_stage_exit(void)
+{
+	cr_emit(EBPF_ALU64 | EBPF_MOV | BPF_K, R0, 0, 0, 0);
+	cr_emit(BPF_JMP | EBPF_EXIT, 0, 0, 0, 0);
+}
+
+/* continue with stage `next' */
+static void cr_stage_next(u_int32_t next)
+{
+	cr_mov64(R1, R_CTX);
+	cr_ld_map(R2, cr_ebpf.stages_fd);
+	cr_movk(R3, (int32_t) next);
+	cr_emit(BPF_JMP | EBPF_CALL, 0, 0, 0, EBPF_FN_TAIL_CALL);
+	cr_stage_exit();
+}
+
+/* The programs: the one attached to the socket skips our own packets on
+ * loopback and calls stage 0, which runs the combined filter and finds the
+ * session's row. The next stages run the filters of as many rules as fit
+ * into EBPF_STAGE_MAX instructions, and the last one counts the packet
+ * for `any rule'. (The kernel charges the attached program to the socket's
+ * option memory, optmem_max, and loads programs of some 100k instructions
+ * at most.) Returns the attached program, or -1. */
+static int cr_ebpf_build(const struct bpf_program *combined, int dlt,
+	int loopback)
+{
+	u_int32_t l_attr, l_rules, l_none, l_rule, stage = 0, i;
+	int linkoff = (dlt == DLT_EN10MB ? 14 : 0);
+	
+	/* stage 0: non-CC traffic leaves after the combined filter */
+	cr_stage_begin();
+	l_attr = cr_labels(1);
+	l_rules = cr_labels(1);
+	l_none = cr_labels(1);
+	if (combined->bf_len <= EBPF_GATE_MAX) {
+		if (cr_translate(combined, l_attr, l_none) != 0) {
+			fprintf(stderr, "the combined filter cannot be run as eBPF "
+				"program.\n");
+			return -1;
+		}
+		cr_place(l_none);
+		cr_stage_exit();
+	}
+	/* the session's row: by the source address, else the default row */
+	cr_place(l_attr);
+	cr_emit(EBPF_ALU64 | EBPF_MOV | BPF_K, R_ROW, 0, 0,
+		CR_MAX_SESSIONS * cr_ebpf.ncols);
+	cr_emit(BPF_ST | BPF_MEM | BPF_W, R_FP, 0, FP_KEY, 0);
+	cr_lookup(cr_ebpf.row_fd, FP_KEY, l_rules);
+	cr_emit(BPF_LDX | BPF_MEM | BPF_W, R_ROW, R0, 0, 0);
+	cr_load_bytes(1, 0, linkoff, l_rules);
+	cr_emit(BPF_LDX | BPF_MEM | BPF_B, R1, R_FP, FP_BUF, 0);
+	cr_emit(BPF_ALU | BPF_RSH | BPF_K, R1, 0, 0, 4);
+	cr_jump(BPF_JMP | EBPF_JNE | BPF_K, R1, 0, 4, l_rules);
+	cr_load_bytes(4, 0, linkoff + 12, l_rules);
+	cr_lookup(cr_ebpf.src_fd, FP_BUF, l_rules);
+	cr_emit(BPF_LDX | BPF_MEM | BPF_W, R_ROW, R0, 0, 0);
+	cr_place(l_rules);
+	cr_emit(BPF_STX | BPF_MEM | BPF_W, R_CTX, R_ROW, SKB_CB(CB_ROW), 0);
+	cr_emit(EBPF_ALU64 | EBPF_MOV | BPF_K, R1, 0, 0, 0);
+	cr_emit(BPF_STX | BPF_MEM | BPF_W, R_CTX, R1, SKB_CB(CB_MATCHED), 0);
+	cr_stage_next(stage + 1);
+	if (cr_ebpf_stage(stage++) != 0)
+		return -1;
+	
+	/* the rules */
+	for (i = 0; i < nel_nrules; stage++) {
+		if (stage == EBPF_STAGES_MAX) {
+			fprintf(stderr, "the filters of the rules need more than %u "
+				"eBPF programs.\n", EBPF_STAGES_MAX - 1);
+			return -1;
+		}
+		cr_stage_begin();
+		cr_emit(BPF_LDX | BPF_MEM | BPF_W, R_ROW, R_CTX, SKB_CB(CB_ROW), 0);
+		do {
+			l_rule = cr_labels(2);
+			if (cr_translate(cr_rule_filter(i), l_rule, l_rule + 1) != 0) {
+				fprintf(stderr, "rule %u: its filter cannot be run as "
+					"eBPF program.\n", nel_rules[i].id);
+				return -1;
+			}
+			cr_place(l_rule);
+			cr_count(i, l_rule + 1);
+			cr_emit(BPF_STX | BPF_MEM | BPF_W, R_CTX, R1,
+				SKB_CB(CB_MATCHED), 0);
+			cr_place(l_rule + 1);
+		} while (++i < nel_nrules && cr_prog.len < EBPF_STAGE_MAX);
+		if (i < nel_nrules) {
+			cr_stage_next(stage + 1);
+		} else {
+			l_none = cr_labels(1);
+			cr_emit(BPF_LDX | BPF_MEM | BPF_W, R0, R_CTX,
+				SKB_CB(CB_MATCHED), 0);
+			cr_jump(BPF_JMP | BPF_JEQ | BPF_K, R0, 0, 0, l_none);
+			cr_count(nel_nrules, l_none);
+			cr_place(l_none);
+			cr_stage_exit();
+		}
+		if (cr_ebpf_stage(stage) != 0)
+			return -1;
+	}
+	
+	/* the attached program */
+	cr_mov64(R_CTX, R1);
+	if (loopback) {
+		cr_emit(BPF_LDX | BPF_MEM | BPF_W, R0, R_CTX, SKB_PKT_TYPE, 0);
+		cr_emit(BPF_JMP | EBPF_JNE | BPF_K, R0, 0, 2, PACKET_OUTGOING);
+		cr_stage_exit();
+	}
+	cr_stage_next(0);
+	return cr_ebpf_load();
+}
+
+static void cr_ebpf_close(void)
+{
+	if (cr_ebpf.cnt != NULL)
+		munmap((void *) cr_ebpf.cnt, cr_ebpf.cnt_size);
+	cr_ebpf.cnt = NULL;
+	if (cr_ebpf.fd != -1)
+		close(cr_ebpf.fd);
+	if (cr_ebpf.prog_fd != -1)
+		close(cr_ebpf.prog_fd);
+	if (cr_ebpf.stages_fd != -1)
+		close(cr_ebpf.stages_fd);
+	if (cr_ebpf.cnt_fd != -1)
+		close(cr_ebpf.cnt_fd);
+	if (cr_ebpf.src_fd != -1)
+		close(cr_ebpf.src_fd);
+	if (cr_ebpf.row_fd != -1)
+		close(cr_ebpf.row_fd);
+	cr_ebpf.fd = cr_ebpf.prog_fd = cr_ebpf.stages_fd = cr_ebpf.cnt_fd = -1;
+	cr_ebpf.src_fd = cr_ebpf.row_fd = -1;
+	free(cr_ebpf.seen);
+	cr_ebpf.seen = NULL;
+	cr_prog_free();
+}
+
+/* the maps and the programs for the link-layer type `dlt'; -1 if the
+ * kernel refuses them */
+static int cr_ebpf_setup(int dlt, int loopback)
+{
+	const struct bpf_program *combined;
+	pcap_t *dead;
+	u_int32_t nrows = CR_MAX_SESSIONS + 1;
+	
+	if ((dead = pcap_open_dead(dlt, CR_SNAPLEN)) == NULL) {
+		fprintf(stderr, "pcap_open_dead() error in cr_ebpf_init()\n");
+		exit(1);
+	}
+	combined = cr_pcap_compile(dead);
+	
+	cr_ebpf.ncols = nel_nrules + 1;
+	cr_ebpf.cnt_size = (size_t) nrows * cr_ebpf.ncols * sizeof(u_int64_t);
+	if ((cr_ebpf.cnt_fd = cr_map_create(EBPF_MAP_TYPE_ARRAY, sizeof(u_int32_t),
+	    sizeof(u_int64_t), nrows * cr_ebpf.ncols, EBPF_F_MMAPABLE)) < 0
+	    || (cr_ebpf.src_fd = cr_map_create(EBPF_MAP_TYPE_HASH,
+	    sizeof(u_int32_t), sizeof(u_int32_t), CR_MAX_SESSIONS, 0)) < 0
+	    || (cr_ebpf.row_fd = cr_map_create(EBPF_MAP_TYPE_ARRAY,
+	    sizeof(u_int32_t), sizeof(u_int32_t), 1, 0)) < 0
+	    || (cr_ebpf.stages_fd = cr_map_create(EBPF_MAP_TYPE_PROG_ARRAY,
+	    sizeof(u_int32_t), sizeof(u_int32_t), EBPF_STAGES_MAX, 0)) < 0) {
+		perror("bpf(BPF_MAP_CREATE)");
+		cr_ebpf_close();
+		return -1;
+	}
+	if ((cr_ebpf.cnt = mmap(NULL, cr_ebpf.cnt_size, PROT_READ, MAP_SHARED,
+	    cr_ebpf.cnt_fd, 0)) == MAP_FAILED) {
+		perror("mmap(BPF_MAP_TYPE_ARRAY)");
+		cr_ebpf.cnt = NULL;
+		cr_ebpf_close();
+		return -1;
+	}
+	if ((cr_ebpf.seen = calloc((size_t) nrows * cr_ebpf.ncols,
+	    sizeof(u_int64_t))) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (calloc())\n");
+		exit(1);
+	}
+	/* until a session measures, packets are not attributed */
+	cr_ebpf.row = CR_MAX_SESSIONS * cr_ebpf.ncols;
+	if (cr_map_update(cr_ebpf.row_fd, 0, cr_ebpf.row) < 0) {
+		perror("bpf(BPF_MAP_UPDATE_ELEM)");
+		cr_ebpf_close();
+		return -1;
+	}
+	
+	if ((cr_ebpf.prog_fd = cr_ebpf_build(combined, dlt, loopback)) < 0) {
+		cr_ebpf_close();
+		return -1;
+	}
+	cr_prog_free();
+	return 0;
+}
+
+/* set up the counting; -1 if the kernel refuses the maps or the program
+ * (the CR then captures with libpcap) */
+int cr_ebpf_init(void)
+{
+	extern char *net_if;
+	struct itimerspec its;
+	int dlt, loopback;
+	
+	cr_ebpf.fd = cr_packet_socket(&dlt, &loopback);
+	if (cr_ebpf_setup(dlt, loopback) != 0)
+		return -1;
+	if (setsockopt(cr_ebpf.fd, SOL_SOCKET, SO_ATTACH_BPF, &cr_ebpf.prog_fd,
+	    sizeof(cr_ebpf.prog_fd)) < 0) {
+		perror("setsockopt(SO_ATTACH_BPF)");
+		cr_ebpf_close();
+		return -1;
+	}
+	cr_packet_bind(cr_ebpf.fd);
+	
+	if ((cr_ebpf.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+		perror("timerfd_create");
+		exit(1);
+	}
+	bzero(&its, sizeof(its));
+	its.it_value.tv_sec = its.it_interval.tv_sec = nel_cfg.ebpf_interval / 1000;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec =
+		(nel_cfg.ebpf_interval % 1000) * 1000000L;
+	if (timerfd_settime(cr_ebpf.timer_fd, 0, &its, NULL) < 0) {
+		perror("timerfd_settime");
+		exit(1);
+	}
+	fprintf(stderr, "counting on %s with %u eBPF programs of %u instructions "
+		"(counters read every %u ms).\n", net_if, cr_ebpf.nstages + 1,
+		cr_ebpf.insn_cnt, nel_cfg.ebpf_interval);
+	return 0;
+}
+
+/* tests/cr_check.c: the programs for raw IPv4 packets, without a socket;
+ * -1 if the kernel refuses them */
+int cr_ebpf_check_init(void)
+{
+	return cr_ebpf_setup(DLT_RAW, 0);
+}
+
+/* tests/cr_check.c: run the programs on the Ethernet frame `frame' of
+ * `len' bytes (BPF_PROG_TEST_RUN, which passes the packet from its IPv4
+ * header on). Sets hit[i] if rule i counted the packet and hit[nel_nrules]
+ * if any rule did; -1 if the kernel refuses the test run. */
+int cr_ebpf_check_run(const u_char *frame, u_int32_t len, u_char *hit)
+{
+	cr_ebpf_attr_t attr;
+	u_int32_t j, row = CR_MAX_SESSIONS * cr_ebpf.ncols;
+	u_int64_t c;
+	
+	bzero(&attr, sizeof(attr));
+	attr.test.prog_fd = (u_int32_t) cr_ebpf.prog_fd;
+	attr.test.data_in = (u_int64_t) (uintptr_t) frame;
+	attr.test.data_size_in = len;
+	if (cr_bpf(EBPF_PROG_TEST_RUN, &attr) < 0) {
+		perror("bpf(BPF_PROG_TEST_RUN)");
+		return -1;
+	}
+	for (j = 0; j < cr_ebpf.ncols; j++) {
+		c = __atomic_load_n(&cr_ebpf.cnt[row + j], __ATOMIC_RELAXED);
+		hit[j] = (c != cr_ebpf.seen[row + j]);
+		cr_ebpf.seen[row + j] = c;
+	}
+	return 0;
+}
+
+/* the timer expires every ebpf_interval ms */
+int cr_ebpf_fd(void)
+{
+	return cr_ebpf.timer_fd;
+}
+
+/* the counters of session slot `i' from now on start at their values */
+static void cr_ebpf_rebase(u_int32_t i)
+{
+	u_int32_t j, row = i * cr_ebpf.ncols;
+	
+	for (j = 0; j < cr_ebpf.ncols; j++)
+		cr_ebpf.seen[row + j] = __atomic_load_n(&cr_ebpf.cnt[row + j],
+			__ATOMIC_RELAXED);
+}
+
+/* add what the kernel counted since the last read to the sessions */
+void cr_ebpf_dispatch(void)
+{
+	struct timeval tv;
+	cr_session_t *s;
+	u_int64_t expired, c, d;
+	u_int32_t i, j, row;
+	double now;
+	
+	if (read(cr_ebpf.timer_fd, &expired, sizeof(expired)) < 0 && errno != EAGAIN)
+		perror("read(timerfd)");
+	cr_ebpf.reads++;
+	gettimeofday(&tv, NULL);
+	now = tv.tv_sec + tv.tv_usec / 1.0e6;
+	
+	row = CR_MAX_SESSIONS * cr_ebpf.ncols + nel_nrules;
+	c = __atomic_load_n(&cr_ebpf.cnt[row], __ATOMIC_RELAXED);
+	cr_unattributed += c - cr_ebpf.seen[row];
+	cr_ebpf.seen[row] = c;
+	
+	for (i = 0; i < CR_MAX_SESSIONS; i++) {
+		if (!cr_ebpf.slot[i].active || (s = cr_session_slot(i)) == NULL)
+			continue;
+		row = i * cr_ebpf.ncols;
+		for (j = 0; j < nel_nrules; j++) {
+			c = __atomic_load_n(&cr_ebpf.cnt[row + j], __ATOMIC_RELAXED);
+			if (c == cr_ebpf.seen[row + j])
+				continue;
+			s->rule[j].recvd += c - cr_ebpf.seen[row + j];
+			s->rule[j].last = now;
+			cr_ebpf.seen[row + j] = c;
+		}
+		c = __atomic_load_n(&cr_ebpf.cnt[row + nel_nrules], __ATOMIC_RELAXED);
+		if ((d = c - cr_ebpf.seen[row + nel_nrules]) == 0)
+			continue;
+		cr_ebpf.seen[row + nel_nrules] = c;
+		s->recvd += (int) d;
+		cr_progress(s);
+		
+		if (s->recvd >= s->cfg.req_pkts)
+			cr_session_done(s);
+	}
+}
+
+/* tell the program the addresses of the measuring sessions, and the row
+ * of the only session (cf. cr_session_of()) */
+void cr_ebpf_sessions(void)
+{
+	cr_session_t *s;
+	u_int32_t i, only = 0, row;
+	int n = 0;
+	
+	if (cr_ebpf.prog_fd == -1)
+		return;
+	for (i = 0; i < CR_MAX_SESSIONS; i++) {
+		if ((s = cr_session_slot(i)) != NULL && s->configured) {
+			n++;
+			only = i;
+		}
+		if (s != NULL && !s->measuring)
+			s = NULL;
+		if (cr_ebpf.slot[i].active && (s == NULL
+		    || s->id != cr_ebpf.slot[i].id)) {
+			if (cr_map_delete(cr_ebpf.src_fd,
+			    cr_ebpf.slot[i].src.s_addr) < 0)
+				perror("bpf(BPF_MAP_DELETE_ELEM)");
+			cr_ebpf.slot[i].active = 0;
+		}
+		if (s != NULL && !cr_ebpf.slot[i].active) {
+			cr_ebpf_rebase(i);
+			if (cr_map_update(cr_ebpf.src_fd, s->src.s_addr,
+			    i * cr_ebpf.ncols) < 0) {
+				perror("bpf(BPF_MAP_UPDATE_ELEM)");
+				exit(1);
+			}
+			cr_ebpf.slot[i].active = 1;
+			cr_ebpf.slot[i].id = s->id;
+			cr_ebpf.slot[i].src = s->src;
+		}
+	}
+	row = CR_MAX_SESSIONS * cr_ebpf.ncols;
+	if (n == 1 && cr_ebpf.slot[only].active)
+		row = only * cr_ebpf.ncols;
+	if (row != cr_ebpf.row) {
+		if (cr_map_update(cr_ebpf.row_fd, 0, row) < 0) {
+			perror("bpf(BPF_MAP_UPDATE_ELEM)");
+			exit(1);
+		}
+		cr_ebpf.row = row;
+	}
+}
+
+void cr_ebpf_report(void)
+{
+	if (cr_ebpf.prog_fd == -1)
+		return;
+	fprintf(stderr, "eBPF counting: %u programs of %u instructions for %u "
+		"rules; counters read %" PRIu64 " times (every %u ms and per "
+		"announcement).\n", cr_ebpf.nstages + 1, cr_ebpf.insn_cnt,
+		nel_nrules, cr_ebpf.reads, nel_cfg.ebpf_interval);
+}
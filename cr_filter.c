@@ -0,0 +1,555 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+
+/* The CR's combined filter: the OR of the filters of all rules, factored.
+ * Each rule's filter is split into its `and' terms. Terms that test the
+ * same header bytes (e.g. `ip[1] == 0x58' and `ip[1]==0x63') share a key;
+ * equal terms also share the value. The rules are then grouped by the key
+ * that most of them test and, within this group, by its value:
+ *
+ *   (ip[1]==0x58 and (ip[32] == 0)) or (ip[1]==0x63 and (ip[32] == 0x01))
+ *   or ... or <rules not testing ip[1], factored the same way>
+ *
+ * so that each byte is tested once on the way to a rule instead of once
+ * per rule, and a packet leaves the tree after the tests of its group.
+ * Terms that are no simple byte test (`src port 9999', masks) are only
+ * factored if they are equal. Filters with a top-level `or' are kept
+ * as one term. The expression only consists of the rules' own terms, so
+ * it accepts exactly what the flat OR of the rules accepts on packets that
+ * contain every byte the filters test. On a shorter packet, a BPF program
+ * rejects the packet at its first load beyond the end; as the factored
+ * filter tests the bytes in another order than the flat OR, either of both
+ * may then reject a packet that the other one accepts. */
+
+typedef struct {
+	const char	*text;		/* as written in the rule */
+	size_t		len;
+	char		*key;		/* tested bytes or normalized term */
+	char		*val;		/* tested value, "" for other terms */
+	int		used;		/* tested by an enclosing group */
+} cr_term_t;
+
+typedef struct {
+	cr_term_t	*term;
+	int		nterms;
+} cr_fterm_rule_t;
+
+/* key of a term in a rule of the rule set that is being grouped */
+typedef struct {
+	const char	*key;
+	int		rule;		/* index into the group */
+} cr_keyref_t;
+
+/* a rule testing the chosen key, and its term */
+typedef struct {
+	cr_term_t	*t;
+	int		rule;
+} cr_valref_t;
+
+/* the rules val[start..end-1] test the same value */
+typedef struct {
+	int		start, end;
+	int		rule;		/* first rule */
+} cr_run_t;
+
+typedef struct {
+	char		*s;
+	size_t		len, cap;
+} cr_fbuf_t;
+
+static void cr_fbuf_put(cr_fbuf_t *b, const char *s, size_t len)
+{
+	if (b->len + len + 1 > b->cap) {
+		while (b->len + len + 1 > b->cap)
+			b->cap = b->cap ? 2 * b->cap : 1024;
+		if ((b->s = realloc(b->s, b->cap)) == NULL) {
+			fprintf(stderr, "ERR: memory alloc (realloc())\n");
+			exit(1);
+		}
+	}
+	memcpy(b->s + b->len, s, len);
+	b->len += len;
+	b->s[b->len] = '\0';
+}
+
+#define CR_FBUF_PUTS(b, str)	cr_fbuf_put((b), (str), strlen(str))
+
+static char *cr_fstrndup(const char *s, size_t len)
+{
+	char *p;
+	
+	if ((p = strndup(s, len)) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (strndup())\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* symbolic offsets of pcap (see pcap-filter(7)) */
+static const char *cr_filter_offset(const char *off, size_t len)
+{
+	static const char *sym[][2] = {
+		{ "icmptype", "0" }, { "icmpcode", "1" }, { "tcpflags", "13" },
+		{ NULL, NULL }
+	};
+	int i;
+	
+	for (i = 0; sym[i][0] != NULL; i++) {
+		if (strlen(sym[i][0]) == len && strncmp(sym[i][0], off, len) == 0)
+			return sym[i][1];
+	}
+	return NULL;
+}
+
+/* number in C notation -> decimal; -1 if it is none */
+static int cr_filter_number(const char *s, size_t len, char *out, size_t outlen)
+{
+	char tmp[32], *end;
+	unsigned long v;
+	
+	if (len == 0 || len >= sizeof(tmp))
+		return -1;
+	memcpy(tmp, s, len);
+	tmp[len] = '\0';
+	errno = 0;
+	v = strtoul(tmp, &end, 0);
+	if (errno != 0 || *end != '\0' || !isdigit((unsigned char) tmp[0]))
+		return -1;
+	snprintf(out, outlen, "%lu", v);
+	return 0;
+}
+
+/* set key and value of a term; `proto[off] == value' and
+ * `proto[off:size] == value' test bytes, all others are compared as a
+ * whole (without white space) */
+static void cr_filter_classify(cr_term_t *t)
+{
+	const char *p = t->text, *end = t->text + t->len, *proto, *off, *q;
+	char key[96], num[32], offnum[32], val[32];
+	size_t protolen, offlen, size = 1;
+	const char *sym;
+	size_t i, n;
+	
+	proto = p;
+	while (p < end && (isalnum((unsigned char) *p)))
+		p++;
+	protolen = p - proto;
+	if (protolen == 0 || p == end || *p != '[')
+		goto other;
+	off = ++p;
+	while (p < end && *p != ']' && *p != ':')
+		p++;
+	offlen = p - off;
+	while (offlen > 0 && isspace((unsigned char) off[offlen - 1]))
+		offlen--;
+	if (p == end)
+		goto other;
+	if ((sym = cr_filter_offset(off, offlen)) != NULL)
+		snprintf(offnum, sizeof(offnum), "%s", sym);
+	else if (cr_filter_number(off, offlen, offnum, sizeof(offnum)) != 0)
+		goto other;
+	if (*p == ':') {
+		for (q = ++p; p < end && *p != ']'; p++)
+			;
+		if (p == end || cr_filter_number(q, p - q, num, sizeof(num)) != 0)
+			goto other;
+		size = strtoul(num, NULL, 10);
+	}
+	for (p++; p < end && isspace((unsigned char) *p); p++)
+		;
+	if (p < end && *p == '=')
+		p++;
+	else
+		goto other;
+	if (p < end && *p == '=')
+		p++;
+	while (p < end && isspace((unsigned char) *p))
+		p++;
+	if (cr_filter_number(p, end - p, val, sizeof(val)) != 0) {
+		/* symbolic values (e.g. icmp-echo) */
+		for (q = p; q < end && (isalnum((unsigned char) *q) || *q == '-'); q++)
+			;
+		if (q == p || q != end || end - p >= (ptrdiff_t) sizeof(val))
+			goto other;
+		memcpy(val, p, end - p);
+		val[end - p] = '\0';
+	}
+	snprintf(key, sizeof(key), "%.*s[%s:%zu]", (int) protolen, proto, offnum, size);
+	t->key = cr_fstrndup(key, strlen(key));
+	t->val = cr_fstrndup(val, strlen(val));
+	return;
+other:
+	if ((t->key = malloc(t->len + 1)) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (malloc())\n");
+		exit(1);
+	}
+	for (i = 0, n = 0; i < t->len; i++) {
+		if (isspace((unsigned char) t->text[i]))
+			continue;
+		/* `==' and `=' are the same */
+		if (t->text[i] == '=' && i + 1 < t->len && t->text[i + 1] == '=')
+			continue;
+		t->key[n++] = t->text[i];
+	}
+	t->key[n] = '\0';
+	t->val = cr_fstrndup("", 0);
+}
+
+/* strip white space and parentheses around the whole of [*s, *e) */
+static void cr_filter_trim(const char **s, const char **e)
+{
+	const char *p;
+	int depth, outer;
+	
+	for (;;) {
+		while (*s < *e && isspace((unsigned char) **s))
+			(*s)++;
+		while (*e > *s && isspace((unsigned char) (*e)[-1]))
+			(*e)--;
+		if (*e - *s < 2 || **s != '(' || (*e)[-1] != ')')
+			return;
+		/* does the first parenthesis close at the end? */
+		for (p = *s, depth = 0, outer = 1; p < *e - 1; p++) {
+			if (*p == '(')
+				depth++;
+			else if (*p == ')' && --depth == 0) {
+				outer = 0;
+				break;
+			}
+		}
+		if (!outer)
+			return;
+		(*s)++;
+		(*e)--;
+	}
+}
+
+/* the operator `op' (and, or) at p as a word? */
+static int cr_filter_word(const char *start, const char *p, const char *end,
+	const char *op)
+{
+	size_t len = strlen(op);
+	
+	if ((size_t) (end - p) < len || strncmp(p, op, len) != 0)
+		return 0;
+	if (p > start && !isspace((unsigned char) p[-1]) && p[-1] != ')')
+		return 0;
+	if (p + len < end && !isspace((unsigned char) p[len]) && p[len] != '(')
+		return 0;
+	return 1;
+}
+
+/* split the filter of a rule into its `and' terms */
+static void cr_filter_split(const char *filter, cr_fterm_rule_t *r)
+{
+	const char *s = filter, *e = filter + strlen(filter), *p, *t;
+	int depth = 0, cap = 4;
+	
+	cr_filter_trim(&s, &e);
+	/* a top-level `or' binds as strongly as `and': keep such a filter */
+	for (p = s; p < e; p++) {
+		if (*p == '(')
+			depth++;
+		else if (*p == ')')
+			depth--;
+		else if (depth == 0 && (cr_filter_word(s, p, e, "or")
+		    || (p[0] == '|' && p + 1 < e && p[1] == '|')))
+			break;
+	}
+	if ((r->term = calloc(cap, sizeof(cr_term_t))) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (calloc())\n");
+		exit(1);
+	}
+	r->nterms = 0;
+	if (s == e)
+		return;		/* empty filter: every packet */
+	if (p < e) {
+		r->term[0].text = s;
+		r->term[0].len = e - s;
+		cr_filter_classify(&r->term[0]);
+		r->nterms = 1;
+		return;
+	}
+	for (p = t = s, depth = 0; p <= e; p++) {
+		int sep = 0;
+		const char *ts, *te;
+		
+		if (p < e && *p == '(')
+			depth++;
+		else if (p < e && *p == ')')
+			depth--;
+		else if (p < e && depth == 0) {
+			if (cr_filter_word(s, p, e, "and"))
+				sep = 3;
+			else if (p[0] == '&' && p + 1 < e && p[1] == '&')
+				sep = 2;
+		}
+		if (!sep && p < e)
+			continue;
+		ts = t;
+		te = p;
+		cr_filter_trim(&ts, &te);
+		if (te > ts) {
+			if (r->nterms == cap) {
+				cap *= 2;
+				if ((r->term = realloc(r->term, cap * sizeof(cr_term_t))) == NULL) {
+					fprintf(stderr, "ERR: memory alloc (realloc())\n");
+					exit(1);
+				}
+			}
+			bzero(&r->term[r->nterms], sizeof(cr_term_t));
+			r->term[r->nterms].text = ts;
+			r->term[r->nterms].len = te - ts;
+			cr_filter_classify(&r->term[r->nterms]);
+			r->nterms++;
+		}
+		if (p < e)
+			p += sep - 1;
+		t = p + 1;
+	}
+}
+
+static int cr_keyref_cmp(const void *a, const void *b)
+{
+	const cr_keyref_t *x = a, *y = b;
+	int c;
+	
+	if ((c = strcmp(x->key, y->key)) != 0)
+		return c;
+	return x->rule - y->rule;
+}
+
+static int cr_valref_cmp(const void *a, const void *b)
+{
+	const cr_valref_t *x = a, *y = b;
+	int c;
+	
+	if ((c = strcmp(x->t->val, y->t->val)) != 0)
+		return c;
+	return x->rule - y->rule;
+}
+
+static int cr_run_cmp(const void *a, const void *b)
+{
+	return ((const cr_run_t *) a)->rule - ((const cr_run_t *) b)->rule;
+}
+
+/* number of unused terms of `r' */
+static int cr_filter_unused(const cr_fterm_rule_t *r)
+{
+	int i, n = 0;
+	
+	for (i = 0; i < r->nterms; i++)
+		n += !r->term[i].used;
+	return n;
+}
+
+/* the first unused term of `r' with key `key' */
+static cr_term_t *cr_filter_term(cr_fterm_rule_t *r, const char *key)
+{
+	int i;
+	
+	for (i = 0; i < r->nterms; i++) {
+		if (!r->term[i].used && strcmp(r->term[i].key, key) == 0)
+			return &r->term[i];
+	}
+	return NULL;
+}
+
+/* a byte test is one operand, other terms are put in parentheses */
+static void cr_filter_put_term(cr_fbuf_t *b, const cr_term_t *t)
+{
+	if (t->val[0] != '\0') {
+		cr_fbuf_put(b, t->text, t->len);
+	} else {
+		CR_FBUF_PUTS(b, "(");
+		cr_fbuf_put(b, t->text, t->len);
+		CR_FBUF_PUTS(b, ")");
+	}
+}
+
+/* emit the OR of the rules `rule[0..n-1]' (their unused terms) */
+static void cr_filter_factor(cr_fbuf_t *b, cr_fterm_rule_t **rule, int n)
+{
+	cr_keyref_t *ref;
+	cr_valref_t *val;
+	cr_run_t *run;
+	cr_fterm_rule_t **grp, **rest;
+	const char *best = NULL;
+	int nref = 0, i, j, k, r, cnt, bestcnt = 1, ngrp, nrest, nruns;
+	
+	/* which key is tested by most rules? */
+	for (i = 0; i < n; i++)
+		nref += cr_filter_unused(rule[i]);
+	if ((ref = malloc((nref + 1) * sizeof(cr_keyref_t))) == NULL
+	    || (val = malloc(n * sizeof(cr_valref_t))) == NULL
+	    || (run = malloc(n * sizeof(cr_run_t))) == NULL
+	    || (grp = malloc(n * sizeof(cr_fterm_rule_t *))) == NULL
+	    || (rest = malloc(n * sizeof(cr_fterm_rule_t *))) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (malloc())\n");
+		exit(1);
+	}
+	for (i = 0, k = 0; i < n; i++) {
+		for (j = 0; j < rule[i]->nterms; j++) {
+			if (!rule[i]->term[j].used) {
+				ref[k].key = rule[i]->term[j].key;
+				ref[k++].rule = i;
+			}
+		}
+	}
+	qsort(ref, nref, sizeof(cr_keyref_t), cr_keyref_cmp);
+	for (i = 0; i < nref; i = j) {
+		for (j = i + 1, cnt = 1; j < nref && strcmp(ref[j].key, ref[i].key) == 0; j++)
+			cnt += (ref[j].rule != ref[j - 1].rule);
+		if (cnt > bestcnt) {
+			bestcnt = cnt;
+			best = ref[i].key;
+		}
+	}
+	
+	if (best == NULL) {
+		/* nothing in common: the plain OR */
+		for (i = 0; i < n; i++) {
+			int many = cr_filter_unused(rule[i]) > 1;
+			
+			CR_FBUF_PUTS(b, i == 0 ? "" : " or ");
+			if (many)
+				CR_FBUF_PUTS(b, "(");
+			for (j = 0, k = 0; j < rule[i]->nterms; j++) {
+				if (rule[i]->term[j].used)
+					continue;
+				if (k++ > 0)
+					CR_FBUF_PUTS(b, " and ");
+				cr_filter_put_term(b, &rule[i]->term[j]);
+			}
+			if (many)
+				CR_FBUF_PUTS(b, ")");
+		}
+		free(ref);
+		free(val);
+		free(run);
+		free(grp);
+		free(rest);
+		return;
+	}
+	
+	/* the rules that test `best', grouped by value in the order of their
+	 * first rule, then the others */
+	for (i = 0, ngrp = 0, nrest = 0; i < n; i++) {
+		cr_term_t *t;
+		
+		if ((t = cr_filter_term(rule[i], best)) == NULL) {
+			rest[nrest++] = rule[i];
+		} else {
+			val[ngrp].t = t;
+			val[ngrp++].rule = i;
+		}
+	}
+	qsort(val, ngrp, sizeof(cr_valref_t), cr_valref_cmp);
+	/* val[]: runs of equal values, each in rule order; the runs are
+	 * emitted in the order of their first rules */
+	for (i = 0, nruns = 0; i < ngrp; i = j) {
+		for (j = i + 1; j < ngrp && strcmp(val[j].t->val, val[i].t->val) == 0; j++)
+			;
+		run[nruns].start = i;
+		run[nruns].end = j;
+		run[nruns++].rule = val[i].rule;
+	}
+	qsort(run, nruns, sizeof(cr_run_t), cr_run_cmp);	/* by val[start].rule */
+	for (r = 0; r < nruns; r++) {
+		cr_term_t *t = val[run[r].start].t;
+		int all = 0;
+		
+		CR_FBUF_PUTS(b, r == 0 ? "" : " or ");
+		/* mark the tested term of each rule in the group */
+		for (j = run[r].start, k = 0; j < run[r].end; j++) {
+			grp[k] = rule[val[j].rule];
+			val[j].t->used = 1;
+			if (cr_filter_unused(grp[k]) == 0)
+				all = 1;	/* the test alone matches this rule */
+			k++;
+		}
+		if (all) {
+			cr_filter_put_term(b, t);
+		} else {
+			CR_FBUF_PUTS(b, "(");
+			cr_filter_put_term(b, t);
+			CR_FBUF_PUTS(b, " and (");
+			cr_filter_factor(b, grp, k);
+			CR_FBUF_PUTS(b, "))");
+		}
+		for (j = run[r].start; j < run[r].end; j++)
+			val[j].t->used = 0;
+	}
+	if (nrest > 0) {
+		CR_FBUF_PUTS(b, " or ");
+		cr_filter_factor(b, rest, nrest);
+	}
+	free(ref);
+	free(val);
+	free(run);
+	free(grp);
+	free(rest);
+}
+
+/* the combined filter of all rules (to be freed by the caller) */
+char *cr_filter_build(void)
+{
+	cr_fterm_rule_t *r, **rule;
+	cr_fbuf_t b = { NULL, 0, 0 };
+	int i, j;
+	
+	if ((r = calloc(nel_nrules, sizeof(cr_fterm_rule_t))) == NULL
+	    || (rule = calloc(nel_nrules, sizeof(cr_fterm_rule_t *))) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (calloc())\n");
+		exit(1);
+	}
+	for (i = 0; i < nel_nrules; i++) {
+		cr_filter_split(nel_rules[i].filter, &r[i]);
+		rule[i] = &r[i];
+		if (r[i].nterms == 0) {
+			/* a rule without a filter takes every packet */
+			CR_FBUF_PUTS(&b, "");
+			goto done;
+		}
+	}
+	cr_filter_factor(&b, rule, nel_nrules);
+done:
+	for (i = 0; i < nel_nrules; i++) {
+		for (j = 0; j < r[i].nterms; j++) {
+			free(r[i].term[j].key);
+			free(r[i].term[j].val);
+		}
+		free(r[i].term);
+	}
+	free(r);
+	free(rule);
+	return b.s;
+}
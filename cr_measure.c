@@ -27,166 +27,362 @@
  */
 
 #include "nel.h"
-#ifdef __MACH__
- #include <mach/clock.h>
- #include <mach/mach.h>
-#endif
-
-int global_measurement_start = 0;
-/* amount of CC packets receiver through warden */
-int recv_through_warden_pkt_cnt = 0;
-
-extern char *ruleset[ANNOUNCED_PROTO_NUMBERS][3];
-
-extern u_int32_t goalcfg_cr;
-
-/* / from CCEAP: client.c \ */
-void print_time_diff(void)
-{
-	long ms;
-	time_t s;
-	struct timespec spec_now;
-	static struct timespec spec_last;
-	static int first_call = 1;
-#ifdef __MACH__ /* code from Stackoverflow.com (Mac OS lacks clock_gettime()) */
-	#warning "Including experimental code for MacOS. CCEAP runs best on Linux!"
-	clock_serv_t cclock;
-	mach_timespec_t mts;
-
-	host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
-	clock_get_time(cclock, &mts);
-	mach_port_deallocate(mach_task_self(), cclock);
-	spec_now.tv_sec = mts.tv_sec;
-	spec_now.tv_nsec = mts.tv_nsec;
-#else
-	clock_gettime(CLOCK_REALTIME, &spec_now);
-#endif
+
+/* The CR captures all CC packets with one handle. The kernel filter is the
+ * OR of all rules; each captured packet is attributed to the session of
+ * its sender by the source address and then classified in user space by
+ * the precompiled filters of the single rules, which count the packets of
+ * their technique in the session. The NEL probes (cr.c) and the COMM phase
+ * share these counters. */
+static pcap_t *cr_handle;
+static struct bpf_program *cr_filter;	/* per rule */
+static int cr_linkoff = -1;		/* IPv4 header offset, -1: unknown */
+static double cr_ts_div = 1.0e6;	/* unit of ts.tv_usec per second */
+u_int64_t cr_unattributed = 0;		/* CC packets of no session */
+
+/* record the result of a NEL probe of `rule' */
+void cr_rule_probed(cr_session_t *s, u_int32_t rule, int pkts)
+{
+	s->rule[rule].probes++;
+	if (pkts > 0)
+		s->rule[rule].probes_ok++;
+	s->rule[rule].probe_pkts += pkts;
+}
+
+/* per technique: packets received through the warden, and how many of the
+ * announced probes (and probe packets) got through; techniques that were
+ * neither probed nor received are only counted */
+void cr_print_rule_stats(cr_session_t *s)
+{
+	int i, idle = 0;
+	u_int32_t probes = 0, probes_ok = 0;
+	
+	fprintf(stderr, "%-6s %-34s %10s %8s %8s %12s\n", "rule", "technique",
+		"recvd", "probes", "passed", "probe pkts");
+	for (i = 0; i < nel_nrules; i++) {
+		cr_rule_stat_t *r = &s->rule[i];
+		
+		if (r->recvd == 0 && r->probes == 0) {
+			idle++;
+			continue;
+		}
+		fprintf(stderr, "%-6u %-34.34s %10" PRIu64 " %8u %8u",
+			nel_rules[i].id, nel_rules[i].name, r->recvd, r->probes,
+			r->probes_ok);
+		if (r->probes > 0) {
+			fprintf(stderr, " %5" PRIu64 " (%3.0f%%)\n", r->probe_pkts,
+				100.0 * r->probe_pkts / (r->probes * s->cfg.nel_pkts_p_prot));
+		} else {
+			fprintf(stderr, " %12s\n", "-");
+		}
+		probes += r->probes;
+		probes_ok += r->probes_ok;
+	}
+	if (idle > 0)
+		fprintf(stderr, "(%i techniques neither probed nor received)\n", idle);
+	fprintf(stderr, "%u of %u probes passed the warden.\n", probes_ok, probes);
+}
+
+/* the session received req_pkts CC packets */
+void cr_measure_report(cr_session_t *s)
+{
+	/* the CS's configuration (cfg_decode() of its configuration message,
+	 * see cr_feedback() and cr_session_config() in cr.c) */
+	u_int32_t warden = s->cfg.warden_mode;
+	u_int32_t blocked = s->cfg.sim_limit;
+	
+	fprintf(stderr, "session %u: MEASUREMENT COMPLETED; received %i CC "
+		"packets through warden link (through combined "
+		"pcap filter, i.e. excluding non-CC traffic).\n",
+		s->id, s->cfg.req_pkts);
+	printf("%.3f seconds\n", s->t_end - s->t_start);
+	
+	fprintf(stderr,
+		"CS's configuration: warden=0x%X (%s), non-blocked=%i/%i (%f%%), "
+		"reload_interval=%i, inactive_checked2active=%i\n",
+		warden,
+		(warden == WARDEN_MODE_NO_WARDEN ? "NO warden" :
+			(warden == WARDEN_MODE_REG_WARDEN ? "REGULAR warden" :
+				(warden == WARDEN_MODE_DYN_WARDEN ? "DYNAMIC warden" :
+					(warden == WARDEN_MODE_ADP_WARDEN ? "simplif. ADAPTIVE warden" :
+						"UNKNOWN(!!!) warden")))),
+		blocked, nel_nrules, (float)blocked/(float)nel_nrules,
+		s->cfg.reload_interval, s->cfg.inactive2active);
+	cr_print_rule_stats(s);
+	fprintf(stderr, "%" PRIu64 " CC packets could not be attributed to a session so far.\n",
+		cr_unattributed);
+	cr_capture_report();
+}
+
+/* source address of a captured IPv4 packet; -1 if there is none */
+int cr_pkt_src(const struct pcap_pkthdr *h, const u_char *bytes,
+	struct in_addr *src)
+{
+	if (cr_linkoff < 0 || h->caplen < (bpf_u_int32) cr_linkoff + 20
+	    || (bytes[cr_linkoff] >> 4) != 4)
+		return -1;
+	memcpy(src, bytes + cr_linkoff + 12, sizeof(*src));
+	return 0;
+}
+
+/* capture time of a packet; tv_usec holds nanoseconds if the handle was
+ * opened with nanosecond precision */
+double cr_pkt_time(const struct pcap_pkthdr *h)
+{
+	return h->ts.tv_sec + h->ts.tv_usec / cr_ts_div;
+}
+
+/* classify a CC packet of session `s' by the filters of the single rules
+ * (a packet may match the filters of several rules); returns 1 if it
+ * matched any rule and was counted */
+int cr_classify(cr_session_t *s, const struct pcap_pkthdr *h,
+	const u_char *bytes)
+{
+	int i, matched = 0;
 	
-	if (first_call) {
-		printf("0.000\n");
-		first_call = 0;
-	} else {
-		s  = spec_now.tv_sec - spec_last.tv_sec;
-		ms = (spec_now.tv_nsec - spec_last.tv_nsec) / 1.0e6;	
-		if (ms < 0) {
-			ms = 1000 + ms;
-			s -= 1;
+	for (i = 0; i < nel_nrules; i++) {
+		if (pcap_offline_filter(&cr_filter[i], h, bytes)) {
+			s->rule[i].recvd++;
+			s->rule[i].last = cr_pkt_time(h);
+			matched = 1;
 		}
-		printf("%"PRIdMAX".%03ld seconds\n", (intmax_t)s, ms);
 	}
-	bcopy(&spec_now, &spec_last, sizeof(struct timespec));
+	if (matched)
+		s->recvd++;
+	return matched;
+}
+
+/* report the session's number of received CC packets, at most every
+ * CR_PROGRESS_INTERVAL sec. */
+void cr_progress(cr_session_t *s)
+{
+	double now = cr_now();
+	
+	if (s->recvd < s->cfg.req_pkts && now - s->t_progress < CR_PROGRESS_INTERVAL)
+		return;
+	s->t_progress = now;
+	fprintf(stderr, "session %u: received: %d packets\n", s->id, s->recvd);
+	fflush(stderr);
 }
-/* \ end: from CCEAP: client.c / */
 
 void pkt_handler_COM(u_char *user, const struct pcap_pkthdr *h,
 			 const u_char *bytes)
 {
-	recv_through_warden_pkt_cnt++;
-	fprintf(stderr, "received: %d packets\n", recv_through_warden_pkt_cnt); fflush(stderr);
+	struct in_addr src;
+	cr_session_t *s;
+	
+	if (cr_pkt_src(h, bytes, &src) != 0)
+		src.s_addr = INADDR_NONE;
+	if ((s = cr_session_of(src)) == NULL) {
+		cr_unattributed++;
+		return;
+	}
+	if (!cr_classify(s, h, bytes))
+		return;
+	cr_progress(s);
+	
+	if (s->recvd >= s->cfg.req_pkts)
+		cr_session_done(s);
+}
 
-	if (recv_through_warden_pkt_cnt >= NUM_OVERALL_REQ_PKTS) {
-		u_int32_t warden;
-		u_int32_t blocked;
-		u_int32_t reload_interval;
-		u_int32_t inactive_checked2active;
-		
-		fprintf(stderr, "MEASUREMENT COMPLETED; received %i CC "
-			"packets through warden link (through combined "
-			"pcap filter, i.e. excluding non-CC traffic).\n",
-			NUM_OVERALL_REQ_PKTS);
-		print_time_diff();
-		
-		warden = (goalcfg_cr & 0xff000000) >> 24;
-		blocked = (goalcfg_cr & 0x00ff0000) >> 16;
-		reload_interval = (goalcfg_cr & 0x0000ff00) >> 8;
-		inactive_checked2active = (goalcfg_cr & 0x000000ff);
+/* compile the filter of every rule and the combined filter for the
+ * link-layer type of `handle'; returns the combined filter. The programs
+ * are kept for further handles of the same type (replay). */
+const struct bpf_program *cr_pcap_compile(pcap_t *handle)
+{
+	static int dlt = -1;
+	static struct bpf_program filter;
+	char *filter_str;
+	int i;
+	
+	if (pcap_datalink(handle) != dlt) {
+		if (dlt != -1) {
+			for (i = 0; i < nel_nrules; i++)
+				pcap_freecode(&cr_filter[i]);
+			pcap_freecode(&filter);
+		}
+		dlt = pcap_datalink(handle);
+		switch (dlt) {
+		case DLT_EN10MB:
+			cr_linkoff = 14;
+			break;
+		case DLT_LINUX_SLL:
+			cr_linkoff = 16;
+			break;
+		case DLT_NULL:
+			cr_linkoff = 4;
+			break;
+		case DLT_RAW:
+			cr_linkoff = 0;
+			break;
+		default:
+			cr_linkoff = -1;
+			fprintf(stderr, "unknown link-layer type, CC packets are only "
+				"attributed to a single session.\n");
+		}
 		
-		fprintf(stderr,
-			"CS's configuration: warden=0x%X (%s), non-blocked=%i/%i (%f%%), "
-			"reload_interval=%i, inactive_checked2active=%i\n",
-			warden,
-			(warden == WARDEN_MODE_NO_WARDEN ? "NO warden" :
-				(warden == WARDEN_MODE_REG_WARDEN ? "REGULAR warden" :
-					(warden == WARDEN_MODE_DYN_WARDEN ? "DYNAMIC warden" :
-						(warden == WARDEN_MODE_ADP_WARDEN ? "simplif. ADAPTIVE warden" :
-							"UNKNOWN(!!!) warden")))),
-			blocked, ANNOUNCED_PROTO_NUMBERS, (float)blocked/(float)ANNOUNCED_PROTO_NUMBERS,
-			reload_interval, inactive_checked2active);
-		fflush(stderr);fflush(stdout);
-		exit(0);
+		fprintf(stderr, "setting up pcap combined filter CC traffic ...\n");
+		if (cr_filter == NULL)
+			cr_filter = nel_calloc(nel_nrules, sizeof(struct bpf_program));
+		for (i = 0; i < nel_nrules; i++) {
+			if (pcap_compile(handle, &cr_filter[i], nel_rules[i].filter, 1,
+			    PCAP_NETMASK_UNKNOWN) != 0) {
+				fprintf(stderr, "pcap_compile() error for rule %u (`%s')!\n",
+					nel_rules[i].id, nel_rules[i].filter);
+				pcap_perror(handle, "pcap_compile in cr_pcap_compile");
+				exit(1);
+			}
+		}
+		/* the rules factored by the bytes they test (cr_filter.c) */
+		filter_str = cr_filter_build();
+		fprintf(stderr, "Combined filter will be set to: ```%s'''\n",
+			filter_str);
+		if (pcap_compile(handle, &filter, filter_str, 1,
+				PCAP_NETMASK_UNKNOWN) != 0) {
+			fprintf(stderr, "pcap_compile() error in cr_pcap_compile()");
+			pcap_perror(handle, "pcap_compile in cr_pcap_compile");
+			exit(1);
+		}
+		fprintf(stderr, "combined filter of %u rules: %u BPF instructions.\n",
+			nel_nrules, filter.bf_len);
+		free(filter_str);
+	}
+	return &filter;
+}
+
+/* the filter of rule `i' as compiled by the last cr_pcap_compile() */
+const struct bpf_program *cr_rule_filter(int i)
+{
+	return &cr_filter[i];
+}
+
+/* compile the filters for `handle' and set the combined filter on it */
+void cr_pcap_setup(pcap_t *handle)
+{
+	cr_ts_div = (pcap_get_tstamp_precision(handle) == PCAP_TSTAMP_PRECISION_NANO
+		     ? 1.0e9 : 1.0e6);
+	if (pcap_setfilter(handle, (struct bpf_program *) cr_pcap_compile(handle)) == -1) {
+		fprintf(stderr, "pcap_setfilter() error in cr_pcap_setup()");
+		pcap_perror(handle, "pcap_setfilter in cr_pcap_setup");
+		exit(1);
 	}
 }
 
-void *cr_measure(void *unused)
+/* open the capture handle, compile the filter of every rule and set the
+ * combined filter (called once at receiver start-up) */
+void cr_pcap_init(void)
 {
 	extern char *net_if;
-	int snapshot_len = 100;
-	char *filter_str = NULL;
-	int promisc = 0;
-	int timeout = 0;
-	struct bpf_program filter;
+	int snapshot_len = CR_SNAPLEN;
+	int promisc = 1;
+	int timeout = 10; /* [ms]: deliver the probes in time for their slot */
 	char err_buf[PCAP_ERRBUF_SIZE];
-	int i;
-	int filter_rule = 0;
-	pcap_t *handle_measure;
+	int rc;
 	
-	if ((handle_measure = pcap_open_live(net_if, snapshot_len, promisc,
-					     timeout, err_buf)) == NULL) {
-		perror("pcap_open_live in cr_measure");
-		exit(1);
+	if (nel_cfg.capture == CR_CAPTURE_RING) {
+		cr_ring_init();
+		fprintf(stderr, "waiting for CC pkts ...\n");
+		return;
 	}
-	
-	fprintf(stderr, "setting up pcap combined filter CC traffic ...\n");
-	for (i = 0; i < ANNOUNCED_PROTO_NUMBERS; i++) {
-		filter_str = realloc(filter_str,
-				(filter_str == NULL
-					? 0
-					: strlen(filter_str)) + 1 + 6 /* for: ' or ()' */
-					  + strlen(ruleset[i][2]));
-		if (!filter_str) {
-			fprintf(stderr, "ERR: memory alloc (realloc())\n");
-			exit(1);
-		}
-		if (filter_rule == 0) {
-			snprintf(filter_str, 3 + strlen(ruleset[i][2]), "(%s)",
-				 ruleset[i][2]);
-			filter_rule ++;
-		} else {
-			snprintf((char *)(filter_str+strlen(filter_str)),
-				 7 + strlen(ruleset[i][2]),
-				 " or (%s)",
-				 ruleset[i][2]);
+	if (nel_cfg.capture == CR_CAPTURE_EBPF) {
+		if (cr_ebpf_init() == 0) {
+			fprintf(stderr, "waiting for CC pkts ...\n");
+			return;
 		}
+		fprintf(stderr, "eBPF counting is not available, capturing with "
+			"libpcap.\n");
+		nel_cfg.capture = CR_CAPTURE_PCAP;
 	}
-	fprintf(stderr, "Combined filter will be set to: ```%s'''\n",
-		filter_str);
-	if (pcap_compile(handle_measure, &filter, filter_str, 0,
-			PCAP_NETMASK_UNKNOWN) != 0) {
-		fprintf(stderr, "pcap_compile() error in cr_measure()");
-		pcap_perror(handle_measure, "pcap_compile in cr_measure");
+	if ((cr_handle = pcap_create(net_if, err_buf)) == NULL) {
+		fprintf(stderr, "pcap_create() error in cr_measure.c: %s\n", err_buf);
 		exit(1);
 	}
-	if (pcap_setfilter(handle_measure, &filter) == -1) {
-		fprintf(stderr, "pcap_setfilter() error in cr_measure()");
-		perror("pcap_setfilter in cr_measure");
+	pcap_set_snaplen(cr_handle, snapshot_len);
+	pcap_set_promisc(cr_handle, promisc);
+	pcap_set_timeout(cr_handle, timeout);
+	if (nel_cfg.pcap_immediate)
+		pcap_set_immediate_mode(cr_handle, 1);
+	if (nel_cfg.pcap_buffer > 0)
+		pcap_set_buffer_size(cr_handle, nel_cfg.pcap_buffer * 1024);
+	if (nel_cfg.pcap_tstamp == CR_TSTAMP_NANO
+	    && pcap_set_tstamp_precision(cr_handle, PCAP_TSTAMP_PRECISION_NANO) != 0)
+		fprintf(stderr, "nanosecond time stamps are not supported, using "
+			"microseconds.\n");
+	if ((rc = pcap_activate(cr_handle)) < 0) {
+		fprintf(stderr, "pcap_activate() error in cr_measure.c: %s (%s)\n",
+			pcap_statustostr(rc), pcap_geterr(cr_handle));
 		exit(1);
+	} else if (rc > 0) {
+		fprintf(stderr, "pcap_activate() warning: %s (%s)\n",
+			pcap_statustostr(rc), pcap_geterr(cr_handle));
 	}
-	
-	fprintf(stderr, "waiting for CC pkts in cr_measure ... ");
-	fflush(stderr);
-	
-	/* wait for measurement to start (triggered by first announcement
-	 * from CS!) */
-	while (!global_measurement_start) {
-		sleep(1);
+	cr_pcap_setup(cr_handle);
+	/* cr_run() polls the capture */
+	if (pcap_setnonblock(cr_handle, 1, err_buf) == -1) {
+		fprintf(stderr, "pcap_setnonblock() error in cr_pcap_init(): %s\n", err_buf);
+		exit(1);
 	}
-	printf("Starting timer: ");
-	print_time_diff();
-	
-	pcap_loop(handle_measure, 0 /*inf pkts*/, pkt_handler_COM, NULL);
+	fprintf(stderr, "waiting for CC pkts ...\n");
+}
+
+/* the capture's file descriptor for cr_run()'s epoll loop */
+int cr_pcap_fd(void)
+{
+	int fd;
 	
-	pcap_close(handle_measure);
-	return NULL;
+	if (nel_cfg.capture == CR_CAPTURE_RING)
+		return cr_ring_fd();
+	if (nel_cfg.capture == CR_CAPTURE_EBPF)
+		return cr_ebpf_fd();
+	if ((fd = pcap_get_selectable_fd(cr_handle)) == -1) {
+		fprintf(stderr, "pcap_get_selectable_fd(): capture device "
+			"cannot be polled.\n");
+		exit(1);
+	}
+	return fd;
+}
+
+/* count the CC packets of the NEL and COMM phase captured so far */
+void cr_pcap_dispatch(void)
+{
+	if (nel_cfg.capture == CR_CAPTURE_RING) {
+		cr_ring_dispatch();
+		return;
+	} else if (nel_cfg.capture == CR_CAPTURE_EBPF) {
+		cr_ebpf_dispatch();
+		return;
+	}
+	if (pcap_dispatch(cr_handle, -1 /* all buffered */, pkt_handler_COM, NULL) == -1)
+		pcap_perror(cr_handle, "pcap_dispatch in cr_pcap_dispatch");
 }
 
+/* the statistics of the capture (for the report of a session) */
+void cr_capture_report(void)
+{
+	struct pcap_stat st;
+	
+	if (nel_cfg.capture == CR_CAPTURE_RING) {
+		cr_ring_report();
+		return;
+	} else if (nel_cfg.capture == CR_CAPTURE_EBPF) {
+		cr_ebpf_report();
+		return;
+	}
+	if (cr_handle == NULL)	/* replay */
+		return;
+	if (pcap_stats(cr_handle, &st) == -1) {
+		pcap_perror(cr_handle, "pcap_stats in cr_capture_report");
+		return;
+	}
+	fprintf(stderr, "pcap capture: %u packets received, %u dropped (buffer "
+		"full), %u dropped by the interface.\n", st.ps_recv, st.ps_drop,
+		st.ps_ifdrop);
+}
 
+/* the sessions or their states changed (cr.c): the eBPF counters attribute
+ * the packets in the kernel and need to know the sessions' addresses */
+void cr_capture_sessions(void)
+{
+	if (nel_cfg.capture == CR_CAPTURE_EBPF)
+		cr_ebpf_sessions();
+}
@@ -0,0 +1,186 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+
+/* Replay: the receiver's measurement on recorded warden-link traffic. The
+ * packets of a pcap file, or of all files of a directory in the order of
+ * their names, run through the combined filter and the classification of
+ * the live receiver (cr_measure.c), but without a feedback channel and at
+ * the speed the files can be read. All packets that pass the combined
+ * filter form one session which uses the local configuration (-f, -o);
+ * with an address given, only the packets of this CS are counted and the
+ * others are not attributed, as for a live receiver.
+ *
+ * Times are capture times: the measurement starts with the first CC
+ * packet (there is no announcement to start with) and completes with the
+ * req_pkts-th one. The capture is read to its end nevertheless, so the
+ * per-rule counters cover all of it. */
+
+static cr_session_t *cr_rs;		/* the replayed session */
+static int cr_rs_completed = 0;
+static u_int64_t cr_rs_pkts = 0;	/* packets read (combined filter) */
+
+static void cr_replay_handler(u_char *user, const struct pcap_pkthdr *h,
+	const u_char *bytes)
+{
+	struct in_addr src;
+	double t = cr_pkt_time(h);
+	
+	cr_rs_pkts++;
+	if (cr_rs->src.s_addr != INADDR_ANY
+	    && (cr_pkt_src(h, bytes, &src) != 0 || src.s_addr != cr_rs->src.s_addr)) {
+		cr_unattributed++;
+		return;
+	}
+	if (!cr_classify(cr_rs, h, bytes))
+		return;
+	if (!cr_rs->measuring) {
+		cr_rs->measuring = 1;
+		cr_rs->t_start = t;
+	}
+	if (!cr_rs_completed && cr_rs->recvd >= cr_rs->cfg.req_pkts) {
+		cr_rs_completed = 1;
+		cr_rs->t_end = t;
+	}
+}
+
+static int cr_replay_namecmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* the files to replay: `path' itself or the files of directory `path' */
+static char **cr_replay_files(const char *path, int *n)
+{
+	struct stat sb;
+	struct dirent *de;
+	char file[PATH_MAX];
+	char **files = NULL;
+	int cap = 0;
+	DIR *dir;
+	
+	*n = 0;
+	if (stat(path, &sb) != 0) {
+		perror(path);
+		exit(1);
+	}
+	if (!S_ISDIR(sb.st_mode)) {
+		if ((files = malloc(sizeof(char *))) == NULL) {
+			fprintf(stderr, "ERR: memory alloc (malloc())\n");
+			exit(1);
+		}
+		files[(*n)++] = strdup(path);
+		return files;
+	}
+	if ((dir = opendir(path)) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(file, sizeof(file), "%s/%s", path, de->d_name);
+		if (stat(file, &sb) != 0 || !S_ISREG(sb.st_mode))
+			continue;
+		if (*n == cap) {
+			cap = cap ? 2 * cap : 16;
+			if ((files = realloc(files, cap * sizeof(char *))) == NULL) {
+				fprintf(stderr, "ERR: memory alloc (realloc())\n");
+				exit(1);
+			}
+		}
+		if ((files[(*n)++] = strdup(file)) == NULL) {
+			fprintf(stderr, "ERR: memory alloc (strdup())\n");
+			exit(1);
+		}
+	}
+	closedir(dir);
+	if (*n == 0) {
+		fprintf(stderr, "%s: no files to replay.\n", path);
+		exit(1);
+	}
+	qsort(files, *n, sizeof(char *), cr_replay_namecmp);
+	return files;
+}
+
+/* argv[1]: pcap file or directory, argv[2] (optional): CS's warden-link
+ * address */
+void cr_replay(int argc, char *argv[])
+{
+	char err_buf[PCAP_ERRBUF_SIZE];
+	struct timespec t0, t1;
+	pcap_t *handle;
+	char **files;
+	int nfiles, i;
+	double dt;
+	
+	if (argc < 2)
+		usage();
+	cr_rs = cr_session_new();
+	cr_rs->cfg = nel_cfg;
+	if (argc > 2 && !inet_aton(argv[2], &cr_rs->src)) {
+		fprintf(stderr, "invalid IP address.\n");
+		usage();
+	}
+	files = cr_replay_files(argv[1], &nfiles);
+	
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nfiles; i++) {
+		if ((handle = pcap_open_offline_with_tstamp_precision(files[i],
+		    nel_cfg.pcap_tstamp == CR_TSTAMP_NANO ? PCAP_TSTAMP_PRECISION_NANO
+		    : PCAP_TSTAMP_PRECISION_MICRO, err_buf)) == NULL) {
+			fprintf(stderr, "pcap_open_offline() error: %s\n", err_buf);
+			exit(1);
+		}
+		cr_pcap_setup(handle);
+		if (pcap_loop(handle, -1, cr_replay_handler, NULL) == -1) {
+			fprintf(stderr, "%s: %s\n", files[i], pcap_geterr(handle));
+			exit(1);
+		}
+		pcap_close(handle);
+		free(files[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	free(files);
+	dt = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1.0e9;
+	
+	if (cr_rs_completed) {
+		cr_measure_report(cr_rs);
+	} else {
+		fprintf(stderr, "REPLAY NOT COMPLETED; received %i of %i CC packets "
+			"through warden link.\n", cr_rs->recvd, cr_rs->cfg.req_pkts);
+		cr_print_rule_stats(cr_rs);
+	}
+	fprintf(stderr, "replayed %i file(s): %" PRIu64 " packets passed the "
+		"combined filter, %i CC packets classified in %.3f seconds "
+		"(%.0f packets/s).\n", nfiles, cr_rs_pkts, cr_rs->recvd, dt,
+		dt > 0 ? cr_rs_pkts / dt : 0.0);
+	if (!cr_rs_completed)
+		exit(1);
+}
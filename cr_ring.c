@@ -0,0 +1,232 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+
+/* TPACKET_V3 capture: the CR's alternative to libpcap on Linux. An
+ * AF_PACKET socket gets the combined filter (compiled by libpcap, run by
+ * the kernel) and a memory-mapped RX ring of blocks. The kernel fills a
+ * block with as many packets as fit and passes it on when it is full or
+ * after `ring_timeout' ms; the CR then runs the packets of the block
+ * through pkt_handler_COM() in place (no copy, no system call per packet)
+ * and returns the block. If no block is free, the kernel drops packets
+ * (and freezes the queue until a block was returned); both are counted. */
+
+static struct {
+	int		fd;
+	u_char		*map;
+	u_int32_t	nblocks;
+	u_int32_t	cur;		/* next block to process */
+	int		loopback;	/* skip our own outgoing packets */
+	u_int64_t	pkts, drops, freezes;	/* kernel's counters */
+	u_int64_t	blocks;		/* processed */
+} cr_ring = { .fd = -1 };
+
+/* an AF_PACKET socket for `net_if' that does not receive before it is
+ * bound; `*dlt' is the link-layer type of its packets */
+int cr_packet_socket(int *dlt, int *loopback)
+{
+	extern char *net_if;
+	struct ifreq ifr;
+	int fd;
+	
+	bzero(&ifr, sizeof(ifr));
+	strncpy(ifr.ifr_name, net_if, IFNAMSIZ - 1);
+	/* Ethernet and loopback devices deliver Ethernet frames, other
+	 * devices (e.g., tunnels) are captured from the IP header on */
+	if ((fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+		perror("socket(AF_PACKET)");
+		exit(1);
+	}
+	if (ioctl(fd, SIOCGIFHWADDR, &ifr) < 0) {
+		perror(net_if);
+		exit(1);
+	}
+	if (ifr.ifr_hwaddr.sa_family == ARPHRD_ETHER
+	    || ifr.ifr_hwaddr.sa_family == ARPHRD_LOOPBACK) {
+		*dlt = DLT_EN10MB;
+	} else {
+		*dlt = DLT_RAW;
+		close(fd);
+		if ((fd = socket(AF_PACKET, SOCK_DGRAM, 0)) < 0) {
+			perror("socket(AF_PACKET)");
+			exit(1);
+		}
+	}
+	if (ioctl(fd, SIOCGIFFLAGS, &ifr) < 0) {
+		perror(net_if);
+		exit(1);
+	}
+	*loopback = (ifr.ifr_flags & IFF_LOOPBACK) != 0;
+	return fd;
+}
+
+/* bind the socket `fd' to `net_if' (it receives from now on) */
+void cr_packet_bind(int fd)
+{
+	extern char *net_if;
+	struct sockaddr_ll sll;
+	
+	bzero(&sll, sizeof(sll));
+	sll.sll_family = AF_PACKET;
+	sll.sll_protocol = htons(ETH_P_ALL);
+	if ((sll.sll_ifindex = if_nametoindex(net_if)) == 0) {
+		perror(net_if);
+		exit(1);
+	}
+	if (bind(fd, (struct sockaddr *) &sll, sizeof(sll)) < 0) {
+		perror("bind(AF_PACKET)");
+		exit(1);
+	}
+}
+
+void cr_ring_init(void)
+{
+	extern char *net_if;
+	struct tpacket_req3 req;
+	struct sock_fprog fprog;
+	const struct bpf_program *filter;
+	pcap_t *dead;
+	int version = TPACKET_V3, dlt;
+	
+	cr_ring.fd = cr_packet_socket(&dlt, &cr_ring.loopback);
+	
+	/* the socket does not receive before bind(), so the filter is set
+	 * before any packet arrives */
+	if ((dead = pcap_open_dead(dlt, CR_SNAPLEN)) == NULL) {
+		fprintf(stderr, "pcap_open_dead() error in cr_ring_init()\n");
+		exit(1);
+	}
+	filter = cr_pcap_compile(dead);
+	fprog.len = filter->bf_len;
+	fprog.filter = (struct sock_filter *) filter->bf_insns;
+	if (setsockopt(cr_ring.fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog,
+	    sizeof(fprog)) < 0) {
+		perror("setsockopt(SO_ATTACH_FILTER)");
+		exit(1);
+	}
+	
+	if (setsockopt(cr_ring.fd, SOL_PACKET, PACKET_VERSION, &version,
+	    sizeof(version)) < 0) {
+		perror("setsockopt(PACKET_VERSION): TPACKET_V3");
+		exit(1);
+	}
+	bzero(&req, sizeof(req));
+	req.tp_block_size = CR_RING_BLOCK_SIZE;
+	req.tp_block_nr = nel_cfg.ring_size / (CR_RING_BLOCK_SIZE / 1024);
+	req.tp_frame_size = TPACKET_ALIGNMENT << 7;	/* (V3: frames vary) */
+	req.tp_frame_nr = (req.tp_block_size / req.tp_frame_size) * req.tp_block_nr;
+	req.tp_retire_blk_tov = nel_cfg.ring_timeout;
+	if (setsockopt(cr_ring.fd, SOL_PACKET, PACKET_RX_RING, &req,
+	    sizeof(req)) < 0) {
+		perror("setsockopt(PACKET_RX_RING)");
+		exit(1);
+	}
+	cr_ring.nblocks = req.tp_block_nr;
+	if ((cr_ring.map = mmap(NULL, (size_t) req.tp_block_size * req.tp_block_nr,
+	    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, cr_ring.fd, 0))
+	    == MAP_FAILED) {
+		/* MAP_LOCKED may exceed RLIMIT_MEMLOCK */
+		if ((cr_ring.map = mmap(NULL, (size_t) req.tp_block_size * req.tp_block_nr,
+		    PROT_READ | PROT_WRITE, MAP_SHARED, cr_ring.fd, 0)) == MAP_FAILED) {
+			perror("mmap(PACKET_RX_RING)");
+			exit(1);
+		}
+	}
+	
+	cr_packet_bind(cr_ring.fd);
+	fprintf(stderr, "capturing on %s with a TPACKET_V3 ring of %u blocks of "
+		"%u KiB (block timeout %u ms).\n", net_if, cr_ring.nblocks,
+		CR_RING_BLOCK_SIZE / 1024, nel_cfg.ring_timeout);
+}
+
+/* the ring's socket is readable when a block was passed on */
+int cr_ring_fd(void)
+{
+	return cr_ring.fd;
+}
+
+/* process and return all blocks the kernel passed on */
+void cr_ring_dispatch(void)
+{
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *ppd;
+	struct sockaddr_ll *sll;
+	struct pcap_pkthdr h;
+	u_int32_t i;
+	
+	for (;;) {
+		bd = (struct tpacket_block_desc *) (cr_ring.map
+			+ (size_t) cr_ring.cur * CR_RING_BLOCK_SIZE);
+		if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+		    & TP_STATUS_USER) == 0)
+			break;
+		ppd = (struct tpacket3_hdr *) ((u_char *) bd
+			+ bd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			sll = (struct sockaddr_ll *) ((u_char *) ppd
+				+ TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			/* on loopback, every packet is seen twice */
+			if (!cr_ring.loopback || sll->sll_pkttype != PACKET_OUTGOING) {
+				h.ts.tv_sec = ppd->tp_sec;
+				h.ts.tv_usec = ppd->tp_nsec / 1000;
+				h.caplen = ppd->tp_snaplen;
+				h.len = ppd->tp_len;
+				pkt_handler_COM(NULL, &h, (u_char *) ppd + ppd->tp_mac);
+			}
+			ppd = (struct tpacket3_hdr *) ((u_char *) ppd + ppd->tp_next_offset);
+		}
+		/* return the block to the kernel */
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+			__ATOMIC_RELEASE);
+		cr_ring.cur = (cr_ring.cur + 1) % cr_ring.nblocks;
+		cr_ring.blocks++;
+	}
+}
+
+/* the kernel's counters since the last report are added up */
+void cr_ring_report(void)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+	
+	if (cr_ring.fd < 0)
+		return;
+	if (getsockopt(cr_ring.fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0) {
+		perror("getsockopt(PACKET_STATISTICS)");
+		return;
+	}
+	/* tp_packets includes the dropped packets */
+	cr_ring.pkts += st.tp_packets;
+	cr_ring.drops += st.tp_drops;
+	cr_ring.freezes += st.tp_freeze_q_cnt;
+	fprintf(stderr, "ring capture: %" PRIu64 " packets passed the filter, "
+		"%" PRIu64 " dropped (ring full), %" PRIu64 " queue freezes; %"
+		PRIu64 " blocks processed.\n", cr_ring.pkts, cr_ring.drops,
+		cr_ring.freezes, cr_ring.blocks);
+}
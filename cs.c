@@ -30,10 +30,10 @@
 
 /* This is a core component of NEL: each array element contains a rule name,
  * a scapy command and finally a PCAP filter for each covert channel technique
- * to be tested.
+ * to be tested. This is the built-in ruleset; see ruleset.c for rulesets
+ * loaded at run-time.
  * Rules developed in joint-work with all authors of the paper. */
-char *ruleset[ANNOUNCED_PROTO_NUMBERS+1][3] = {
-	/* update ANNOUNCED_PROTO_NUMBERS after adding new proto here! */
+char *ruleset[][3] = {
 	{ "[1] IPv4 w/ reserved flag set",
 		"a=IP(flags=0x4)",
 		"ip[6] == 0x80" },
@@ -193,31 +193,45 @@ char *ruleset[ANNOUNCED_PROTO_NUMBERS+1][3] = {
 	{ "Mn29",
 		"a=IP(tos=108)/SCTP()/SCTPChunkError(type=15)",
 		"ip[32] == 0xf and ip[1]==0x6c" },		
-	/* update ANNOUNCED_PROTO_NUMBERS after adding new proto here! */
+	/* keep this sentinel at the end */
 	{NULL, NULL, NULL}
 };
-int ruleset_activation[ANNOUNCED_PROTO_NUMBERS];
-time_t ruleset_checked[ANNOUNCED_PROTO_NUMBERS];
-int preparation_done = 0;
-u_int32_t goalcfg_cs = WARDEN_MODE << 24 | SIM_LIMIT_FOR_BLOCKED_SENDING << 16 | RELOAD_INTERVAL << 8 | SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE;
+static double cs_now(nel_state_t *);
+static void cs_send(nel_state_t *, u_int32_t, int);
+static void cs_pretend(nel_state_t *, u_int32_t);
+static int cs_native(nel_state_t *, u_int32_t);
+static void cs_nb_found(nel_state_t *);
+
 /*************************
  * SHARED: NEL+COMM PHASE
  *************************/
-/* the set of currently non-blocked protocols (indicated by '1'. Set
- * to '0' by default and set back to '0' once discovered as blocked
- * again.
- */
-u_int32_t P_nb[ANNOUNCED_PROTO_NUMBERS] = { 0 };
+/* state shared by the NEL, COMM and rule reloader threads (P_nb, simulated
+ * warden ruleset, ...), see nel_state_t; nel.c allocates its per-rule state
+ * before it starts them */
+nel_state_t cs_state = {
+	.now = cs_now,
+	.send = cs_send,
+	.pretend = cs_pretend,
+	.native = cs_native,
+	.nb_found = cs_nb_found,
+	.verbose = 1,
+	.cfg = &nel_cfg,
+	.ruleset = &cs_state.ruleset_snap[0]
+};
+/* the reloader starts once the NEL thread initialized cs_state */
+static int preparation_done = 0;
+static pthread_mutex_t preparation_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t preparation_cond = PTHREAD_COND_INITIALIZER;
 
 
 /* cs-internal debug function */
-void print_Pnb(void)
+void print_Pnb(nel_state_t *st)
 {
 	int i;
 	
 	fprintf(stderr, "P_nb={");
-	for (i = 0; i < ANNOUNCED_PROTO_NUMBERS; i++) {
-			fprintf(stderr, "%i=>%i, ", i, P_nb[i]);
+	for (i = 0; i < nel_nrules; i++) {
+			fprintf(stderr, "%i=>%i, ", i, nel_bit_test(&st->P_nb, i));
 	}
 	fprintf(stderr, "eol}\n");
 }
@@ -229,7 +243,15 @@ void send_CC_packet(u_int32_t announced_proto)
 	char buf[2048] = {'\0'};
 	
 	printf("sending protocol %i...\n", announced_proto);
-	scapy_cmd = ruleset[announced_proto][1];
+#ifdef USE_NATIVE_PKT_ENGINE
+	if (pkt_send_native(announced_proto) == 0)
+		return;
+#endif
+#ifdef USE_SCAPY_WORKER
+	scapyw_send(announced_proto);
+	return;
+#endif
+	scapy_cmd = (char *) nel_rules[announced_proto].tmpl;
 	
 	/* the dirty part ... */
 	snprintf(buf, sizeof(buf) - 1,
@@ -252,118 +274,511 @@ void send_CC_packet(u_int32_t announced_proto)
 
 void pretend_sending(u_int32_t protonum)
 {
-	/* This system() is just to consume an approx. equal amount of time
-	 *  as if we would ACTUALLY send the packet. */
-	if (system("echo 'exit;' | scapy >/dev/null 2>&1") != 0) {
-	   fprintf(stderr, "Fatal: An error occured while calling 'scapy'.\n");
-	   exit(1);
+	/* Consume an approx. equal amount of time as if we would ACTUALLY
+	 * send the packet, using the path send_CC_packet() would take. */
+#ifdef USE_NATIVE_PKT_ENGINE
+	if (pkt_is_native(protonum)) {
+		pkt_pretend_native(protonum);
+	} else
+#endif
+	{
+#ifdef USE_SCAPY_WORKER
+		scapyw_pretend(protonum);
+#else
+		if (system("echo 'exit;' | scapy >/dev/null 2>&1") != 0) {
+		   fprintf(stderr, "Fatal: An error occured while calling 'scapy'.\n");
+		   exit(1);
+		}
+#endif
 	}
 	fprintf(stderr, "warden: internally blocked sending of protocol %u\n", protonum);
 }
 
-/*************************
- * NEL PHASE
- *************************/
+/* nel_state_t hooks of the real sender: wall-clock time and actual sending */
+static double cs_now(nel_state_t *st)
+{
+	struct timespec ts;
 
-/* CS: 1) send announcements to receiver, 2) transfer the CC test packets, and
- * 3) receive results (blocking I/O) via NEL meta communication channel. */
-void *cs_NEL_handler(void *sockfd_ptr)
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+static void cs_COMM_send(u_int32_t);
+
+static void cs_send(nel_state_t *st, u_int32_t announced_proto, int phase)
 {
-	int n;
-	nel_proto_t buf;
-	int *sockfd = (int *) sockfd_ptr;
-	int i;
-#ifdef INCREMENTAL_PROTO_SELECT
-	int p = 0;
+	if (phase == NEL_PHASE_COMM)
+		cs_COMM_send(announced_proto);
+	else
+		send_CC_packet(announced_proto);
+}
+
+static void cs_pretend(nel_state_t *st, u_int32_t announced_proto)
+{
+	pretend_sending(announced_proto);
+}
+
+static int cs_native(nel_state_t *st, u_int32_t announced_proto)
+{
+#ifdef USE_NATIVE_PKT_ENGINE
+	return pkt_is_native(announced_proto);
+#else
+	return 0;
 #endif
-	
-	/* deactivate all rules by default */
-	bzero(ruleset_activation, sizeof(ruleset_activation));
-	for (i = 0; i < ANNOUNCED_PROTO_NUMBERS; i++)
-		ruleset_checked[i] = time(NULL);
-	
+}
+
+/* print the warden configuration */
+void cs_print_config(const nel_cfg_t *cfg)
+{
 	printf("Configuration. MODE=");
-	switch (WARDEN_MODE) {
+	switch (cfg->warden_mode) {
 		case WARDEN_MODE_NO_WARDEN:  printf("NO WARDEN\n");  break;
 		case WARDEN_MODE_REG_WARDEN: printf("REGULAR WARDEN, "); break;
 		case WARDEN_MODE_DYN_WARDEN: printf("DYNAMIC WARDEN, "); break;
 		case WARDEN_MODE_ADP_WARDEN: printf("SIMPLIFIED ADAPTIVE WARDEN, "); break;
 		default: fprintf(stderr, "invalid mode! exiting.\n"); exit(1);
 	}
-	if (WARDEN_MODE != WARDEN_MODE_NO_WARDEN) {
-		printf("simul. blocking limit=%i", SIM_LIMIT_FOR_BLOCKED_SENDING);
-		printf(" (%f%%)", (float) 100*(ANNOUNCED_PROTO_NUMBERS - SIM_LIMIT_FOR_BLOCKED_SENDING) / ANNOUNCED_PROTO_NUMBERS);
-		if (WARDEN_MODE != WARDEN_MODE_REG_WARDEN) {
-			printf(", reload interval=%i", RELOAD_INTERVAL);
+	if (cfg->warden_mode != WARDEN_MODE_NO_WARDEN) {
+		printf("simul. blocking limit=%i", cfg->sim_limit);
+		printf(" (%f%%)", (float) 100*((int) nel_nrules - (int) cfg->sim_limit) / nel_nrules);
+		if (cfg->warden_mode != WARDEN_MODE_REG_WARDEN) {
+			printf(", reload interval=%i", cfg->reload_interval);
 		}
-		if (WARDEN_MODE == WARDEN_MODE_ADP_WARDEN) {
-			printf(", inactive_checked (ic)=%i (%f%%)", SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE,
-				(float) (100*SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE / ANNOUNCED_PROTO_NUMBERS));
+		if (cfg->warden_mode == WARDEN_MODE_ADP_WARDEN) {
+			printf(", inactive_checked (ic)=%i (%f%%)", cfg->inactive2active,
+				(float) (100*cfg->inactive2active / nel_nrules));
 		}
 		putchar('\n');
 	}
+	printf("Probe policy: %s", probe_policy_name(cfg->probe_policy));
+	if (cfg->probe_policy == PROBE_POLICY_THOMPSON)
+		printf(", verdict decay=%u s", cfg->probe_decay);
+	putchar('\n');
+}
+
+/* The decision logic of the NEL, COMM and reloader threads below works on
+ * a nel_state_t and uses its hooks for time and sending, so that it is
+ * shared by the real sender and the simulation (sim.c). */
+
+/* allocate the per-rule state of `st' for the loaded ruleset (before the
+ * threads that share `st' start) */
+void cs_state_alloc(nel_state_t *st)
+{
+	nel_bits_init(&st->P_nb);
+	nel_bits_init(&st->ruleset_snap[0].active);
+	nel_bits_init(&st->ruleset_snap[1].active);
+	st->ruleset_checked = nel_calloc(nel_nrules, sizeof(time_t));
+	st->probe = nel_calloc(nel_nrules, sizeof(nel_probe_stat_t));
+	st->score = nel_calloc(nel_nrules, sizeof(double));
+}
+
+void cs_state_free(nel_state_t *st)
+{
+	nel_bits_free(&st->P_nb);
+	nel_bits_free(&st->ruleset_snap[0].active);
+	nel_bits_free(&st->ruleset_snap[1].active);
+	free(st->ruleset_checked);
+	free(st->probe);
+	free(st->score);
+}
+
+void cs_state_init(nel_state_t *st)
+{
+	int i;
+	
+	/* deactivate all rules by default */
+	nel_bits_clear(&st->P_nb);
+	for (i = 0; i < 2; i++) {
+		nel_bits_clear(&st->ruleset_snap[i].active);
+		st->ruleset_snap[i].epoch = 0;
+		st->ruleset_snap[i].readers = 0;
+	}
+	st->ruleset = &st->ruleset_snap[0];
+	for (i = 0; i < nel_nrules; i++)
+		st->ruleset_checked[i] = (time_t) st->now(st);
+	st->next_proto = 0;
+	bzero(st->probe, nel_nrules * sizeof(nel_probe_stat_t));
+}
+
+/* the current snapshot of the simulated warden's ruleset; the reloader
+ * does not reuse it before cs_ruleset_put() */
+static nel_ruleset_t *cs_ruleset_get(nel_state_t *st)
+{
+	nel_ruleset_t *rs;
+	
+	for (;;) {
+		rs = __atomic_load_n(&st->ruleset, __ATOMIC_ACQUIRE);
+		__atomic_add_fetch(&rs->readers, 1, __ATOMIC_ACQ_REL);
+		/* still current, i.e. the reloader did not start to refill it
+		 * before it saw us as a reader? */
+		if (rs == __atomic_load_n(&st->ruleset, __ATOMIC_ACQUIRE))
+			return rs;
+		__atomic_sub_fetch(&rs->readers, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static void cs_ruleset_put(nel_ruleset_t *rs)
+{
+	__atomic_sub_fetch(&rs->readers, 1, __ATOMIC_RELEASE);
+}
+
+/* simulated warden: is `announced_proto' currently blocked? */
+int cs_warden_blocks(nel_state_t *st, u_int32_t announced_proto)
+{
+	nel_ruleset_t *rs;
+	int blocked;
+	
+	switch (st->cfg->warden_mode) {
+	case WARDEN_MODE_NO_WARDEN:
+		/* blocks none of the CCs, whatever SIM_LIMIT_FOR_BLOCKED_SENDING is */
+		return 0;
+	case WARDEN_MODE_REG_WARDEN:
+		return (announced_proto >= st->cfg->sim_limit);
+	case WARDEN_MODE_DYN_WARDEN:
+		/* FALLTHROUGH */
+	case WARDEN_MODE_ADP_WARDEN:
+		rs = cs_ruleset_get(st);
+		blocked = nel_bit_test(&rs->active, announced_proto);
+		cs_ruleset_put(rs);
+		return blocked;
+	}
+	return 0;
+}
+
+/* send one NEL probe packet (or pretend to, if the warden blocks it) */
+void cs_NEL_send_probe(nel_state_t *st, u_int32_t announced_proto)
+{
+	/* NEW (0.2.6): simulate a simple regular warden that blocks a fraction of the CCs */
+	if (!cs_warden_blocks(st, announced_proto)) {
+		st->send(st, announced_proto, NEL_PHASE_NEL);
+		if (st->cfg->warden_mode == WARDEN_MODE_ADP_WARDEN) {
+			/* register rule as recently checked */
+			__atomic_store_n(&st->ruleset_checked[announced_proto],
+				(time_t) st->now(st), __ATOMIC_RELAXED);
+		}
+	} else {
+		st->pretend(st, announced_proto); /* just consume time */
+	}
+}
+
+/* NEL_ANNOUNCE_POS() of the probe `protos[i]' of a batch: the probes are
+ * sent in the order of `protos' */
+u_int32_t cs_NEL_announce_pos(nel_state_t *st, const u_int32_t *protos, int i)
+{
+	u_int32_t native = 0, scapy = 0;
+	int j;
+	
+	for (j = 0; j <= i; j++) {
+		if (st->native(st, protos[j]))
+			native++;
+		else
+			scapy++;
+	}
+	return NEL_ANNOUNCE_POS(native, scapy);
+}
+
+/* the CR's feedback for a probed protocol: update P_nb accordingly */
+void cs_NEL_feedback(nel_state_t *st, u_int32_t announced_proto, u_int32_t result)
+{
+	probe_verdict(st, announced_proto, result == 1);
+	if (nel_bit_assign(&st->P_nb, announced_proto, result == 1) == 0
+	    && result == 1 && st->nb_found != NULL)
+		st->nb_found(st);
+}
+
+/* send one COMM phase packet of a non-blocked protocol */
+void cs_COMM_send_pkt(nel_state_t *st, u_int32_t announced_proto)
+{
+	/* use this non-blocked protocol + try sending it! */
+	if (st->cfg->warden_mode == WARDEN_MODE_NO_WARDEN
+	    || !cs_warden_blocks(st, announced_proto)) {
+		st->send(st, announced_proto, NEL_PHASE_COMM);
+	} else {
+		st->pretend(st, announced_proto); /* just consume time */
+	}
+	if (st->cfg->warden_mode == WARDEN_MODE_ADP_WARDEN) {
+		/* register rule as recently checked */
+		__atomic_store_n(&st->ruleset_checked[announced_proto],
+			(time_t) st->now(st), __ATOMIC_RELAXED);
+	}
+}
+
+/* ADAPTIVE warden: a rule triggered at `t' and another one triggered at
+ * `u': is the first one less recent? (ties: the higher rule is) */
+#define CS_LESS_RECENT(t, rule, u, rule2) \
+	((t) < (u) || ((t) == (u) && (rule) > (rule2)))
+
+typedef struct {
+	time_t		t;
+	u_int32_t	rule;
+} cs_trigger_t;
+
+/* restore the min-heap property (least recent trigger at the top) below
+ * position `i' */
+static inline void cs_trigger_sift_down(cs_trigger_t *heap, int n, int i)
+{
+	cs_trigger_t e = heap[i];
+	int c;
+	
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && CS_LESS_RECENT(heap[c + 1].t, heap[c + 1].rule,
+		    heap[c].t, heap[c].rule))
+			c++;
+		if (!CS_LESS_RECENT(heap[c].t, heap[c].rule, e.t, e.rule))
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = e;
+}
+
+/* ADAPTIVE warden: the (at most) `k' most recently triggered rules, most
+ * recent first; one pass over ruleset_checked with a min-heap of the `k'
+ * best so far, i.e. O(N log K) */
+static int cs_top_triggered(nel_state_t *st, cs_trigger_t *heap, int k)
+{
+	u_int32_t rule;
+	time_t t, min_t = 0;
+	int n = 0, i;
+	cs_trigger_t e;
+	
+	if (k <= 0)
+		return 0;
+	for (rule = 0; rule < nel_nrules; rule++) {
+		t = __atomic_load_n(&st->ruleset_checked[rule], __ATOMIC_RELAXED);
+		/* not triggered since its last activation (0) or, once the heap
+		 * is full, not more recent than its top: rules come in
+		 * ascending order, i.e. lose ties */
+		if (t <= min_t)
+			continue;
+		if (n < k) {
+			/* sift up */
+			for (i = n++; i > 0 && CS_LESS_RECENT(t, rule,
+			     heap[(i - 1) / 2].t, heap[(i - 1) / 2].rule); i = (i - 1) / 2)
+				heap[i] = heap[(i - 1) / 2];
+			heap[i].t = t;
+			heap[i].rule = rule;
+		} else {
+			heap[0].t = t;
+			heap[0].rule = rule;
+			cs_trigger_sift_down(heap, n, 0);
+		}
+		if (n == k)
+			min_t = heap[0].t;
+	}
+	/* heap sort: pop the least recent to the end */
+	for (i = n - 1; i > 0; i--) {
+		e = heap[0];
+		heap[0] = heap[i];
+		heap[i] = e;
+		cs_trigger_sift_down(heap, i, 0);
+	}
+	return n;
+}
+
+/* a random number in [0, n) from the splitmix64 sequence `x' (Lemire's
+ * multiply-shift instead of a modulo) */
+static inline u_int32_t cs_rand_below(u_int64_t *x, u_int32_t n)
+{
+	u_int64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+	
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z ^= z >> 31;
+	return (u_int32_t) (((z >> 32) * (u_int64_t) n) >> 32);
+}
+
+/* DYNAMIC and ADAPTIVE warden: shuffle the active rules. The new ruleset is
+ * built in the snapshot that is not current and published at once; the
+ * senders keep using the previous one until then. */
+void cs_reload_rules(nel_state_t *st)
+{
+	int i, n_active, n_promoted = 0, n_free = 0, n_draw, invert;
+	u_int32_t rule, j, tmp;
+	u_int64_t x;
+	u_int32_t *free_rules;
+	cs_trigger_t *promoted;
+	nel_bitset_t act;
+	nel_ruleset_t *cur, *next;
+	
+	cur = __atomic_load_n(&st->ruleset, __ATOMIC_ACQUIRE);
+	next = (cur == &st->ruleset_snap[0] ? &st->ruleset_snap[1] : &st->ruleset_snap[0]);
+	/* grace period: senders that got `next' before the last reload may
+	 * still read it */
+	while (__atomic_load_n(&next->readers, __ATOMIC_ACQUIRE) != 0)
+		sched_yield();
+	
+	/* shuffle rules: first set all rules to zero (=deactivated) */
+	nel_bits_init(&act);
+	free_rules = nel_calloc(nel_nrules, sizeof(u_int32_t));
+	promoted = nel_calloc(st->cfg->inactive2active, sizeof(cs_trigger_t));
+	/* the number of rules the warden activates (blocks) */
+	n_active = (int) nel_nrules - (int) st->cfg->sim_limit;
+	
+	if (st->cfg->warden_mode == WARDEN_MODE_ADP_WARDEN) {
+		/* take the SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE latest triggered (checked) inactive rules into
+		 * the active ruleset (and reset them to zero) */
+		n_promoted = cs_top_triggered(st, promoted, (int) st->cfg->inactive2active);
+		if (st->verbose)
+			printf("Activated the following previously triggered inactive rules: ");
+		for (i = 0; i < n_promoted; i++) {
+			rule = promoted[i].rule;
+			act.w[rule / 64] |= (u_int64_t) 1 << (rule % 64);
+			/* set the rule's value to zero so that the rule must first be triggered again before
+			 * being used; has a negliable race condition as COM phase could just re-set the same
+			 * rule again, but this is very unlikely and would influence the measurements very,
+			 * very slightly, if at all. */
+			__atomic_store_n(&st->ruleset_checked[rule], 0, __ATOMIC_RELAXED);
+			if (st->verbose)
+				printf("%u, ", rule);
+		}
+		if (st->verbose)
+			printf("\n");
+	}
+	
+	/* DYNAMIC: activate 50-SIM_LIMIT_FOR_BLOCKED_SENDING protocols randomly; ADAPTIVE: activate
+	 * the remaining ones randomly. A partial Fisher-Yates shuffle of the inactive rules draws
+	 * them without repetition, i.e. without searching for a rule that is not yet active. If
+	 * most of them are to be activated, the ones that stay inactive are drawn instead. */
+	for (rule = 0; rule < nel_nrules; rule++) {
+		if (!((act.w[rule / 64] >> (rule % 64)) & 1))
+			free_rules[n_free++] = rule;
+	}
+	n_draw = n_active - n_promoted;
+	if (n_draw > n_free)
+		n_draw = n_free;
+	invert = (n_draw > n_free / 2);
+	if (invert)
+		n_draw = n_free - n_draw;
+	/* one seed per reload keeps st->seed's sequence reproducible */
+	x = (u_int64_t) rand_r(&st->seed) << 32 | (u_int32_t) rand_r(&st->seed);
+	for (i = 0; i < n_draw; i++) {
+		j = i + cs_rand_below(&x, n_free - i);
+		tmp = free_rules[j];
+		free_rules[j] = free_rules[i];
+		free_rules[i] = tmp;
+		if (!invert)
+			act.w[tmp / 64] |= (u_int64_t) 1 << (tmp % 64);
+	}
+	for (i = n_draw; invert && i < n_free; i++)
+		act.w[free_rules[i] / 64] |= (u_int64_t) 1 << (free_rules[i] % 64);
+	
+	/* publish the new ruleset */
+	nel_bits_copy(&next->active, &act);
+	next->epoch = cur->epoch + 1;
+	__atomic_store_n(&st->ruleset, next, __ATOMIC_RELEASE);
+	
+	if (st->verbose) {
+		printf("activated rules (epoch %u): {", next->epoch);
+		for (rule = 0; rule < nel_nrules; rule++)
+			printf("%i,", nel_bit_test(&act, rule));
+		printf("}\n");
+	}
+	nel_bits_free(&act);
+	free(free_rules);
+	free(promoted);
+}
+
+/*************************
+ * NEL PHASE
+ *************************/
+
+/* CS: the CR's result for the announcement `msg->seq' of the current batch
+ * (the announcements first_seq .. first_seq+n-1) */
+static void cs_NEL_result(nel_state_t *st, const nel_proto_t *msg,
+	const u_int32_t *protos, u_int32_t first_seq, int n)
+{
+	u_int32_t i = msg->seq - first_seq;
+	
+	if (i >= (u_int32_t) n || msg->announced_proto != nel_rules[protos[i]].id) {
+		fprintf(stderr, "invalid result (seq=%u, proto=%u) from CR. Exiting.\n",
+			msg->seq, msg->announced_proto);
+		exit(1);
+	}
+	/* update P_nb accordingly */
+	cs_NEL_feedback(st, protos[i], msg->result);
+	fprintf(stderr, "\trecv'd feedback for proto=%u, "
+			"result=%u, ", protos[i], msg->result);
+	/* show P_nb for debugging and rule checking */
+	print_Pnb(st);
+}
+
+/* CS: 1) announce a batch of protocols to the receiver, 2) transfer the CC
+ * test packets of all of them once the CR is armed, and 3) receive the
+ * results (blocking I/O) via NEL meta communication channel as they come
+ * in. The CR may already send results while we wait for its `armed'
+ * messages (e.g. when COMM traffic completed a probe early). */
+void *cs_NEL_handler(void *sockfd_ptr)
+{
+	int n;
+	nel_proto_t msg;
+	int *sockfd = (int *) sockfd_ptr;
+	int i, j, batch, armed, pending;
+	nel_state_t *st = &cs_state;
+	u_int8_t cfgmsg[NEL_CFGMSG_MAX];
+	u_int32_t *protos = nel_calloc(nel_nrules, sizeof(u_int32_t));
+	u_int32_t seq = 0, first_seq;
+	
+	st->seed = (unsigned int) time(NULL);
+	cs_state_init(st);
+	cs_print_config(st->cfg);
+	pthread_mutex_lock(&preparation_mtx);
 	preparation_done = 1;
+	pthread_cond_broadcast(&preparation_cond);
+	pthread_mutex_unlock(&preparation_mtx);
+	
+	/* tell the CR about our configuration */
+	n = cfg_encode(st->cfg, cfgmsg, sizeof(cfgmsg));
+	if (send(*sockfd, cfgmsg, n, 0) != n) {
+		perror("send(config)");
+		exit(1);
+	}
 
 	while (1) {
-		bzero(&buf, sizeof(buf));
-#ifdef INCREMENTAL_PROTO_SELECT
-		buf.announced_proto = p++ % ANNOUNCED_PROTO_NUMBERS;
-#else
-		/* randomly chose the protocol to try next */
-		srand(time(NULL));
-		buf.announced_proto = rand() % ANNOUNCED_PROTO_NUMBERS;
-#endif
-		buf.goalcfg = goalcfg_cs; /* tell the CR about our configuration */
-		if ((n = send(*sockfd, &buf, sizeof(buf), 0)) < 0) {
-			perror("send()");
-			sleep(1);
+		batch = (int) st->cfg->nel_batch;
+		probe_select(st, protos, batch);
+		first_seq = seq;
+		for (i = 0; i < batch; i++) {
+			if (nel_msg_send(*sockfd, NEL_MSG_ANNOUNCE, seq++,
+			    nel_rules[protos[i]].id,
+			    cs_NEL_announce_pos(st, protos, i)) != 0)
+				exit(1);
 		}
 		
-		sleep(1); /* wait one second before sending data (CR waits much
-			   * longer, so we will have no problem here). */
+		/* wait until the CR counts the packets of all announced
+		 * protocols, then send the probes right away */
+		for (armed = 0, pending = batch; armed < batch; ) {
+			if (nel_msg_recv(*sockfd, &msg) != 0) {
+				fprintf(stderr, "CR closed the feedback channel. Exiting.\n");
+				exit(1);
+			}
+			if (msg.type == NEL_MSG_ARMED) {
+				armed++;
+			} else if (msg.type == NEL_MSG_RESULT) {
+				cs_NEL_result(st, &msg, protos, first_seq, batch);
+				pending--;
+			}
+		}
 		
-		/* send NUM_NEL_TESTPKT_SND_PKTS_P_PROT packets of test traffic each time */
-		for (i = 0; i < NUM_NEL_TESTPKT_SND_PKTS_P_PROT /*XXX: NEL! */; i++) {
-			/* NEW (0.2.6): simulate a simple regular warden that blocks a fraction of the CCs */
-			if (WARDEN_MODE == WARDEN_MODE_REG_WARDEN || WARDEN_MODE == WARDEN_MODE_NO_WARDEN) {
-				/* In case of WARDEN_MODE_NO_WARDEN, SIM_LIMIT_FOR_BLOCKED_SENDING
-				 * must block none of the CCs! */
-				if (buf.announced_proto < SIM_LIMIT_FOR_BLOCKED_SENDING) {
-					send_CC_packet(buf.announced_proto);
-				} else {
-					pretend_sending(buf.announced_proto); /* just consume time */
-				}
-			} else if (WARDEN_MODE == WARDEN_MODE_DYN_WARDEN || WARDEN_MODE == WARDEN_MODE_ADP_WARDEN) {
-				/* send packet if protocol is NOT blocked */
-				if (ruleset_activation[buf.announced_proto] == 0) {
-					send_CC_packet(buf.announced_proto);
-					if (WARDEN_MODE == WARDEN_MODE_ADP_WARDEN) {
-						/* register rule as recently checked */
-						ruleset_checked[buf.announced_proto] = time(NULL);
-					}
-				} else {
-					pretend_sending(buf.announced_proto); /* just consume time */
-				}
+		/* send nel_pkts_per_proto packets of test traffic for each protocol */
+		for (j = 0; j < batch; j++) {
+			for (i = 0; i < st->cfg->nel_pkts_p_prot /*XXX: NEL! */; i++) {
+				cs_NEL_send_probe(st, protos[j]);
 			}
 		}
 		
-		/* after we sent the test packets for the selected hiding technique,
-		 * wait for the answer of the CR that informs us about the number of
-		 * packets it received of the particular CC hiding technique. */
-		if ((n = recv(*sockfd, &buf, sizeof(buf), 0)) < 0) {
-			perror("recv()");
-			sleep(1);
-		} if (n == 0) {
-			fprintf(stderr, "%%");
-			sleep(1);
-		} else {
-			/* update P_nb accordingly */
-			P_nb[buf.announced_proto] = buf.result;
-			fprintf(stderr, "\trecv'd feedback for proto=%u, "
-					"result=%u, ", buf.announced_proto,
-					buf.result);
-			/* show P_nb for debugging and rule checking */
-			print_Pnb();
+		/* after we sent the test packets for the selected hiding techniques,
+		 * wait for the answers of the CR that inform us whether it received
+		 * packets of the particular CC hiding technique. */
+		while (pending > 0) {
+			if (nel_msg_recv(*sockfd, &msg) != 0) {
+				fprintf(stderr, "CR closed the feedback channel. Exiting.\n");
+				exit(1);
+			}
+			if (msg.type == NEL_MSG_RESULT) {
+				cs_NEL_result(st, &msg, protos, first_seq, batch);
+				pending--;
+			}
 		}
 	}
 
@@ -376,152 +791,155 @@ void *cs_NEL_handler(void *sockfd_ptr)
 /*************************
  * COMMUNICATION PHASE
  *************************/
- 
+
+/* COMM phase packets actually sent (i.e. not blocked by the simulated
+ * warden and accepted by the kernel) since the COMM phase started; used
+ * for the rate report */
+static u_int64_t comm_pkts_tx = 0;
+
+/* eventfd the COMM thread waits on while P_nb is empty (-1: not created
+ * yet, i.e. the COMM thread did not look at P_nb yet either) */
+static int comm_efd = -1;
+
+/* nel_state_t.nb_found: the NEL thread found a non-blocked protocol */
+static void cs_nb_found(nel_state_t *st)
+{
+	int fd = __atomic_load_n(&comm_efd, __ATOMIC_ACQUIRE);
+	
+	if (fd >= 0 && write(fd, &(u_int64_t){1}, sizeof(u_int64_t)) < 0)
+		perror("write(eventfd)");
+}
+
+/* wait until P_nb is not empty any more */
+static void cs_COMM_wait(nel_state_t *st)
+{
+	u_int64_t cnt;
+	
+	/* a protocol found after this check still wakes us up: the eventfd
+	 * counts the wake-ups until we read it */
+	while (nel_bits_count(&st->P_nb) == 0) {
+		if (read(comm_efd, &cnt, sizeof(cnt)) < 0 && errno != EINTR) {
+			perror("read(eventfd)");
+			exit(1);
+		}
+	}
+}
+
+/* send one COMM phase packet, or queue it for the next burst */
+static void cs_COMM_send(u_int32_t announced_proto)
+{
+#ifdef USE_COMM_BATCH_TX
+	/* counted once pkt_burst_flush() sent it */
+	if (pkt_burst_add(announced_proto) == 0)
+		return;
+#endif
+	send_CC_packet(announced_proto);
+	comm_pkts_tx++;
+}
+
+/* print the achieved COMM phase packet rate (at most once per
+ * COMM_RATE_REPORT_INTERVAL seconds unless `final' is set) */
+static void cs_COMM_report_rate(int final)
+{
+	static struct timespec t_start, t_last;
+	static u_int64_t pkts_last = 0;
+	struct timespec t_now;
+	double dt_last, dt_start;
+
+	clock_gettime(CLOCK_MONOTONIC, &t_now);
+	if (t_start.tv_sec == 0 && t_start.tv_nsec == 0) {
+		t_start = t_last = t_now;
+		return;
+	}
+	dt_last = (t_now.tv_sec - t_last.tv_sec) + (t_now.tv_nsec - t_last.tv_nsec) / 1.0e9;
+	dt_start = (t_now.tv_sec - t_start.tv_sec) + (t_now.tv_nsec - t_start.tv_nsec) / 1.0e9;
+	if (final) {
+		fprintf(stderr, "COMM phase: %" PRIu64 " packets sent in %.3f sec "
+			"(%.1f pkts/s on average), %" PRIu64 " dropped\n",
+			comm_pkts_tx, dt_start,
+			dt_start > 0 ? comm_pkts_tx / dt_start : 0.0,
+			pkt_burst_drops());
+	} else if (dt_last >= COMM_RATE_REPORT_INTERVAL) {
+		fprintf(stderr, "COMM phase: %.1f pkts/s (%" PRIu64 " packets sent "
+			"so far)\n", (comm_pkts_tx - pkts_last) / dt_last,
+			comm_pkts_tx);
+		t_last = t_now;
+		pkts_last = comm_pkts_tx;
+	}
+}
+
 void *cs_COMM_sender(void *unused)
 {
-	int i;
+	int i, fd;
 	int pkts_sent = 0;
 	int sent_during_current_loop;
-	nel_proto_t proto;
+	nel_state_t *st = &cs_state;
+	
+	if ((fd = eventfd(0, 0)) < 0) {
+		perror("eventfd");
+		exit(1);
+	}
+	__atomic_store_n(&comm_efd, fd, __ATOMIC_RELEASE);
+	cs_COMM_report_rate(0); /* start the rate measurement */
 	
-	/* iterate through P_bn to send NUM_COMM_PHASE_PKTS packets,
+	/* iterate through P_bn to send comm_pkts packets,
 	 * only use available protocols marked as non-blocked in P_nb
 	 */
-	while (pkts_sent < NUM_COMM_PHASE_PKTS) {
+	while (pkts_sent < st->cfg->comm_pkts) {
 		sent_during_current_loop = 0;
-		for (i = 0; i < ANNOUNCED_PROTO_NUMBERS; i++) {
-			proto.announced_proto = i;
-			if (P_nb[i] == 1) {
-				//printf("non-blocked protocol %i found\n", i);
-				/* We found a non-blocked protocol, now use this protocol to
-				 * send NUM_COMM_PHASE_SND_PKTS_P_PROT packets. */
-				int pkt_cnt = 0;
-				for (pkt_cnt = 0;
-					 pkt_cnt < NUM_COMM_PHASE_SND_PKTS_P_PROT /*XXX: COMM-P.! */;
-					 pkt_cnt++) {
-					/* use this non-blocked protocol + try sending it! */
-					if (WARDEN_MODE == WARDEN_MODE_NO_WARDEN) {
-						send_CC_packet(proto.announced_proto);
-					} else {
-						if (WARDEN_MODE == WARDEN_MODE_REG_WARDEN) {
-							if (proto.announced_proto < SIM_LIMIT_FOR_BLOCKED_SENDING) {
-								send_CC_packet(proto.announced_proto);
-							} else {
-								pretend_sending(proto.announced_proto); /* just consume time */
-							}
-						} else if (WARDEN_MODE == WARDEN_MODE_DYN_WARDEN || WARDEN_MODE == WARDEN_MODE_ADP_WARDEN) {
-								if (ruleset_activation[proto.announced_proto] == 0) {
-									send_CC_packet(proto.announced_proto);
-								} else {
-									pretend_sending(proto.announced_proto); /* just consume time */
-								}
-								
-								if (WARDEN_MODE == WARDEN_MODE_ADP_WARDEN) {
-									/* register rule as recently checked */
-									ruleset_checked[proto.announced_proto] = time(NULL);
-								}
-						}
-					}
-				}
-				pkts_sent += NUM_COMM_PHASE_SND_PKTS_P_PROT;
-				sent_during_current_loop = 1;
-			} else {
-				//printf("skipping blocked protocol\n");
+		/* visit the non-blocked protocols only */
+		for (i = nel_bits_next(&st->P_nb, 0); i >= 0;
+		     i = nel_bits_next(&st->P_nb, i + 1)) {
+			/* We found a non-blocked protocol, now use this protocol to
+			 * send comm_pkts_per_proto packets. */
+			int pkt_cnt = 0;
+			for (pkt_cnt = 0;
+				 pkt_cnt < st->cfg->comm_pkts_p_prot /*XXX: COMM-P.! */;
+				 pkt_cnt++) {
+				cs_COMM_send_pkt(st, i);
 			}
+			pkts_sent += st->cfg->comm_pkts_p_prot;
+			sent_during_current_loop = 1;
 		}
+#ifdef USE_COMM_BATCH_TX
+		/* send the burst of this pass over P_nb */
+		comm_pkts_tx += pkt_burst_flush();
+#endif
+		cs_COMM_report_rate(0);
 		/* if we found no non-blocked protocol, NEL is either
 		 * not initially completed or needs to re-run, so we
-		 * need to wait a little */
+		 * wait until it finds one */
 		if (sent_during_current_loop == 0)
-			sleep(1);
+			cs_COMM_wait(st);
 	}
 
-	fprintf(stderr, "\n===== COMMUNICATION PHASE COMPLETED (or reached limit of packets to send -- NUM_COMM_PHASE_PKTS) =====\n");
+	fprintf(stderr, "\n===== COMMUNICATION PHASE COMPLETED (or reached limit of packets to send -- comm_pkts) =====\n");
 	fprintf(stderr, "\n===== %i packets have been sent.\n", pkts_sent);
+	cs_COMM_report_rate(1);
 	fprintf(stderr, "exiting.\n");
 	exit(0);
 	/* NOTREACHED */
 	return NULL;
 }
 
-/* For DYNAMIC and ADAPTIVE warden only: shuffle rules every RELOAD_INTERVAL [sec] */
+/* For DYNAMIC and ADAPTIVE warden only: shuffle rules every reload_interval [sec] */
 void *cs_RuleReloader(void *unused)
 {
 	time_t last_timestamp = 0; /* force shuffling on loop entry */
 
 	/* wait until preparation is done */
-	while (preparation_done == 0) {
-		usleep(10000);
-	}
+	pthread_mutex_lock(&preparation_mtx);
+	while (preparation_done == 0)
+		pthread_cond_wait(&preparation_cond, &preparation_mtx);
+	pthread_mutex_unlock(&preparation_mtx);
 	
-	if (WARDEN_MODE == WARDEN_MODE_DYN_WARDEN || WARDEN_MODE == WARDEN_MODE_ADP_WARDEN) {
+	if (cs_state.cfg->warden_mode == WARDEN_MODE_DYN_WARDEN
+	    || cs_state.cfg->warden_mode == WARDEN_MODE_ADP_WARDEN) {
 		while (1) {
 				/* check if time for shuffling activated rules is due */
-				if ((last_timestamp + RELOAD_INTERVAL) < time(NULL)) {
+				if ((last_timestamp + cs_state.cfg->reload_interval) < time(NULL)) {
 					last_timestamp = time(NULL);
-					int counter = 0;
-					int inactive2active = 0;
-					/* shuffle rules: first set all rules to zero (=deactivated) */
-					bzero(ruleset_activation, sizeof(ruleset_activation));
-					
-					switch (WARDEN_MODE) {
-						case WARDEN_MODE_DYN_WARDEN:
-							/* activate 50-SIM_LIMIT_FOR_BLOCKED_SENDING protocols randomly */
-							for (counter = 0; counter < (ANNOUNCED_PROTO_NUMBERS - SIM_LIMIT_FOR_BLOCKED_SENDING); counter++) {
-								int rule = rand() % ANNOUNCED_PROTO_NUMBERS;
-								/* find next suitable slot */
-								/* find the next free protocol to activate in case the current one is already activated */
-								while (ruleset_activation[rule % ANNOUNCED_PROTO_NUMBERS] == 1) {
-									rule++;
-								}
-								ruleset_activation[rule % ANNOUNCED_PROTO_NUMBERS] = 1;
-							}
-							break;
-						case WARDEN_MODE_ADP_WARDEN:
-							/* take the SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE latest triggered (checked) inactive rules into
-							 * the active ruleset (and reset them to zero) */
-							printf("Activated the following previously triggered inactive rules: ");
-							for (inactive2active = 0; inactive2active < SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE; inactive2active++) {
-								time_t max_time = 0;
-								int max_node = 0;
-								/* find max value (most recent trigger) */
-								for (counter = inactive2active; counter < ANNOUNCED_PROTO_NUMBERS; counter++) {
-									if (max_time < ruleset_checked[counter]) {
-										max_time = ruleset_checked[counter];
-										max_node = counter;
-									}
-								}
-								/* active rule with max value; has a negliable race condition as COM phase could just
-								 * re-set the same rule again, but this is very unlikely and would influence the
-								 * measurements very, very slightly, if at all. */
-								ruleset_activation[max_node] = 1;
-								// set the rule's value to zero so that the rule must first be triggered again before being used
-								ruleset_checked[max_node] = 0;
-								printf("%i, ", max_node);
-							}
-							printf("result: {");
-							for (counter = 0; counter < ANNOUNCED_PROTO_NUMBERS; counter++)
-								printf("%i,", ruleset_activation[counter]);
-							printf("}\n");
-							/* activate the remaining 50-SIM_LIMIT_FOR_BLOCKED_SENDING-SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE
-							 * protocols randomly */
-							for (counter = 0;
-								 counter < (ANNOUNCED_PROTO_NUMBERS - SIM_LIMIT_FOR_BLOCKED_SENDING
-											- SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE); counter++) {
-								int rule = rand() % ANNOUNCED_PROTO_NUMBERS;
-								/* find next suitable slot */
-								/* find the next free protocol to activate in case the current one is already activated */
-								while (ruleset_activation[rule % ANNOUNCED_PROTO_NUMBERS] == 1) {
-									rule++;
-								}
-								ruleset_activation[rule % ANNOUNCED_PROTO_NUMBERS] = 1;
-							}
-							break;
-					}
-					printf("activated rules: {");
-					for (counter = 0; counter < ANNOUNCED_PROTO_NUMBERS; counter++)
-						printf("%i,", ruleset_activation[counter]);
-					printf("}\n");
+					cs_reload_rules(&cs_state);
 				}
 				usleep(200000);
 				//fprintf(stderr,"=================RULE RELOAD CHECK===============\n");
@@ -532,4 +950,3 @@ void *cs_RuleReloader(void *unused)
 	}
 	return NULL;
 }
-
@@ -0,0 +1,671 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+
+/* Multi-flow sender: runs `count' NEL senders (flows) in one process. Every
+ * flow is the sender of cs.c -- NEL handler, COMM sender and rule reloader
+ * on its own nel_state_t -- but instead of three threads per flow, each of
+ * them is a task that does a bounded amount of work and then tells the
+ * pool what it waits for: nothing (run again), a point in time (sleep) or
+ * data on a file descriptor (feedback channel, COMM wake-up). A small pool
+ * of worker threads runs the tasks. Every worker keeps runnable tasks in
+ * its own deque; a worker without work steals the oldest task of another
+ * worker, or collects the tasks whose time or feedback arrived. */
+
+#define CS_TASK_NEL		0
+#define CS_TASK_COMM		1
+#define CS_TASK_RELOAD		2
+#define CS_TASKS		3
+
+/* what a task waits for after it ran */
+#define CS_RUN_AGAIN		0
+#define CS_RUN_SLEEP		1	/* until task->due */
+#define CS_RUN_WAITFD		2	/* until task->fd is readable */
+#define CS_RUN_DONE		3
+
+/* NEL task of a flow */
+#define CS_NEL_ANNOUNCE		0	/* announce the next batch */
+#define CS_NEL_ARMING		1	/* wait for the CR's `armed' messages */
+#define CS_NEL_COLLECT		2	/* probes sent, wait for the results */
+
+/* busy workers look for due and readable tasks every CS_POLL_RUNS runs */
+#define CS_POLL_RUNS		16
+
+struct cs_flow;
+
+typedef struct {
+	struct cs_flow	*flow;
+	int		kind;		/* CS_TASK_* */
+	double		due;		/* CS_RUN_SLEEP */
+	int		fd;		/* CS_RUN_WAITFD */
+	int		polled;		/* fd added to the pool's epoll set */
+} cs_task_t;
+
+typedef struct cs_flow {
+	u_int32_t	id;
+	nel_cfg_t	cfg;		/* nel_cfg, but with the flow's src_addr */
+	nel_state_t	st;
+	int		fd;		/* feedback channel */
+	int		comm_efd;	/* eventfd: P_nb gained a protocol */
+	struct in_addr	src;		/* warden-link source address */
+	cs_task_t	task[CS_TASKS];
+	int		ntasks;		/* tasks not done yet (atomic) */
+	int		done;		/* flow ends (atomic) */
+	double		t_start, t_end;
+	/* NEL task */
+	int		nel;		/* CS_NEL_* */
+	u_int32_t	*protos;	/* per rule */
+	int		batch, armed, pending;
+	u_int32_t	seq, first_seq;
+	u_int32_t	probes, probes_ok;
+	/* COMM task */
+	u_int32_t	comm_sent;	/* actually sent, see cs_flow_send() */
+	pkt_burst_t	burst;
+	/* reloader task */
+	time_t		reload_last;
+} cs_flow_t;
+
+/* a worker's runnable tasks: a ring buffer of which the owner pops the
+ * newest task (tail) while thieves take the oldest one (head) */
+typedef struct {
+	pthread_t	th;
+	int		id;
+	pthread_mutex_t	mtx;
+	cs_task_t	**q;
+	int		head, n;
+	unsigned int	seed;		/* victim selection */
+	u_int64_t	runs, steals;
+} cs_worker_t;
+
+static struct {
+	cs_worker_t	*w;
+	int		nw;
+	int		cap;		/* capacity of each deque */
+	int		epfd;		/* feedback channels of waiting tasks */
+	pthread_mutex_t	sleep_mtx;
+	cs_task_t	**sleeping;	/* min-heap by due */
+	int		nsleeping;
+	int		flows_left;	/* atomic */
+} cs_pool;
+
+static cs_flow_t *cs_flow;
+static int cs_nflows;
+
+/*************************
+ * FLOWS
+ *************************/
+
+static double cs_flow_now(nel_state_t *st)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1.0e9;
+}
+
+/* nel_state_t.send of a flow: the native engine with the flow's source
+ * address; scapy (host's source address) for all other rules */
+static void cs_flow_send(nel_state_t *st, u_int32_t announced_proto, int phase)
+{
+	cs_flow_t *f = st->priv;
+
+#ifdef USE_NATIVE_PKT_ENGINE
+	if (phase == NEL_PHASE_COMM) {
+		/* counted once pkt_burst_flush_src() sent it */
+		if (pkt_burst_add_src(&f->burst, announced_proto, f->src) == 0)
+			return;
+	} else if (pkt_send_native_src(announced_proto, f->src) == 0) {
+		return;
+	}
+#endif
+	send_CC_packet(announced_proto);
+	if (phase == NEL_PHASE_COMM)
+		f->comm_sent++;
+}
+
+static void cs_flow_pretend(nel_state_t *st, u_int32_t announced_proto)
+{
+	pretend_sending(announced_proto);
+}
+
+static int cs_flow_native(nel_state_t *st, u_int32_t announced_proto)
+{
+#ifdef USE_NATIVE_PKT_ENGINE
+	return pkt_is_native(announced_proto);
+#else
+	return 0;
+#endif
+}
+
+/* wake the flow's idle COMM task */
+static void cs_flow_nb_found(nel_state_t *st)
+{
+	cs_flow_t *f = st->priv;
+	
+	if (write(f->comm_efd, &(u_int64_t){1}, sizeof(u_int64_t)) < 0)
+		perror("write(eventfd)");
+}
+
+/* let all tasks of the flow end: the NEL and COMM task may wait for their
+ * fds, so make them readable */
+static void cs_flow_end(cs_flow_t *f)
+{
+	if (__atomic_exchange_n(&f->done, 1, __ATOMIC_ACQ_REL) == 0) {
+		f->t_end = cs_flow_now(&f->st);
+		shutdown(f->fd, SHUT_RDWR);
+		cs_flow_nb_found(&f->st);
+	}
+}
+
+/* the last task of the flow ended */
+static void cs_flow_finish(cs_flow_t *f)
+{
+	int i;
+	
+	for (i = 0; i < CS_TASKS; i++) {
+		if (f->task[i].polled)
+			epoll_ctl(cs_pool.epfd, EPOLL_CTL_DEL, f->task[i].fd, NULL);
+	}
+	close(f->fd);
+	close(f->comm_efd);
+	__atomic_sub_fetch(&cs_pool.flows_left, 1, __ATOMIC_ACQ_REL);
+}
+
+/* the CR's result for the announcement `msg->seq' of the current batch */
+static int cs_flow_result(cs_flow_t *f, const nel_proto_t *msg)
+{
+	u_int32_t i = msg->seq - f->first_seq;
+	
+	if (i >= (u_int32_t) f->batch
+	    || msg->announced_proto != nel_rules[f->protos[i]].id) {
+		fprintf(stderr, "flow %u: invalid result (seq=%u, proto=%u) from "
+			"CR.\n", f->id, msg->seq, msg->announced_proto);
+		return -1;
+	}
+	cs_NEL_feedback(&f->st, f->protos[i], msg->result);
+	f->probes++;
+	if (msg->result == 1)
+		f->probes_ok++;
+	return 0;
+}
+
+/* NEL task: cs_NEL_handler() as a state machine that never blocks */
+static int cs_flow_nel(cs_flow_t *f)
+{
+	nel_proto_t msg;
+	int i, j, n;
+	
+	if (f->nel == CS_NEL_ANNOUNCE) {
+		f->batch = (int) f->cfg.nel_batch;
+		probe_select(&f->st, f->protos, f->batch);
+		f->first_seq = f->seq;
+		for (i = 0; i < f->batch; i++) {
+			if (nel_msg_send(f->fd, NEL_MSG_ANNOUNCE, f->seq++,
+			    nel_rules[f->protos[i]].id,
+			    cs_NEL_announce_pos(&f->st, f->protos, i)) != 0) {
+				cs_flow_end(f);
+				return CS_RUN_DONE;
+			}
+		}
+		f->armed = 0;
+		f->pending = f->batch;
+		f->nel = CS_NEL_ARMING;
+		return CS_RUN_WAITFD;
+	}
+	
+	/* consume all complete messages */
+	while ((n = recv(f->fd, &msg, sizeof(msg), MSG_PEEK | MSG_DONTWAIT))
+	    == sizeof(msg)) {
+		if (nel_msg_recv(f->fd, &msg) != 0) {
+			cs_flow_end(f);
+			return CS_RUN_DONE;
+		}
+		if (msg.type == NEL_MSG_ARMED) {
+			f->armed++;
+		} else if (msg.type == NEL_MSG_RESULT) {
+			if (cs_flow_result(f, &msg) != 0) {
+				cs_flow_end(f);
+				return CS_RUN_DONE;
+			}
+			f->pending--;
+		}
+	}
+	if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		/* the CR completed its measurement of this flow (or failed) */
+		cs_flow_end(f);
+		return CS_RUN_DONE;
+	}
+	
+	if (f->nel == CS_NEL_ARMING && f->armed == f->batch) {
+		for (j = 0; j < f->batch; j++) {
+			for (i = 0; i < f->cfg.nel_pkts_p_prot; i++)
+				cs_NEL_send_probe(&f->st, f->protos[j]);
+		}
+		f->nel = CS_NEL_COLLECT;
+	}
+	if (f->nel == CS_NEL_COLLECT && f->pending == 0) {
+		f->nel = CS_NEL_ANNOUNCE;
+		return CS_RUN_AGAIN;
+	}
+	return CS_RUN_WAITFD;
+}
+
+/* COMM task: one pass of cs_COMM_sender() over P_nb */
+static int cs_flow_comm(cs_task_t *t)
+{
+	cs_flow_t *f = t->flow;
+	int i, j, sent = 0;
+	u_int64_t cnt;
+	
+	/* consume the wake-ups; we look at P_nb anyway */
+	if (read(f->comm_efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		perror("read(eventfd)");
+	for (i = nel_bits_next(&f->st.P_nb, 0); i >= 0;
+	     i = nel_bits_next(&f->st.P_nb, i + 1)) {
+		for (j = 0; j < f->cfg.comm_pkts_p_prot; j++)
+			cs_COMM_send_pkt(&f->st, i);
+		sent = 1;
+	}
+#ifdef USE_NATIVE_PKT_ENGINE
+	f->comm_sent += pkt_burst_flush_src(&f->burst);
+#endif
+	if (f->comm_sent >= f->cfg.comm_pkts) {
+		cs_flow_end(f);
+		return CS_RUN_DONE;
+	}
+	/* NEL did not find a non-blocked protocol (yet): wait until it does
+	 * (a protocol found since the read() above left the eventfd readable) */
+	return (sent ? CS_RUN_AGAIN : CS_RUN_WAITFD);
+}
+
+/* reloader task: cs_RuleReloader() */
+static int cs_flow_reload(cs_task_t *t)
+{
+	cs_flow_t *f = t->flow;
+	
+	if ((f->reload_last + f->cfg.reload_interval) < time(NULL)) {
+		f->reload_last = time(NULL);
+		cs_reload_rules(&f->st);
+	}
+	t->due = cs_flow_now(&f->st) + 0.2;
+	return CS_RUN_SLEEP;
+}
+
+/* connect flow `i' to the CR and send its configuration */
+static void cs_flow_init(cs_flow_t *f, u_int32_t i, struct sockaddr_in *srv,
+	u_int32_t src_base)
+{
+	u_int8_t cfgmsg[NEL_CFGMSG_MAX];
+	int n;
+	
+	bzero(f, sizeof(*f));
+	f->id = i;
+	f->cfg = nel_cfg;
+	f->cfg.src_addr = src_base + i;
+	f->src.s_addr = htonl(f->cfg.src_addr);
+	f->st.now = cs_flow_now;
+	f->st.send = cs_flow_send;
+	f->st.pretend = cs_flow_pretend;
+	f->st.native = cs_flow_native;
+	f->st.nb_found = cs_flow_nb_found;
+	f->st.cfg = &f->cfg;
+	f->st.priv = f;
+	f->st.seed = (unsigned int) time(NULL) + i * 7919;
+	cs_state_alloc(&f->st);
+	cs_state_init(&f->st);
+	f->protos = nel_calloc(nel_nrules, sizeof(u_int32_t));
+	
+	if ((f->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	if (connect(f->fd, (struct sockaddr *) srv, sizeof(*srv)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+	n = cfg_encode(&f->cfg, cfgmsg, sizeof(cfgmsg));
+	if (send(f->fd, cfgmsg, n, 0) != n) {
+		perror("send(config)");
+		exit(1);
+	}
+	if ((f->comm_efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+		perror("eventfd");
+		exit(1);
+	}
+	f->t_start = cs_flow_now(&f->st);
+	
+	f->task[CS_TASK_NEL].kind = CS_TASK_NEL;
+	f->task[CS_TASK_COMM].kind = CS_TASK_COMM;
+	f->task[CS_TASK_RELOAD].kind = CS_TASK_RELOAD;
+	for (n = 0; n < CS_TASKS; n++)
+		f->task[n].flow = f;
+	f->task[CS_TASK_NEL].fd = f->fd;
+	f->task[CS_TASK_COMM].fd = f->comm_efd;
+	f->task[CS_TASK_RELOAD].fd = -1;
+	f->ntasks = (f->cfg.warden_mode == WARDEN_MODE_DYN_WARDEN
+		|| f->cfg.warden_mode == WARDEN_MODE_ADP_WARDEN) ? 3 : 2;
+}
+
+/*************************
+ * WORK-STEALING POOL
+ *************************/
+
+/* the owner's end of the deque */
+static void cs_deque_push(cs_worker_t *w, cs_task_t *t)
+{
+	pthread_mutex_lock(&w->mtx);
+	w->q[(w->head + w->n++) % cs_pool.cap] = t;
+	pthread_mutex_unlock(&w->mtx);
+}
+
+/* a task that yields goes to the thieves' end, behind all others */
+static void cs_deque_yield(cs_worker_t *w, cs_task_t *t)
+{
+	pthread_mutex_lock(&w->mtx);
+	w->head = (w->head + cs_pool.cap - 1) % cs_pool.cap;
+	w->q[w->head] = t;
+	w->n++;
+	pthread_mutex_unlock(&w->mtx);
+}
+
+static cs_task_t *cs_deque_pop(cs_worker_t *w)
+{
+	cs_task_t *t = NULL;
+	
+	pthread_mutex_lock(&w->mtx);
+	if (w->n > 0)
+		t = w->q[(w->head + --w->n) % cs_pool.cap];
+	pthread_mutex_unlock(&w->mtx);
+	return t;
+}
+
+static cs_task_t *cs_deque_steal(cs_worker_t *w)
+{
+	cs_task_t *t = NULL;
+	
+	/* pthread_mutex_trylock(): do not queue up behind the owner */
+	if (pthread_mutex_trylock(&w->mtx) != 0)
+		return NULL;
+	if (w->n > 0) {
+		t = w->q[w->head];
+		w->head = (w->head + 1) % cs_pool.cap;
+		w->n--;
+	}
+	pthread_mutex_unlock(&w->mtx);
+	return t;
+}
+
+/* steal a task of another worker, starting with a random victim */
+static cs_task_t *cs_steal(cs_worker_t *w)
+{
+	cs_task_t *t;
+	int i, v;
+	
+	if (cs_pool.nw < 2)
+		return NULL;
+	v = rand_r(&w->seed) % cs_pool.nw;
+	for (i = 0; i < cs_pool.nw; i++, v = (v + 1) % cs_pool.nw) {
+		if (v == w->id)
+			continue;
+		if ((t = cs_deque_steal(&cs_pool.w[v])) != NULL) {
+			w->steals++;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/* sleeping tasks: binary min-heap by due time */
+static void cs_sleep_push(cs_task_t *t)
+{
+	cs_task_t **h;
+	int i;
+	
+	pthread_mutex_lock(&cs_pool.sleep_mtx);
+	h = cs_pool.sleeping;
+	for (i = cs_pool.nsleeping++; i > 0 && h[(i - 1) / 2]->due > t->due;
+	    i = (i - 1) / 2)
+		h[i] = h[(i - 1) / 2];
+	h[i] = t;
+	pthread_mutex_unlock(&cs_pool.sleep_mtx);
+}
+
+/* move the due sleeping tasks to `w'; returns the time until the next
+ * sleeping task is due [ms], at most `max_ms' */
+static int cs_sleep_collect(cs_worker_t *w, double now, int max_ms)
+{
+	cs_task_t **h, *t, *last;
+	int i, c, n, ms = max_ms;
+	
+	pthread_mutex_lock(&cs_pool.sleep_mtx);
+	h = cs_pool.sleeping;
+	while (cs_pool.nsleeping > 0 && h[0]->due <= now) {
+		t = h[0];
+		last = h[n = --cs_pool.nsleeping];
+		for (i = 0; (c = 2 * i + 1) < n; i = c) {
+			if (c + 1 < n && h[c + 1]->due < h[c]->due)
+				c++;
+			if (h[c]->due >= last->due)
+				break;
+			h[i] = h[c];
+		}
+		h[i] = last;
+		cs_deque_push(w, t);
+	}
+	if (cs_pool.nsleeping > 0 && (h[0]->due - now) * 1000 < ms)
+		ms = (int) ((h[0]->due - now) * 1000) + 1;
+	pthread_mutex_unlock(&cs_pool.sleep_mtx);
+	return ms;
+}
+
+/* collect the due tasks and the tasks whose feedback channel became
+ * readable, waiting at most `max_ms' for the latter */
+static void cs_pool_poll(cs_worker_t *w, int max_ms)
+{
+	struct epoll_event ev[16];
+	int i, n, ms;
+	
+	ms = cs_sleep_collect(w, cs_flow_now(NULL), max_ms);
+	if (w->n > 0)
+		ms = 0;
+	n = epoll_wait(cs_pool.epfd, ev, 16, ms);
+	for (i = 0; i < n; i++)
+		cs_deque_push(w, ev[i].data.ptr);
+}
+
+/* run task `t' and pass it on to whatever it waits for */
+static void cs_task_run(cs_worker_t *w, cs_task_t *t)
+{
+	struct epoll_event ev;
+	cs_flow_t *f = t->flow;
+	int r;
+	
+	w->runs++;
+	if (__atomic_load_n(&f->done, __ATOMIC_ACQUIRE)) {
+		r = CS_RUN_DONE;
+	} else {
+		switch (t->kind) {
+		case CS_TASK_NEL:	r = cs_flow_nel(f);	break;
+		case CS_TASK_COMM:	r = cs_flow_comm(t);	break;
+		default:		r = cs_flow_reload(t);	break;
+		}
+	}
+	
+	switch (r) {
+	case CS_RUN_AGAIN:
+		cs_deque_yield(w, t);
+		break;
+	case CS_RUN_SLEEP:
+		cs_sleep_push(t);
+		break;
+	case CS_RUN_WAITFD:
+		bzero(&ev, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = t;
+		if (epoll_ctl(cs_pool.epfd, t->polled ? EPOLL_CTL_MOD
+		    : EPOLL_CTL_ADD, t->fd, &ev) < 0) {
+			perror("epoll_ctl(flow)");
+			exit(1);
+		}
+		t->polled = 1;
+		break;
+	case CS_RUN_DONE:
+		if (__atomic_sub_fetch(&f->ntasks, 1, __ATOMIC_ACQ_REL) == 0)
+			cs_flow_finish(f);
+		break;
+	}
+}
+
+static void *cs_worker(void *arg)
+{
+	cs_worker_t *w = arg;
+	cs_task_t *t;
+	
+	while (__atomic_load_n(&cs_pool.flows_left, __ATOMIC_ACQUIRE) > 0) {
+		/* do not let a busy worker starve the waiting tasks */
+		if (w->runs % CS_POLL_RUNS == 0)
+			cs_pool_poll(w, 0);
+		if ((t = cs_deque_pop(w)) == NULL && (t = cs_steal(w)) == NULL) {
+			cs_pool_poll(w, CS_FLOW_IDLE_MS);
+			continue;
+		}
+		cs_task_run(w, t);
+	}
+	return NULL;
+}
+
+/* `nel flows CR-NEL-link-IP CR-warden-link-IP count [threads]' */
+void cs_flows(int argc, char *argv[])
+{
+	extern char *warden_link_ip;
+	struct sockaddr_in srv;
+	struct in_addr warden_link_addr;
+	u_int32_t src_base, i;
+	char addr[INET_ADDRSTRLEN];
+	u_int64_t comm = 0;
+	double dt_max = 0;
+	int nthreads = 0;
+	
+	if (argc < 4)
+		usage();
+	cs_nflows = atoi(argv[3]);
+	if (cs_nflows < 1 || cs_nflows > CS_FLOW_MAX) {
+		fprintf(stderr, "count must be 1..%i.\n", CS_FLOW_MAX);
+		exit(1);
+	}
+	if (argc > 4)
+		nthreads = atoi(argv[4]);
+	if (nthreads <= 0)
+		nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > cs_nflows)
+		nthreads = cs_nflows;
+	
+	bzero(&srv, sizeof(srv));
+	if (!inet_aton(argv[1], &srv.sin_addr) || !inet_aton(argv[2], &warden_link_addr)) {
+		fprintf(stderr, "invalid IP address.\n");
+		usage();
+	}
+	srv.sin_family = AF_INET;
+	srv.sin_port = htons(12345);
+	warden_link_ip = argv[2];
+	/* flow i sends from src_addr+i */
+	src_base = nel_cfg.src_addr;
+	if (src_base == 0)
+		src_base = ntohl(nel_route_src(warden_link_addr).s_addr);
+#ifdef USE_NATIVE_PKT_ENGINE
+	pkt_engine_init(warden_link_ip);
+#endif
+	cs_print_config(&nel_cfg);
+	
+	if ((cs_flow = calloc(cs_nflows, sizeof(cs_flow_t))) == NULL
+	    || (cs_pool.w = calloc(nthreads, sizeof(cs_worker_t))) == NULL
+	    || (cs_pool.sleeping = calloc(cs_nflows * CS_TASKS, sizeof(cs_task_t *))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	if ((cs_pool.epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	pthread_mutex_init(&cs_pool.sleep_mtx, NULL);
+	cs_pool.nw = nthreads;
+	cs_pool.cap = cs_nflows * CS_TASKS;
+	cs_pool.flows_left = cs_nflows;
+	for (i = 0; i < (u_int32_t) nthreads; i++) {
+		cs_pool.w[i].id = i;
+		cs_pool.w[i].seed = (unsigned int) time(NULL) + i;
+		pthread_mutex_init(&cs_pool.w[i].mtx, NULL);
+		if ((cs_pool.w[i].q = calloc(cs_pool.cap, sizeof(cs_task_t *))) == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+	}
+	
+	/* connect all flows, then deal their tasks out to the workers */
+	for (i = 0; i < (u_int32_t) cs_nflows; i++)
+		cs_flow_init(&cs_flow[i], i, &srv, src_base);
+	printf("%i flows (src %s+), %i worker threads.\n", cs_nflows,
+		inet_ntop(AF_INET, &cs_flow[0].src, addr, sizeof(addr)), nthreads);
+	for (i = 0; i < (u_int32_t) cs_nflows; i++) {
+		int k;
+		
+		for (k = 0; k < cs_flow[i].ntasks; k++)
+			cs_deque_push(&cs_pool.w[(i * CS_TASKS + k) % nthreads],
+				&cs_flow[i].task[k]);
+	}
+	
+	for (i = 0; i < (u_int32_t) nthreads; i++) {
+		if (pthread_create(&cs_pool.w[i].th, NULL, cs_worker, &cs_pool.w[i])) {
+			perror("pthread_create(flows)");
+			exit(1);
+		}
+	}
+	for (i = 0; i < (u_int32_t) nthreads; i++) {
+		if (pthread_join(cs_pool.w[i].th, NULL))
+			perror("pthread joining error");
+	}
+	
+	fprintf(stderr, "\n===== ALL %i FLOWS COMPLETED =====\n", cs_nflows);
+	for (i = 0; i < (u_int32_t) cs_nflows; i++) {
+		cs_flow_t *f = &cs_flow[i];
+		
+		fprintf(stderr, "flow %u (src %s): %.3f sec, %u/%u probes "
+			"non-blocked, %u COMM packets\n", f->id,
+			inet_ntop(AF_INET, &f->src, addr, sizeof(addr)),
+			f->t_end - f->t_start, f->probes_ok, f->probes, f->comm_sent);
+		comm += f->comm_sent;
+		if (f->t_end - f->t_start > dt_max)
+			dt_max = f->t_end - f->t_start;
+	}
+	fprintf(stderr, "%" PRIu64 " COMM packets in %.3f sec\n", comm, dt_max);
+	for (i = 0; i < (u_int32_t) nthreads; i++) {
+		fprintf(stderr, "worker %u: %" PRIu64 " task runs, %" PRIu64
+			" stolen\n", i, cs_pool.w[i].runs, cs_pool.w[i].steals);
+	}
+}
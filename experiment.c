@@ -0,0 +1,233 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+
+/* Monte Carlo experiments: run `runs' simulations (sim.c) for each of a set
+ * of warden configurations on a pool of worker threads and report the
+ * distribution of the completion times per configuration.
+ *
+ * Run r of every configuration uses the seed r+1, i.e. all configurations
+ * are compared under the same random numbers and every number reported can
+ * be reproduced with `nel simulate <seed>'. Each simulation has its own
+ * state, so the workers share nothing but the job counter. */
+
+typedef struct {
+	nel_cfg_t	cfg;
+	char		*name;
+	double		*t;	/* completion times of the successful runs */
+	int		*ok;	/* per run: 1=completed, 0=failed */
+} exp_cfg_t;
+
+typedef struct {
+	exp_cfg_t	*cfgs;
+	int		ncfgs;
+	int		runs;
+	int		next_job;	/* next job (cfg * runs + run) to take */
+} exp_t;
+
+static void *exp_worker(void *arg)
+{
+	exp_t *exp = arg;
+	exp_cfg_t *c;
+	int job, run;
+
+	while ((job = __atomic_fetch_add(&exp->next_job, 1, __ATOMIC_RELAXED))
+	       < exp->ncfgs * exp->runs) {
+		c = &exp->cfgs[job / exp->runs];
+		run = job % exp->runs;
+		c->ok[run] = (simulate(&c->cfg, (unsigned int) run + 1, 0,
+			&c->t[run], NULL) == 0);
+	}
+	return NULL;
+}
+
+/* parse `mode[:blocking-limit[:reload-interval[:inactive-checked]]]',
+ * where each field after the mode may also be a `key=value' (config.c) */
+static void exp_parse_cfg(char *spec, nel_cfg_t *cfg)
+{
+	const char *keys[] = { "sim_limit", "reload_interval", "inactive_checked" };
+	char *mode, *field, *val;
+	const char *err;
+	int i = 0;
+
+	*cfg = nel_cfg;
+	mode = strsep(&spec, ":");
+	if ((err = cfg_set(cfg, "warden", mode)) != NULL) {
+		fprintf(stderr, "invalid warden mode `%s' (none|reg|dyn|adp).\n", mode);
+		exit(1);
+	}
+	while ((field = strsep(&spec, ":")) != NULL) {
+		if ((val = strchr(field, '=')) != NULL) {
+			*val++ = '\0';
+			err = cfg_set(cfg, field, val);
+		} else if (i < 3) {
+			err = cfg_set(cfg, keys[i++], field);
+		} else {
+			err = "too many fields";
+		}
+		if (err != NULL) {
+			fprintf(stderr, "invalid warden configuration `%s': %s: %s.\n",
+				mode, field, err);
+			exit(1);
+		}
+	}
+	if ((err = cfg_check(cfg)) != NULL) {
+		fprintf(stderr, "invalid warden configuration `%s': %s.\n", mode, err);
+		exit(1);
+	}
+}
+
+static int exp_cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* p-th percentile (0..100) of n sorted values, linear interpolation */
+static double exp_percentile(double *v, int n, double p)
+{
+	double pos = p / 100.0 * (n - 1);
+	int i = (int) pos;
+
+	if (i + 1 >= n)
+		return v[n - 1];
+	return v[i] + (pos - i) * (v[i + 1] - v[i]);
+}
+
+static void exp_report(exp_cfg_t *c, int runs)
+{
+	int i, n = 0;
+	double sum = 0, sq = 0, mean, sd, ci;
+
+	/* compact the successful runs */
+	for (i = 0; i < runs; i++) {
+		if (c->ok[i])
+			c->t[n++] = c->t[i];
+	}
+	printf("%-28s %6i %6i", c->name, runs, n);
+	if (n == 0) {
+		printf("  (no run completed)\n");
+		return;
+	}
+	qsort(c->t, n, sizeof(double), exp_cmp);
+	for (i = 0; i < n; i++)
+		sum += c->t[i];
+	mean = sum / n;
+	for (i = 0; i < n; i++)
+		sq += (c->t[i] - mean) * (c->t[i] - mean);
+	sd = (n > 1 ? sqrt(sq / (n - 1)) : 0);
+	ci = EXP_CI_Z * sd / sqrt(n);
+	printf(" %9.2f %8.2f %9.2f..%-9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+		mean, sd, mean - ci, mean + ci, c->t[0],
+		exp_percentile(c->t, n, 5), exp_percentile(c->t, n, 50),
+		exp_percentile(c->t, n, 95), c->t[n - 1]);
+}
+
+/* argv: <runs> [threads [cfg ...]] */
+int experiment(int argc, char **argv)
+{
+	exp_t exp;
+	exp_cfg_t cfgs[EXP_MAX_CONFIGS];
+	pthread_t *th;
+	int nthreads, i;
+	struct timespec t0, t1;
+	double real;
+
+	if (argc < 1 || (exp.runs = atoi(argv[0])) < 1)
+		usage();
+	nthreads = (argc > 1 ? atoi(argv[1]) : 0);
+	if (nthreads < 1)
+		nthreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+
+	/* configurations to compare; the compiled-in one by default */
+	exp.ncfgs = (argc > 2 ? argc - 2 : 1);
+	if (exp.ncfgs > EXP_MAX_CONFIGS) {
+		fprintf(stderr, "too many warden configurations (max. %i).\n",
+			EXP_MAX_CONFIGS);
+		exit(1);
+	}
+	for (i = 0; i < exp.ncfgs; i++) {
+		if (argc > 2) {
+			cfgs[i].name = argv[i + 2];
+			exp_parse_cfg(strdup(argv[i + 2]), &cfgs[i].cfg);
+		} else {
+			cfgs[i].name = "default";
+			cfgs[i].cfg = nel_cfg;
+		}
+		cfgs[i].t = calloc(exp.runs, sizeof(double));
+		cfgs[i].ok = calloc(exp.runs, sizeof(int));
+		if (!cfgs[i].t || !cfgs[i].ok) {
+			fprintf(stderr, "ERR: memory alloc (calloc())\n");
+			exit(1);
+		}
+	}
+	exp.cfgs = cfgs;
+	exp.next_job = 0;
+
+	for (i = 0; i < exp.ncfgs; i++) {
+		printf("[%s] ", cfgs[i].name);
+		cs_print_config(&cfgs[i].cfg);
+	}
+	printf("running %i simulations per configuration (seeds 1..%i) on %i threads.\n",
+		exp.runs, exp.runs, nthreads);
+
+	if ((th = calloc(nthreads, sizeof(pthread_t))) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (calloc())\n");
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&th[i], NULL, exp_worker, &exp)) {
+			perror("pthread_create(experiment)");
+			exit(1);
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_join(th[i], NULL))
+			perror("pthread joining error");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	real = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1.0e9;
+
+	/* completion times [simulated seconds] */
+	printf("\n%-28s %6s %6s %9s %8s %20s %9s %9s %9s %9s %9s\n", "config", "runs",
+		"done", "mean", "sd", "95% CI (mean)", "min", "p5", "median", "p95", "max");
+	for (i = 0; i < exp.ncfgs; i++) {
+		exp_report(&cfgs[i], exp.runs);
+		free(cfgs[i].t);
+		free(cfgs[i].ok);
+	}
+	printf("\n%i simulations in %.3f seconds real time (%.1f/s).\n",
+		exp.ncfgs * exp.runs, real, exp.ncfgs * exp.runs / real);
+	free(th);
+	return 0;
+}
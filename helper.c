@@ -32,9 +32,15 @@ void usage(void)
 {
 	extern char *__progname;
 
-	fprintf(stderr, "usage: %s  \'sender\'|\'receiver\'  <specific parameters, see below>:\n", __progname);
+	fprintf(stderr, "usage: %s  [-f config-file] [-r ruleset-file] [-o key=value ...] \'sender\'|\'receiver\'|... <specific parameters, see below>:\n", __progname);
 	fprintf(stderr, "       %s  sender   CR-NEL-link-IP CR-warden-link-IP\n", __progname);
-	fprintf(stderr, "       %s  receiver CS-NEL-link-IP CR-warden-link-Interface\n\n", __progname);
+	fprintf(stderr, "       %s  receiver CS-NEL-link-IP CR-warden-link-Interface\n", __progname);
+	fprintf(stderr, "       %s  flows    CR-NEL-link-IP CR-warden-link-IP count [threads]\n", __progname);
+	fprintf(stderr, "       %s  replay   pcap-file|directory [CS-warden-link-IP]\n", __progname);
+	fprintf(stderr, "       %s  simulate [seed]\n", __progname);
+	fprintf(stderr, "       %s  experiment runs [threads [none|reg|dyn|adp[:limit[:reload[:ic]]][:key=value...] ...]]\n\n", __progname);
+	cfg_usage();
+	fprintf(stderr, "\n");
 	fprintf(stderr,
 			"Example Setup:      NEL-IP                   CS/CR-WARDEN-LINK-IP      CS/CR-LINK-IFACE\n"
 			"                    ----------------         ---------------------     ------------------\n"
@@ -48,3 +54,178 @@ void usage(void)
 }
 
 
+
+/* encode one message of the feedback channel into `msg' (in network byte
+ * order, as sent) */
+void nel_msg_encode(nel_proto_t *msg, u_int16_t type, u_int32_t seq,
+	u_int32_t announced_proto, u_int32_t result)
+{
+	bzero(msg, sizeof(*msg));
+	msg->version = htons(NEL_PROTO_VERSION);
+	msg->type = htons(type);
+	msg->seq = htonl(seq);
+	msg->announced_proto = htonl(announced_proto);
+	msg->result = htonl(result);
+}
+
+/* send one message of the feedback channel; returns 0 on success */
+int nel_msg_send(int fd, u_int16_t type, u_int32_t seq, u_int32_t announced_proto,
+	u_int32_t result)
+{
+	nel_proto_t msg;
+	
+	nel_msg_encode(&msg, type, seq, announced_proto, result);
+	if (send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg)) {
+		perror("send()");
+		return -1;
+	}
+	return 0;
+}
+
+/* receive one message of the feedback channel (in host byte order);
+ * returns 0 on success, -1 if the peer closed the channel or sent an
+ * invalid message */
+int nel_msg_recv(int fd, nel_proto_t *msg)
+{
+	u_int8_t buf[sizeof(nel_proto_t)];
+	ssize_t n;
+	
+	if ((n = recv(fd, buf, sizeof(buf), MSG_WAITALL)) != sizeof(buf)) {
+		if (n < 0)
+			perror("recv()");
+		return -1;
+	}
+	return nel_msg_decode(buf, msg);
+}
+
+/* decode the message of the feedback channel at `buf' (sizeof(nel_proto_t)
+ * bytes as received) into `msg' (in host byte order); returns -1 if it is
+ * invalid */
+int nel_msg_decode(const void *buf, nel_proto_t *msg)
+{
+	memcpy(msg, buf, sizeof(*msg));
+	msg->version = ntohs(msg->version);
+	msg->type = ntohs(msg->type);
+	msg->seq = ntohl(msg->seq);
+	msg->announced_proto = ntohl(msg->announced_proto);
+	msg->result = ntohl(msg->result);
+	if (msg->version != NEL_PROTO_VERSION) {
+		fprintf(stderr, "unsupported feedback channel version %u "
+			"(expected %u)\n", msg->version, NEL_PROTO_VERSION);
+		return -1;
+	}
+	return 0;
+}
+
+/* the source address the kernel would choose for packets to `dst'
+ * (INADDR_ANY if there is no route) */
+struct in_addr nel_route_src(struct in_addr dst)
+{
+	struct sockaddr_in sa;
+	struct in_addr src;
+	socklen_t salen;
+	int fd;
+	
+	src.s_addr = INADDR_ANY;
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0) {
+		bzero(&sa, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_addr = dst;
+		sa.sin_port = htons(9);
+		salen = sizeof(sa);
+		if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0
+		    && getsockname(fd, (struct sockaddr *)&sa, &salen) == 0)
+			src = sa.sin_addr;
+		close(fd);
+	}
+	return src;
+}
+
+/* calloc() of at least one element; exits if there is no memory */
+void *nel_calloc(size_t n, size_t size)
+{
+	void *p;
+	
+	if ((p = calloc(n > 0 ? n : 1, size)) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (calloc())\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* atomic access to a set of rules; the sender threads test and modify
+ * single bits concurrently */
+int nel_bit_test(const nel_bitset_t *set, u_int32_t bit)
+{
+	return (__atomic_load_n(&set->w[bit / 64], __ATOMIC_ACQUIRE)
+		>> (bit % 64)) & 1;
+}
+
+/* returns the bit's previous value */
+int nel_bit_assign(nel_bitset_t *set, u_int32_t bit, int val)
+{
+	u_int64_t mask = (u_int64_t) 1 << (bit % 64), old;
+	
+	if (val)
+		old = __atomic_fetch_or(&set->w[bit / 64], mask, __ATOMIC_RELEASE);
+	else
+		old = __atomic_fetch_and(&set->w[bit / 64], ~mask, __ATOMIC_RELEASE);
+	return (old & mask) != 0;
+}
+
+/* allocate the (cleared) words of a set for the rules of the ruleset */
+void nel_bits_init(nel_bitset_t *set)
+{
+	set->w = nel_calloc(NEL_BITSET_WORDS, sizeof(u_int64_t));
+}
+
+void nel_bits_free(nel_bitset_t *set)
+{
+	free(set->w);
+	set->w = NULL;
+}
+
+void nel_bits_clear(nel_bitset_t *set)
+{
+	int i;
+	
+	for (i = 0; i < NEL_BITSET_WORDS; i++)
+		__atomic_store_n(&set->w[i], 0, __ATOMIC_RELEASE);
+}
+
+/* publish the (private) set `src' in `set' word by word */
+void nel_bits_copy(nel_bitset_t *set, const nel_bitset_t *src)
+{
+	int i;
+	
+	for (i = 0; i < NEL_BITSET_WORDS; i++)
+		__atomic_store_n(&set->w[i], src->w[i], __ATOMIC_RELEASE);
+}
+
+/* the first set bit >= `from', or -1; skips 64 clear bits at a time */
+int nel_bits_next(const nel_bitset_t *set, u_int32_t from)
+{
+	u_int32_t i = from / 64;
+	u_int64_t w;
+	
+	if (from >= nel_nrules)
+		return -1;
+	w = __atomic_load_n(&set->w[i], __ATOMIC_ACQUIRE) & (~(u_int64_t) 0 << (from % 64));
+	while (w == 0) {
+		if (++i == NEL_BITSET_WORDS)
+			return -1;
+		w = __atomic_load_n(&set->w[i], __ATOMIC_ACQUIRE);
+	}
+	i = i * 64 + __builtin_ctzll(w);
+	return (i < nel_nrules ? (int) i : -1);
+}
+
+/* number of set bits */
+int nel_bits_count(const nel_bitset_t *set)
+{
+	int i, n = 0;
+	
+	for (i = 0; i < NEL_BITSET_WORDS; i++)
+		n += __builtin_popcountll(__atomic_load_n(&set->w[i], __ATOMIC_ACQUIRE));
+	return n;
+}
@@ -39,27 +39,57 @@ char *warden_link_ip = NULL;
 int main(int argc, char *argv[])
 {
 	int mode = MODE_UNSET;
-	struct sockaddr_in srv, cli;
-	int sockfd, clifd;
-	pthread_t th1, th2;
+	struct sockaddr_in srv;
+	struct in_addr warden_link_addr; /* only SENDER */
+	int sockfd;
+	pthread_t th1;
 	pthread_t th_comm_ph; /* only SENDER for COMM. phase */
 	pthread_t th_rule_reload; /* only SENDER for DYN+ADP warden */
-	extern char *ruleset[ANNOUNCED_PROTO_NUMBERS][3];
+	const char *rules_path = NULL; /* NULL: built-in ruleset */
+	unsigned int sim_seed; /* only SIMULATE */
+	double sim_result;
+	struct timespec sim_t0, sim_t1;
+	int ch;
+	char *val;
+	const char *err;
 	
 	printf(WELCOME_MESSAGE);
 	
-	/* configuration check: is ANNOUNCED_PROTO_NUMBERS up-to-date with the
-	 * ruleset? */
-	if (ruleset[ANNOUNCED_PROTO_NUMBERS][0] != NULL
-	 || ruleset[ANNOUNCED_PROTO_NUMBERS][1] != NULL
-	 || ruleset[ANNOUNCED_PROTO_NUMBERS][2] != NULL) {
-		fprintf(stderr, "ruleset not updated. Please adjust the macro "
-		"`ANNOUNCED_PROTO_NUMBERS' in nel.h to the number of rules in "
-		" `ruleset'.\n");
+	/* run-time configuration: options precede the mode */
+	while ((ch = getopt(argc, argv, "+f:o:r:h")) != -1) {
+		switch (ch) {
+		case 'f':
+			cfg_load(&nel_cfg, optarg);
+			break;
+		case 'o':
+			if ((val = strchr(optarg, '=')) == NULL) {
+				fprintf(stderr, "-o %s: key=value expected.\n", optarg);
+				usage();
+			}
+			*val++ = '\0';
+			if ((err = cfg_set(&nel_cfg, optarg, val)) != NULL) {
+				fprintf(stderr, "-o %s: %s.\n", optarg, err);
+				usage();
+			}
+			break;
+		case 'r':
+			rules_path = optarg;
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	ruleset_init(rules_path);
+	if ((err = cfg_check(&nel_cfg)) != NULL) {
+		fprintf(stderr, "invalid configuration: %s.\n", err);
 		exit(1);
 	}
-		
-	if (argc < 4)
+	/* let argv[1] be the mode again */
+	argc -= optind - 1;
+	argv += optind - 1;
+	
+	if (argc < 2)
 		usage();
 
 /* checking the mode */
@@ -69,10 +99,24 @@ int main(int argc, char *argv[])
 	} else if (strstr(argv[1], "receiver")  != NULL) {
 		printf("receiver mode.\n");
 		mode = MODE_RECEIVER;
+	} else if (strstr(argv[1], "simulate")  != NULL) {
+		printf("simulation mode.\n");
+		mode = MODE_SIMULATE;
+	} else if (strstr(argv[1], "experiment")  != NULL) {
+		printf("experiment mode.\n");
+		mode = MODE_EXPERIMENT;
+	} else if (strstr(argv[1], "flows")  != NULL) {
+		printf("multi-flow sender mode.\n");
+		mode = MODE_FLOWS;
+	} else if (strstr(argv[1], "replay")  != NULL) {
+		printf("replay mode.\n");
+		mode = MODE_REPLAY;
 	} else {
 		usage();
 		/* NOTREACHED */
 	}
+	if ((mode == MODE_SENDER || mode == MODE_RECEIVER) && argc < 4)
+		usage();
 	
 	/* argv[2] is used by the particular MODES below */
 
@@ -103,6 +147,15 @@ int main(int argc, char *argv[])
 		
 		/* 3rd parameter is the DST IP that will be used for scapy */
 		warden_link_ip = argv[3];
+		/* the CR tells our CC packets apart from those of other
+		 * senders by their source address */
+		if (nel_cfg.src_addr == 0 && inet_aton(warden_link_ip, &warden_link_addr))
+			nel_cfg.src_addr = ntohl(nel_route_src(warden_link_addr).s_addr);
+#ifdef USE_NATIVE_PKT_ENGINE
+		pkt_engine_init(warden_link_ip);
+#endif
+		/* the state the sender threads share */
+		cs_state_alloc(&cs_state);
 		
 		/* NEL thread */
 		if (pthread_create(&th1, NULL, cs_NEL_handler, &sockfd)) {
@@ -115,7 +168,8 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 		/* rule reloader */
-		if (WARDEN_MODE == WARDEN_MODE_DYN_WARDEN || WARDEN_MODE == WARDEN_MODE_ADP_WARDEN) {
+		if (nel_cfg.warden_mode == WARDEN_MODE_DYN_WARDEN
+		    || nel_cfg.warden_mode == WARDEN_MODE_ADP_WARDEN) {
 			if (pthread_create(&th_rule_reload, NULL, cs_RuleReloader, NULL)) {
 				perror("pthread_create(rule_reloader.CS)");
 				exit(1);
@@ -159,33 +213,45 @@ int main(int argc, char *argv[])
 			exit(1);
 		}
 		
-		/* run measurement thread in parallel */
-		if (pthread_create(&th2, NULL, cr_measure, NULL)) {
-			perror("pthread_create(CR.measure)");
-			exit(1);
-		}
+		/* capture handle + filters for the CC packets */
+		cr_pcap_init();
 		
-		/* now accept a connection and run the actual NEL phase */
-		while (1) {
-			socklen_t len;
-			
-			len = sizeof(cli);
-			clifd = accept(sockfd, (struct sockaddr *)&cli, &len);
-			if (clifd < 0) {
-				perror("accept()");
-				exit(1);
-			}
-			
-			if (pthread_create(&th1, NULL, cr_NEL_handler, &clifd)) {
-				perror("pthread_create(NEL.phase.CR)");
-				exit(1);
-			}
-
-			if(pthread_join(th1, NULL)) {
-				perror("pthread joining error");
-			}
-			close(clifd);
+		/* now accept connections and run the actual NEL phase */
+		cr_run(sockfd);
+		break;
+/* SIMULATION */
+	case MODE_SIMULATE:
+		/* argv[2] (optional) is the seed */
+		sim_seed = (argc > 2 ? strtoul(argv[2], NULL, 0) : (unsigned int) time(NULL));
+		cs_print_config(&nel_cfg);
+		clock_gettime(CLOCK_MONOTONIC, &sim_t0);
+		if (simulate(&nel_cfg, sim_seed, 1, &sim_result, NULL) != 0) {
+			fprintf(stderr, "SIMULATION FAILED; less than %i CC packets "
+				"went through the warden (seed=%u).\n",
+				nel_cfg.req_pkts, sim_seed);
+			exit(1);
 		}
+		clock_gettime(CLOCK_MONOTONIC, &sim_t1);
+		fprintf(stderr, "SIMULATION COMPLETED; received %i CC packets "
+			"through warden link after %.3f simulated seconds (seed=%u, "
+			"%.3f seconds real time).\n", nel_cfg.req_pkts,
+			sim_result, sim_seed,
+			(sim_t1.tv_sec - sim_t0.tv_sec) + (sim_t1.tv_nsec - sim_t0.tv_nsec) / 1.0e9);
+		break;
+/* EXPERIMENT */
+	case MODE_EXPERIMENT:
+		/* argv[2..]: runs [threads [warden configurations]] */
+		experiment(argc - 2, argv + 2);
+		break;
+/* MULTI-FLOW SENDER */
+	case MODE_FLOWS:
+		/* argv[2..]: CR-NEL-link-IP CR-warden-link-IP count [threads] */
+		cs_flows(argc - 1, argv + 1);
+		break;
+/* REPLAY */
+	case MODE_REPLAY:
+		/* argv[2..]: pcap-file|directory [CS-warden-link-IP] */
+		cr_replay(argc - 1, argv + 1);
 		break;
 	case MODE_UNSET:
 		/* FALLTHROUGH */
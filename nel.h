@@ -26,6 +26,7 @@
  *
  */
 
+#define _GNU_SOURCE /* sendmmsg() */
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -35,54 +36,175 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sched.h>
 #include <pcap.h>
 #include <signal.h>
 #include <inttypes.h>
 #include <math.h>
 #include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <sys/syscall.h>
 
 /*#define DEBUGMODE*/
 
-#define TOOL_VERSION		"0.4.0"
+#define TOOL_VERSION		"0.5.0"
 #define WELCOME_MESSAGE		"NEL: Implementation of a Network Environment Learning (NEL) Phase\n" \
 				"     for Network Covert Channel Research\n\n" \
 				"(C) 2017-2021 Steffen Wendzel (steffen (at) wendzel (dot) de), " \
 				"WWW: https://www.wendzel.de\n" \
 				"Version " TOOL_VERSION "\n\n"
 
-/* How many CCs are implemented (cs.c)? This value needs to match
- * the number of array "ruleset"'s elements! */
-#define ANNOUNCED_PROTO_NUMBERS		50
+/* The following values are defaults. They can be changed at run-time
+ * with `-o key=value' or a configuration file (`-f file'), see config.c
+ * and the key in brackets. */
 
 /* CR_NEL_TESTPKT_WAITING_TIME:
- * Waiting time of NEL receiver for packets from Alice (in sec) */
+ * Waiting time of NEL receiver for packets from Alice (in sec) [nel_wait] */
 #define CR_NEL_TESTPKT_WAITING_TIME	5
 
+/* CR_NEL_ADAPTIVE_WAIT:
+ * If 1, the CR answers as soon as all probe packets of a protocol arrived
+ * and waits for the probe packets of a (blocked) protocol only as long as
+ * the observed announcement-to-capture times suggest. It estimates how long
+ * one natively sent and one scapy-sent probe take (smoothed time plus 4x
+ * its variation, as TCP's RTO, RFC 6298, at least CR_NEL_WAIT_MARGIN) and
+ * adds them up for the probes the CS sends until the announced one (see
+ * NEL_ANNOUNCE_POS), at most CR_NEL_TESTPKT_WAITING_TIME seconds. 0=always
+ * wait for CR_NEL_TESTPKT_WAITING_TIME [adaptive_wait] */
+#define CR_NEL_ADAPTIVE_WAIT		1
+#define CR_NEL_WAIT_MARGIN		0.02
+
+/* CR_MAX_SESSIONS:
+ * how many senders the receiver serves at the same time. Each sender has its
+ * own feedback channel, probes and counters; its CC packets are told apart
+ * by their source address, so concurrent senders need different warden-link
+ * addresses (see `src_addr').
+ * CR_EXIT_AFTER_SESSIONS:
+ * the receiver exits after this many senders completed their measurement;
+ * 0=serve senders until terminated [sessions]
+ * CR_PROGRESS_INTERVAL:
+ * seconds between two reports of a session's number of received CC
+ * packets (the last one is reported in any case) */
+#define CR_MAX_SESSIONS			64
+#define CR_EXIT_AFTER_SESSIONS		1
+#define CR_PROGRESS_INTERVAL		1
+
+/* CR_CAPTURE -- NEW in v.0.5.0:
+ * how the CR captures the CC packets:
+ * CR_CAPTURE_PCAP: with libpcap;
+ * CR_CAPTURE_RING: with an AF_PACKET socket and a memory-mapped TPACKET_V3
+ *   RX ring (Linux, see cr_ring.c): the kernel fills whole blocks of packets
+ *   that the CR processes in place, and it counts the packets it dropped
+ *   because the ring was full;
+ * CR_CAPTURE_EBPF: counting only (Linux, see cr_ebpf.c): an eBPF program
+ *   on an AF_PACKET socket runs the filters of the rules in the kernel and
+ *   counts the matches per session and rule in a map; no packet is copied
+ *   to the CR. Falls back to CR_CAPTURE_PCAP if the kernel refuses the
+ *   program (e.g., no CAP_BPF) [capture]
+ * CR_RING_SIZE:
+ * CR_CAPTURE_RING: size of the ring in KiB, a multiple of the block size
+ *   CR_RING_BLOCK_SIZE [ring_size]
+ * CR_RING_BLOCK_TIMEOUT:
+ * CR_CAPTURE_RING: ms after which the kernel passes on a block that is not
+ *   full yet, i.e. the max. delay of a probe packet; 0=kernel's choice
+ *   [ring_timeout]
+ * CR_EBPF_INTERVAL:
+ * CR_CAPTURE_EBPF: ms between two reads of the counters, i.e. the max.
+ *   delay of a probe packet [ebpf_interval]
+ * CR_PCAP_IMMEDIATE:
+ * CR_CAPTURE_PCAP: 1=libpcap passes on every packet at once instead of
+ *   buffering them up to the capture timeout (immediate mode) [pcap_immediate]
+ * CR_PCAP_BUFFER:
+ * CR_CAPTURE_PCAP: size of the kernel's capture buffer in KiB; 0=libpcap's
+ *   default [pcap_buffer]
+ * CR_PCAP_TSTAMP:
+ * CR_CAPTURE_PCAP and replay: precision of the packets' time stamps,
+ *   CR_TSTAMP_MICRO or CR_TSTAMP_NANO [pcap_tstamp]
+ * CR_SNAPLEN:
+ * bytes captured of each packet */
+#define CR_CAPTURE_PCAP			0x00
+#define CR_CAPTURE_RING			0x01
+#define CR_CAPTURE_EBPF			0x02
+#define CR_CAPTURE			CR_CAPTURE_PCAP
+#define CR_RING_SIZE			4096
+#define CR_RING_BLOCK_TIMEOUT		10
+#define CR_RING_BLOCK_SIZE		(128 * 1024)
+#define CR_EBPF_INTERVAL		10
+#define CR_TSTAMP_MICRO			0x00
+#define CR_TSTAMP_NANO			0x01
+#define CR_PCAP_IMMEDIATE		1
+#define CR_PCAP_BUFFER			0
+#define CR_PCAP_TSTAMP			CR_TSTAMP_MICRO
+#define CR_SNAPLEN			100
+
 /* NUM_COMM_PHASE_PKTS:
  * number of COMM phase packets to send; should be enough to
- * succeed also under heavily-blocked circumstances */
+ * succeed also under heavily-blocked circumstances [comm_pkts] */
 #define NUM_COMM_PHASE_PKTS		100000
 
 /* NUM_OVERALL_REQ_PKTS:
  * number of CC packets (overall) that must go through warden
- * before we count NEL as completed */
+ * before we count NEL as completed [req_pkts] */
 #define NUM_OVERALL_REQ_PKTS		400
 
 /* NUM_COMM_PHASE_SND_PKTS_P_PROT:
  * how many packets to send during the *COMM* phase per
- * non-blocked protocol in a row */
+ * non-blocked protocol in a row [comm_pkts_per_proto] */
 #define NUM_COMM_PHASE_SND_PKTS_P_PROT	5
 
 /* NUM_NEL_TESTPKT_SND_PKTS_P_PROT:
- * how many packets to be sent per CC type during *NEL* phase */
+ * how many packets to be sent per CC type during *NEL* phase [nel_pkts_per_proto] */
 #define NUM_NEL_TESTPKT_SND_PKTS_P_PROT 5
 
+/* NUM_NEL_BATCH_PROTOS:
+ * how many protocols the CS announces at once during the *NEL* phase; their
+ * probes are sent back to back and the CR's verdicts are collected as they
+ * arrive, so one batch costs about one probe time-slot. 1=one protocol at
+ * a time (as NEL <= 0.4.0), number of rules=probe all protocols in every
+ * batch [nel_batch] */
+#define NUM_NEL_BATCH_PROTOS		10
+
+/* PROBE_POLICY -- NEW in v.0.5.0:
+ * how the CS chooses the protocols of the next NEL batch (see probe.c):
+ * PROBE_POLICY_RANDOM: uniformly at random;
+ * PROBE_POLICY_RR: one after another (round-robin);
+ * PROBE_POLICY_STALE: the protocols with the oldest verdicts (or none) first;
+ * PROBE_POLICY_THOMPSON: Thompson sampling of each protocol's chance to
+ *   pass the warden, learned from its verdicts [probe_policy]
+ * PROBE_DECAY:
+ * time constant (in sec) with which the verdicts of a protocol lose their
+ * weight for Thompson sampling, so that it notices a reloaded warden;
+ * 0=verdicts never age [probe_decay] */
+#define PROBE_POLICY_RANDOM		0x00
+#define PROBE_POLICY_RR			0x01
+#define PROBE_POLICY_STALE		0x02
+#define PROBE_POLICY_THOMPSON		0x03
+#define PROBE_POLICIES			4
+#define PROBE_POLICY			PROBE_POLICY_THOMPSON
+#define PROBE_DECAY			60
+
 /* All warden macros must be <0xff */
 #define WARDEN_MODE_NO_WARDEN           0x10
 #define WARDEN_MODE_REG_WARDEN          0x20 /* regular warden */
 #define WARDEN_MODE_DYN_WARDEN          0x40 /* dynamic warden (Mazurczyk et al.) */
 #define WARDEN_MODE_ADP_WARDEN          0x80 /* *SIMPLIFIED* Adaptive Warden(!) */
-#define WARDEN_MODE                     WARDEN_MODE_NO_WARDEN
+#define WARDEN_MODE                     WARDEN_MODE_NO_WARDEN /* [warden] */
 
 /* WARDEN_MODE_REG/DYN/ADP_WARDEN -> SIM_LIMIT_FOR_BLOCKED_SENDING -- NEW in v.0.2.6:
  * Simulate a WARDEN already in this tool w/o relying on extra software.
@@ -91,12 +213,12 @@
  * 2=sender will send 4% (block 96%) of the probe packets;
  * 25=sender will send/block 50% of the probe packets;
  * 50=sender will send 100% of the probe protocols (DEFAULT) */
-#define SIM_LIMIT_FOR_BLOCKED_SENDING 50 /* must be <=50 and <0xff */
+#define SIM_LIMIT_FOR_BLOCKED_SENDING 50 /* must be <=50 [sim_limit] */
 /* WARDEN_MODE_DYN/ADP -> RELOAD_INTERVAL [seconds]:
  * After how many seconds should we shuffle the active rules again?
  * Note: This is not exact. It is always RELOAD_INTERVAL+small overhead.
  */
-#define RELOAD_INTERVAL		 10 /* must be <0xff */
+#define RELOAD_INTERVAL		 10 /* [reload_interval] */
 /* WARDEN_MODE_ADP -> SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE:
  * How many of the recently triggered inactive rules are activated
  * during the next run?
@@ -104,34 +226,421 @@
  * 2=the 2 latest triggered rules would be moved
  * 50=All rules will be moved (i.e. warden only based on observations of triggers!)
  */
-#define SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE  5 /* must be <0xff */
+#define SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE  5 /* [inactive_checked] */
+
 
+/* Simulation mode (`nel simulate', sim.c) -- NEW in v.0.5.0:
+ * Runs sender, simulated warden and receiver in virtual time within one
+ * process (no sockets, pcap or scapy). Only useful for the simulated
+ * wardens (and NO warden).
+ * SIM_PKT_TX_TIME: virtual time [sec] to send (or pretend sending) one packet.
+ * SIM_SCAPY_TX_TIME: the same for a rule the native packet engine cannot
+ *   craft (pkt_build()), i.e. that is sent via scapy.
+ * SIM_FEEDBACK_RTT: virtual round-trip time [sec] of the feedback channel,
+ *   i.e. from the CS's announcement until it receives the CR's `armed'.
+ * SIM_MAX_TIME: virtual time [sec] after which a run counts as failed. */
+#define SIM_PKT_TX_TIME		0.001 /* must be >0 */
+#define SIM_SCAPY_TX_TIME	0.05
+#define SIM_FEEDBACK_RTT	0.001
+#define SIM_MAX_TIME		86400
+
+/* Monte Carlo experiments (`nel experiment', experiment.c) -- NEW in v.0.5.0:
+ * Runs many simulations per warden configuration on all cores and reports
+ * the distribution of the completion times.
+ * EXP_MAX_CONFIGS: max. number of warden configurations per experiment.
+ * EXP_CI_Z: z-value of the reported confidence interval (1.96 = 95%). */
+#define EXP_MAX_CONFIGS		32
+#define EXP_CI_Z		1.96
+
+/* Multi-flow sender (`nel flows', csflow.c) -- NEW in v.0.5.0:
+ * Runs many independent NEL senders (flows) in one process: every flow has
+ * its own P_nb, simulated warden, feedback channel and warden-link source
+ * address (src_addr+i), and all flows share the packet engine. The flows'
+ * NEL, COMM and reloader work is done by a small pool of worker threads
+ * that steal work from each other.
+ * CS_FLOW_MAX: max. number of flows.
+ * CS_FLOW_BURST: max. COMM packets of a flow sent with one sendmmsg().
+ * CS_FLOW_IDLE_MS: max. time [ms] an idle worker waits for feedback before
+ *   it looks for work again. */
+#define CS_FLOW_MAX		1024
+#define CS_FLOW_BURST		64
+#define CS_FLOW_IDLE_MS		10
 
 /* remaining basic definitions */
 #define MODE_UNSET		0x00
 #define MODE_SENDER		0x01
 #define MODE_RECEIVER           0x02
+#define MODE_SIMULATE		0x03
+#define MODE_EXPERIMENT		0x04
+#define MODE_FLOWS		0x05
+#define MODE_REPLAY		0x06
+
+/* USE_NATIVE_PKT_ENGINE:
+ * If defined, CC packets are crafted in-process (pkt.c) and sent over a raw
+ * socket instead of running scapy for every single packet. Rules that the
+ * native engine cannot craft are still sent via scapy. Comment out to send
+ * all packets via scapy (behavior of NEL <= 0.4.0). */
+#define USE_NATIVE_PKT_ENGINE
+
+/* PKT_MAX_LEN: max. size of a natively crafted CC packet */
+#define PKT_MAX_LEN		1500
+
+/* COMM phase burst of one flow of the multi-flow sender */
+typedef struct {
+	struct mmsghdr	msg[CS_FLOW_BURST];
+	struct iovec	iov[CS_FLOW_BURST];
+	u_char		buf[CS_FLOW_BURST][PKT_MAX_LEN];
+	int		len;
+	int		sent;	/* by pkt_burst_add_src() since the last flush */
+} pkt_burst_t;
+
+/* USE_PKT_TMPL_CACHE:
+ * If defined (and USE_NATIVE_PKT_ENGINE is defined), the packets of rules
+ * the native engine cannot craft are generated by one batched scapy run at
+ * start-up and stored in the file PKT_TMPL_CACHE_FILE (keyed by a hash of
+ * the rule's scapy command). Later starts only run scapy for new rules. */
+#define USE_PKT_TMPL_CACHE
+#define PKT_TMPL_CACHE_FILE	"nel_tmpl.cache"
+#define PKT_TMPL_MAGIC		"NELTMPL1"
+
+/* USE_SCAPY_WORKER:
+ * If defined, packets that still need scapy are sent by one persistent
+ * python/scapy process (scapyw.c) instead of one `echo ... | scapy' per
+ * packet. SCAPY_PYTHON is the interpreter that has scapy installed. */
+#define USE_SCAPY_WORKER
+#define SCAPY_PYTHON		"python3"
 
-/* INCREMENTAL_PROTO_SELECT:
- * This macro (if uncommented) ensures that protocols are selected in an incremental
- * manner instead of randomly */
-/*#define INCREMENTAL_PROTO_SELECT*/
+/* USE_COMM_BATCH_TX:
+ * If defined (and USE_NATIVE_PKT_ENGINE is defined), the COMM phase queues
+ * the packets of all non-blocked protocols of one pass over P_nb and sends
+ * them with one sendmmsg() call (at most PKT_BURST_MAX packets per call).
+ * The achieved packet rate is reported every COMM_RATE_REPORT_INTERVAL sec. */
+#define USE_COMM_BATCH_TX
+#define PKT_BURST_MAX		1024
+#define COMM_RATE_REPORT_INTERVAL	1
 
 #define min(a, b)		(a < b ? a : b)
 
+/* Message of the feedback channel (all fields in network byte order, see
+ * nel_msg_send()/nel_msg_recv()). The CS numbers its announcements; the CR's
+ * `armed' and result messages carry the sequence number of the announcement
+ * they belong to, so several announcements can be outstanding at once.
+ * announced_proto is the id of the rule (nel_rule_t.id). */
+#define NEL_PROTO_VERSION	4
 typedef struct {
+	u_int16_t		version;	/* NEL_PROTO_VERSION */
+#define NEL_MSG_ANNOUNCE	0x01 /* CS->CR: probe of announced_proto follows */
+#define NEL_MSG_ARMED		0x02 /* CR->CS: CR now counts announced_proto's packets */
+#define NEL_MSG_RESULT		0x03 /* CR->CS: result of the probe */
+	u_int16_t		type;
+	u_int32_t		seq;
 	u_int32_t		announced_proto;
 #define RESULT_RECVD		0x01 /* received during time-slot */
 #define RESULT_TIMEOUT		0x00 /* not received during time-slot */
 	u_int32_t		result;
-	u_int32_t		goalcfg; /* used by CS to tell CR what the config is */
 } nel_proto_t;
 
+/* In an announcement, `result' tells the CR which probes the CS sends before
+ * the announced one once the batch is armed: the number of natively sent
+ * and of scapy-sent probes of the batch, the announced one included. The CR
+ * scales the probe's time-slot accordingly (see CR_NEL_ADAPTIVE_WAIT). */
+#define NEL_ANNOUNCE_POS(native, scapy)	((u_int32_t) (native) | (u_int32_t) (scapy) << 16)
+#define NEL_ANNOUNCE_NATIVE(pos)	((pos) & 0xffff)
+#define NEL_ANNOUNCE_SCAPY(pos)		((pos) >> 16)
+
+void nel_msg_encode(nel_proto_t *, u_int16_t, u_int32_t, u_int32_t, u_int32_t);
+int nel_msg_send(int, u_int16_t, u_int32_t, u_int32_t, u_int32_t);
+int nel_msg_recv(int, nel_proto_t *);
+int nel_msg_decode(const void *, nel_proto_t *);
+
+/* Configuration message: sent once by the CS after connecting, so that the
+ * CR knows (and uses) the sender's configuration. A nel_cfgmsg_t header is
+ * followed by `len' bytes of TLVs (nel_tlv_t + value); all fields are in
+ * network byte order. TLV types are the CFG_TLV_* values of config.c;
+ * unknown types are skipped, so parameters can be added later. */
+#define NEL_CFGMSG_MAGIC	0x4e454c43 /* "NELC" */
+#define NEL_CFGMSG_VERSION	1
+#define NEL_CFGMSG_MAX		512
+typedef struct {
+	u_int32_t		magic;
+	u_int16_t		version;
+	u_int16_t		len;
+} nel_cfgmsg_t;
+
+typedef struct {
+	u_int16_t		type;
+	u_int16_t		len;
+} nel_tlv_t;
+
+/* Run-time configuration (config.c). nel_cfg is the configuration of this
+ * process: the defaults from the macros above, changed by `-f'/`-o';
+ * experiments simulate several configurations. */
+typedef struct {
+	u_int32_t	warden_mode;	/* WARDEN_MODE */
+	u_int32_t	sim_limit;	/* SIM_LIMIT_FOR_BLOCKED_SENDING */
+	u_int32_t	reload_interval; /* RELOAD_INTERVAL */
+	u_int32_t	inactive2active; /* SIM_INACTIVE_CHECKED_MOVE_TO_ACTIVE */
+	u_int32_t	nel_wait;	/* CR_NEL_TESTPKT_WAITING_TIME */
+	u_int32_t	req_pkts;	/* NUM_OVERALL_REQ_PKTS */
+	u_int32_t	comm_pkts;	/* NUM_COMM_PHASE_PKTS */
+	u_int32_t	comm_pkts_p_prot; /* NUM_COMM_PHASE_SND_PKTS_P_PROT */
+	u_int32_t	nel_pkts_p_prot; /* NUM_NEL_TESTPKT_SND_PKTS_P_PROT */
+	u_int32_t	adaptive_wait;	/* CR_NEL_ADAPTIVE_WAIT */
+	u_int32_t	nel_batch;	/* NUM_NEL_BATCH_PROTOS */
+	u_int32_t	src_addr;	/* CS's warden-link IPv4 address (host order), 0=auto */
+	u_int32_t	sessions;	/* CR_EXIT_AFTER_SESSIONS (CR only) */
+	u_int32_t	probe_policy;	/* PROBE_POLICY */
+	u_int32_t	probe_decay;	/* PROBE_DECAY */
+	u_int32_t	capture;	/* CR_CAPTURE (CR only) */
+	u_int32_t	ring_size;	/* CR_RING_SIZE (CR only) */
+	u_int32_t	ring_timeout;	/* CR_RING_BLOCK_TIMEOUT (CR only) */
+	u_int32_t	ebpf_interval;	/* CR_EBPF_INTERVAL (CR only) */
+	u_int32_t	pcap_immediate;	/* CR_PCAP_IMMEDIATE (CR only) */
+	u_int32_t	pcap_buffer;	/* CR_PCAP_BUFFER (CR only) */
+	u_int32_t	pcap_tstamp;	/* CR_PCAP_TSTAMP (CR only) */
+	/* not configurable: the CS's ruleset (sent with the configuration,
+	 * 0 if the CS did not send it) */
+	u_int32_t	rules;		/* number of rules */
+	u_int64_t	rules_digest;	/* see ruleset.c */
+} nel_cfg_t;
+
+extern nel_cfg_t nel_cfg;
+const char *cfg_set(nel_cfg_t *, const char *, const char *);
+void cfg_load(nel_cfg_t *, const char *);
+const char *cfg_check(const nel_cfg_t *);
+void cfg_usage(void);
+int cfg_encode(const nel_cfg_t *, u_int8_t *, int);
+int cfg_decode(nel_cfg_t *, const u_int8_t *, int);
+
+/* A rule of the ruleset (ruleset.c): a covert channel technique, the scapy
+ * command that builds its packet `a' and the pcap filter that matches it.
+ * Rules are referred to by their index in nel_rules. */
+typedef struct {
+	u_int32_t	id;
+	const char	*name;
+	const char	*tmpl;
+	const char	*filter;
+} nel_rule_t;
+
+extern nel_rule_t *nel_rules;
+extern u_int32_t nel_nrules;
+extern u_int64_t nel_rules_digest;
+void ruleset_init(const char *);
+int ruleset_lookup(u_int32_t);
+
+/* NEL_PHASE_*: phase a CC packet is sent in (see nel_state_t.send) */
+#define NEL_PHASE_NEL		0x01
+#define NEL_PHASE_COMM		0x02
+
+/* Set of rules (one bit per rule) that is read and modified concurrently by
+ * the sender threads; see nel_bit_*() in helper.c. The words are allocated
+ * for the loaded ruleset by nel_bits_init(). */
+#define NEL_BITSET_WORDS	((nel_nrules + 63) / 64)
+typedef struct {
+	u_int64_t	*w;
+} nel_bitset_t;
+
+/* The simulated warden's ruleset (DYN/ADP warden). A reload fills the
+ * snapshot that is not in use, waits until no sender reads it any more and
+ * then publishes it at once, so that the senders never see a partially
+ * reloaded ruleset (see cs_reload_rules()). */
+typedef struct {
+	nel_bitset_t	active;		/* activated (=blocking) rules */
+	u_int32_t	epoch;		/* number of reloads */
+	int		readers;	/* senders reading the snapshot (atomic) */
+} nel_ruleset_t;
+
+/* what the CS learned about a protocol from its verdicts (see probe.c) */
+typedef struct {
+	float		pass;		/* verdicts `passed', aged */
+	float		fail;		/* verdicts `blocked', aged */
+	double		last;		/* time of the last verdict, 0=none */
+} nel_probe_stat_t;
+
+/* State of a NEL sender: P_nb and the simulated warden's ruleset. The
+ * decision logic in cs.c only accesses time and the network through the
+ * hooks, so that the same logic drives the real sender threads (wall-clock
+ * time, actual packets) and the simulation in sim.c (virtual time). */
+typedef struct nel_state {
+	/* the set of currently non-blocked protocols (indicated by '1'. Set
+	 * to '0' by default and set back to '0' once discovered as blocked
+	 * again. */
+	nel_bitset_t	P_nb;
+	nel_ruleset_t	*ruleset;	/* current snapshot of ruleset_snap */
+	nel_ruleset_t	ruleset_snap[2];
+	/* ADP warden: when the rules were last triggered (atomic access) */
+	time_t		*ruleset_checked;
+	unsigned int	seed;		/* rand_r() state */
+	u_int32_t	next_proto;	/* PROBE_POLICY_RR */
+	/* verdicts per protocol (NEL phase only) */
+	nel_probe_stat_t *probe;
+	double		*score;		/* probe.c: per protocol, scratch */
+	int		verbose;
+	const nel_cfg_t	*cfg;		/* warden configuration */
+	double		(*now)(struct nel_state *);
+	void		(*send)(struct nel_state *, u_int32_t, int);
+	void		(*pretend)(struct nel_state *, u_int32_t);
+	/* is the protocol sent without scapy? (see NEL_ANNOUNCE_POS) */
+	int		(*native)(struct nel_state *, u_int32_t);
+	/* optional: P_nb gained a protocol (wakes an idle COMM phase) */
+	void		(*nb_found)(struct nel_state *);
+	void		*priv;		/* hook data */
+} nel_state_t;
+
+extern nel_state_t cs_state;
+void cs_state_alloc(nel_state_t *);
+void cs_state_free(nel_state_t *);
+void cs_state_init(nel_state_t *);
+void cs_print_config(const nel_cfg_t *);
+int cs_warden_blocks(nel_state_t *, u_int32_t);
+void cs_NEL_send_probe(nel_state_t *, u_int32_t);
+u_int32_t cs_NEL_announce_pos(nel_state_t *, const u_int32_t *, int);
+void cs_NEL_feedback(nel_state_t *, u_int32_t, u_int32_t);
+void cs_COMM_send_pkt(nel_state_t *, u_int32_t);
+void cs_reload_rules(nel_state_t *);
+/* probe.c */
+int probe_policy_lookup(const char *);
+const char *probe_policy_name(u_int32_t);
+void probe_select(nel_state_t *, u_int32_t *, int);
+void probe_verdict(nel_state_t *, u_int32_t, int);
+/* CR: per-rule statistics of a session (cr_measure.c) */
+typedef struct {
+	u_int64_t	recvd;		/* packets classified to the rule */
+	u_int32_t	probes;		/* NEL: announcements */
+	u_int32_t	probes_ok;	/* NEL: announcements with >=1 packet */
+	u_int64_t	probe_pkts;	/* NEL: packets received in the time-slots */
+	double		last;		/* capture time of the last packet */
+} cr_rule_stat_t;
+
+/* CR: estimator of the time one probe adds to the time from an announcement
+ * until all its probe packets were captured, one per way of sending (see
+ * CR_NEL_ADAPTIVE_WAIT) */
+#define NEL_ENGINE_NATIVE	0
+#define NEL_ENGINE_SCAPY	1
+#define NEL_ENGINES		2
+typedef struct {
+	double		srtt;
+	double		rttvar;
+	int		samples;
+} nel_rtt_t;
+
+/* CR: an announced protocol whose probe packets the CR waits for */
+typedef struct {
+	int		active;
+	u_int32_t	seq;		/* of the announcement */
+	u_int32_t	pos;		/* NEL_ANNOUNCE_POS() of the announcement */
+	u_int64_t	start;		/* rule's packet counter when armed */
+	double		t0;		/* cr_now() when armed */
+	double		deadline;	/* cr_now() at the end of the time-slot */
+	int		sample;		/* use the probe for the session's rtt? */
+	int		heap;		/* position in the deadline heap (cr.c) */
+} cr_probe_t;
+
+/* CR: one sender served by the receiver (cr.c) */
+typedef struct {
+	int		fd;		/* feedback channel, -1: unused */
+	u_int32_t	id;		/* session number (for the output) */
+	struct in_addr	src;		/* CS's warden-link address */
+	nel_cfg_t	cfg;		/* the CS's configuration */
+	int		measuring;	/* first announcement received */
+	double		t_start;	/* cr_now() at the first announcement */
+	double		t_end;		/* cr_now() at completion */
+	int		recvd;		/* CC packets received through the warden */
+	double		t_progress;	/* cr_now() when `recvd' was reported */
+	cr_rule_stat_t	*rule;		/* per rule */
+	cr_probe_t	*probe;		/* per rule */
+	int		probes_active;
+	nel_rtt_t	rtt[NEL_ENGINES];
+	int		configured;	/* configuration message received */
+	struct in_addr	peer;		/* feedback channel's address */
+	/* feedback channel input not processed yet: the socket is
+	 * non-blocking and a message may arrive in pieces */
+	u_int8_t	rbuf[sizeof(nel_cfgmsg_t) + NEL_CFGMSG_MAX];
+	int		rlen;
+	/* feedback channel output the socket did not take yet (sent when it
+	 * is writable again) */
+	u_int8_t	*wbuf;
+	int		wlen, wsize;
+	int		pollout;	/* waiting for EPOLLOUT */
+	int		failed;		/* output lost: close the session */
+} cr_session_t;
+
+extern u_int64_t cr_unattributed;
+
+int cr_NEL_account(const nel_cfg_t *, int, int *);
+void cr_rtt_sample(nel_rtt_t *, u_int32_t, double);
+double cr_rtt_timeout(const nel_rtt_t *, u_int32_t, const nel_cfg_t *);
+double cr_now(void);
+cr_session_t *cr_session_of(struct in_addr);
+cr_session_t *cr_session_slot(int);
+cr_session_t *cr_session_new(void);
+void cr_session_free(cr_session_t *);
+void cr_session_done(cr_session_t *);
+const struct bpf_program *cr_pcap_compile(pcap_t *);
+const struct bpf_program *cr_rule_filter(int);
+void cr_pcap_setup(pcap_t *);
+void cr_pcap_init(void);
+int cr_pkt_src(const struct pcap_pkthdr *, const u_char *, struct in_addr *);
+int cr_classify(cr_session_t *, const struct pcap_pkthdr *, const u_char *);
+void cr_rule_probed(cr_session_t *, u_int32_t, int);
+void cr_print_rule_stats(cr_session_t *);
+void cr_measure_report(cr_session_t *);
+void cr_progress(cr_session_t *);
+int cr_pcap_fd(void);
+void cr_pcap_dispatch(void);
+void cr_capture_report(void);
+void cr_capture_sessions(void);
+double cr_pkt_time(const struct pcap_pkthdr *);
+void pkt_handler_COM(u_char *, const struct pcap_pkthdr *, const u_char *);
+/* cr_filter.c */
+char *cr_filter_build(void);
+/* cr_ring.c */
+int cr_packet_socket(int *, int *);
+void cr_packet_bind(int);
+void cr_ring_init(void);
+int cr_ring_fd(void);
+void cr_ring_dispatch(void);
+void cr_ring_report(void);
+/* cr_ebpf.c */
+int cr_ebpf_init(void);
+int cr_ebpf_fd(void);
+void cr_ebpf_dispatch(void);
+void cr_ebpf_sessions(void);
+void cr_ebpf_report(void);
+int cr_ebpf_check_init(void);
+int cr_ebpf_check_run(const u_char *, u_int32_t, u_char *);
+void cr_run(int);
+void cr_replay(int, char **);
+int simulate(const nel_cfg_t *, unsigned int, int, double *, int *);
+int experiment(int, char **);
 void *cs_COMM_sender(void *);
 void *cs_NEL_handler(void *);
 void *cs_RuleReloader(void *);
-void *cr_NEL_handler(void *);
-void *cr_measure(void *);
+void send_CC_packet(u_int32_t);
+void cs_flows(int, char **);
 void usage(void);
+int nel_bit_test(const nel_bitset_t *, u_int32_t);
+int nel_bit_assign(nel_bitset_t *, u_int32_t, int);
+void nel_bits_init(nel_bitset_t *);
+void nel_bits_free(nel_bitset_t *);
+void nel_bits_clear(nel_bitset_t *);
+void nel_bits_copy(nel_bitset_t *, const nel_bitset_t *);
+int nel_bits_next(const nel_bitset_t *, u_int32_t);
+int nel_bits_count(const nel_bitset_t *);
+struct in_addr nel_route_src(struct in_addr);
+void *nel_calloc(size_t, size_t);
 void pretend_sending(u_int32_t);
+void pkt_engine_init(const char *);
+int pkt_build(const char *, u_char *, size_t, struct in_addr, struct in_addr);
+int pkt_is_native(u_int32_t);
+int pkt_send_native(u_int32_t);
+void pkt_pretend_native(u_int32_t);
+int pkt_burst_add(u_int32_t);
+int pkt_burst_flush(void);
+u_int64_t pkt_burst_drops(void);
+int pkt_send_native_src(u_int32_t, struct in_addr);
+int pkt_burst_add_src(pkt_burst_t *, u_int32_t, struct in_addr);
+int pkt_burst_flush_src(pkt_burst_t *);
+void scapyw_send(u_int32_t);
+void scapyw_pretend(u_int32_t);
 
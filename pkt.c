@@ -0,0 +1,1084 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+
+/* Native packet engine: the scapy commands of the ruleset are translated into
+ * raw packets once at start-up and then sent over a raw socket, i.e. without
+ * forking a shell and a python interpreter for every single packet.
+ * Only the subset of scapy's syntax used by our rules is understood (see
+ * pkt_layers[] below). The bytes of all other rules are generated by a
+ * single scapy run and kept in an on-disk template cache (see
+ * USE_PKT_TMPL_CACHE). Rules that still cannot be sent over a raw socket
+ * (an explicit IP checksum is always overwritten by the kernel) are sent
+ * via scapy by send_CC_packet(). */
+
+/* layer types */
+#define PKT_L_IP		0x01
+#define PKT_L_TCP		0x02
+#define PKT_L_UDP		0x03
+#define PKT_L_ICMP		0x04
+#define PKT_L_SCTP		0x05
+#define PKT_L_SCTPCHUNK		0x06
+#define PKT_L_RAW		0x07
+
+/* field kinds */
+#define PKT_F_INT		0x00
+#define PKT_F_ADDR		0x01 /* dotted-quad string */
+#define PKT_F_TCPFLAGS		0x02 /* integer or scapy flag string, e.g. "SA" */
+
+/* automatically computed values that can be overwritten by the rule */
+#define PKT_SET_LEN		0x01
+#define PKT_SET_CHKSUM		0x02
+#define PKT_SET_PROTO		0x04
+#define PKT_SET_SRC		0x08
+
+/* ICMP conditional fields (scapy only builds them for some ICMP types) */
+#define PKT_C_NONE		0x00
+#define PKT_C_ECHO		0x01 /* id/seq: types 0, 8, 13-18 */
+#define PKT_C_PARAM		0x02 /* ptr/reserved: type 12 */
+#define PKT_C_UNUSED		0x03 /* unused: types 3, 4, 10, 11 */
+#define PKT_C_GW		0x04 /* gw: type 5 */
+
+#define PKT_MAX_LAYERS		8
+#define PKT_MAX_ARGS		8
+
+typedef struct {
+	const char	*name;
+	int		off;	/* byte offset within the layer header */
+	int		len;	/* size of the field's byte range (1-4) */
+	u_int32_t	mask;	/* bits of the field within that range (0=all) */
+	int		kind;	/* PKT_F_* */
+	int		cond;	/* PKT_C_* */
+	int		autoset;/* PKT_SET_* value this field overwrites */
+} pkt_field_t;
+
+typedef struct {
+	const char		*name;
+	int			type;	/* PKT_L_* */
+	int			hdrlen;
+	u_int8_t		proto;	/* value of IP's proto field */
+	int			is_error; /* scapy's *error layers */
+	const u_char		*defaults;
+	const pkt_field_t	*fields;
+} pkt_layer_t;
+
+static const pkt_field_t pkt_ip_fields[] = {
+	{ "version",	0, 1, 0xf0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "ihl",	0, 1, 0x0f,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "tos",	1, 1, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "len",	2, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, PKT_SET_LEN },
+	{ "id",		4, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "flags",	6, 2, 0xe000,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "frag",	6, 2, 0x1fff,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "ttl",	8, 1, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "proto",	9, 1, 0,	  PKT_F_INT,	  PKT_C_NONE, PKT_SET_PROTO },
+	{ "chksum",	10, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, PKT_SET_CHKSUM },
+	{ "src",	12, 4, 0,	  PKT_F_ADDR,	  PKT_C_NONE, PKT_SET_SRC },
+	{ NULL, 0, 0, 0, 0, 0, 0 }
+};
+
+static const pkt_field_t pkt_tcp_fields[] = {
+	{ "sport",	0, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "dport",	2, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "seq",	4, 4, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "ack",	8, 4, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "dataofs",	12, 1, 0xf0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "reserved",	12, 1, 0x0e,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "flags",	12, 2, 0x01ff,	  PKT_F_TCPFLAGS, PKT_C_NONE, 0 },
+	{ "window",	14, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "chksum",	16, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, PKT_SET_CHKSUM },
+	{ "urgptr",	18, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ NULL, 0, 0, 0, 0, 0, 0 }
+};
+
+static const pkt_field_t pkt_udp_fields[] = {
+	{ "sport",	0, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "dport",	2, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "len",	4, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, PKT_SET_LEN },
+	{ "chksum",	6, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, PKT_SET_CHKSUM },
+	{ NULL, 0, 0, 0, 0, 0, 0 }
+};
+
+static const pkt_field_t pkt_icmp_fields[] = {
+	{ "type",	0, 1, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "code",	1, 1, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "chksum",	2, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, PKT_SET_CHKSUM },
+	{ "id",		4, 2, 0,	  PKT_F_INT,	  PKT_C_ECHO, 0 },
+	{ "seq",	6, 2, 0,	  PKT_F_INT,	  PKT_C_ECHO, 0 },
+	{ "ptr",	4, 1, 0,	  PKT_F_INT,	  PKT_C_PARAM, 0 },
+	{ "reserved",	5, 3, 0,	  PKT_F_INT,	  PKT_C_PARAM, 0 },
+	{ "unused",	4, 4, 0,	  PKT_F_INT,	  PKT_C_UNUSED, 0 },
+	{ "gw",		4, 4, 0,	  PKT_F_ADDR,	  PKT_C_GW, 0 },
+	{ NULL, 0, 0, 0, 0, 0, 0 }
+};
+
+static const pkt_field_t pkt_sctp_fields[] = {
+	{ "sport",	0, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "dport",	2, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "tag",	4, 4, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "chksum",	8, 4, 0,	  PKT_F_INT,	  PKT_C_NONE, PKT_SET_CHKSUM },
+	{ NULL, 0, 0, 0, 0, 0, 0 }
+};
+
+static const pkt_field_t pkt_sctpchunk_fields[] = {
+	{ "type",	0, 1, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "flags",	1, 1, 0,	  PKT_F_INT,	  PKT_C_NONE, 0 },
+	{ "len",	2, 2, 0,	  PKT_F_INT,	  PKT_C_NONE, PKT_SET_LEN },
+	{ NULL, 0, 0, 0, 0, 0, 0 }
+};
+
+/* scapy's default header values */
+static const u_char pkt_ip_defaults[20] = {
+	0x45, 0x00, 0x00, 0x14, 0x00, 0x01, 0x00, 0x00, 0x40, 0x00 };
+static const u_char pkt_tcp_defaults[20] = {
+	0x00, 0x14, 0x00, 0x50, 0, 0, 0, 0, 0, 0, 0, 0,
+	0x50, 0x02, 0x20, 0x00 };
+static const u_char pkt_udp_defaults[8] = {
+	0x00, 0x35, 0x00, 0x35 };
+static const u_char pkt_icmp_defaults[8] = {
+	0x08 };
+static const u_char pkt_sctp_defaults[12] = { 0 };
+static const u_char pkt_sctpchunk_defaults[4] = {
+	0x09 };
+
+static const pkt_layer_t pkt_layers[] = {
+	{ "IP",		    PKT_L_IP,	     20, 4,   0, pkt_ip_defaults,	 pkt_ip_fields },
+	{ "TCP",	    PKT_L_TCP,	     20, 6,   0, pkt_tcp_defaults,	 pkt_tcp_fields },
+	{ "TCPerror",	    PKT_L_TCP,	     20, 6,   1, pkt_tcp_defaults,	 pkt_tcp_fields },
+	{ "UDP",	    PKT_L_UDP,	      8, 17,  0, pkt_udp_defaults,	 pkt_udp_fields },
+	{ "UDPerror",	    PKT_L_UDP,	      8, 17,  1, pkt_udp_defaults,	 pkt_udp_fields },
+	{ "ICMP",	    PKT_L_ICMP,	      8, 1,   0, pkt_icmp_defaults,	 pkt_icmp_fields },
+	{ "ICMPerror",	    PKT_L_ICMP,	      8, 1,   1, pkt_icmp_defaults,	 pkt_icmp_fields },
+	{ "SCTP",	    PKT_L_SCTP,	     12, 132, 0, pkt_sctp_defaults,	 pkt_sctp_fields },
+	{ "SCTPChunkError", PKT_L_SCTPCHUNK,  4, 0,   0, pkt_sctpchunk_defaults, pkt_sctpchunk_fields },
+	{ NULL, 0, 0, 0, 0, NULL, NULL }
+};
+
+typedef struct {
+	const pkt_layer_t	*layer; /* NULL for raw payload */
+	size_t			off;
+	int			set;	/* PKT_SET_* */
+} pkt_inst_t;
+
+typedef struct {
+	const pkt_field_t	*field;
+	u_int32_t		value;
+	struct in_addr		addr;
+} pkt_arg_t;
+
+/* pre-built packets, one per rule (len == 0: needs scapy). The templates
+ * do not change once pkt_engine_init() returned; `native' is cleared (by
+ * the NEL or the COMM thread) if the kernel refuses the packet. */
+#define PKT_TMPL_NONE		0x00
+#define PKT_TMPL_NATIVE		0x01 /* crafted by pkt_build() */
+#define PKT_TMPL_SCAPY		0x02 /* bytes generated by scapy (cache) */
+typedef struct {
+	u_char	buf[PKT_MAX_LEN];
+	int	len;
+	int	origin;
+	int	native;	/* 1: send over the raw socket (atomic access) */
+} pkt_tmpl_t;
+static pkt_tmpl_t *pkt_tmpl;	/* per rule */
+
+/* errors of sendto() after which the kernel will never accept the packet;
+ * all others (ENOBUFS: the device's queue is full, EINTR, ...) are retried
+ * PKT_SEND_TRIES times with an increasing pause of PKT_BACKOFF_US << try */
+#define PKT_ERR_PERSISTENT(e)	((e) == EINVAL || (e) == EMSGSIZE || (e) == EPERM)
+#define PKT_SEND_TRIES		5
+#define PKT_BACKOFF_US		100
+
+/* template cache entry (see pkt_cache_load() for the file format) */
+typedef struct {
+	u_int64_t	hash;	 /* pkt_hash() of the scapy command */
+	struct in_addr	gen_src; /* source address scapy chose itself */
+	u_int16_t	len;
+	u_char		buf[PKT_MAX_LEN];
+} pkt_cache_ent_t;
+
+static int pkt_rawfd = -1;
+static struct sockaddr_in pkt_dst;
+static struct in_addr pkt_src;	/* source address of the templates */
+
+/* COMM phase burst, see pkt_burst_add() (only used by the COMM thread) */
+static struct mmsghdr pkt_burst_msg[PKT_BURST_MAX];
+static struct iovec pkt_burst_iov[PKT_BURST_MAX];
+static int pkt_burst_len = 0;
+static int pkt_burst_sent = 0;	/* by pkt_burst_add() since the last flush */
+/* COMM packets that sendmmsg() did not send (atomic access, all threads) */
+static u_int64_t pkt_burst_dropped = 0;
+
+static u_int32_t pkt_get(const u_char *p, int len)
+{
+	u_int32_t v = 0;
+
+	while (len-- > 0)
+		v = (v << 8) | *p++;
+	return v;
+}
+
+static void pkt_put(u_char *p, int len, u_int32_t v)
+{
+	while (len-- > 0) {
+		p[len] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+/* Internet checksum (RFC 1071); `sum' allows to add a pseudo header */
+static u_int16_t pkt_cksum(const u_char *p, size_t len, u_int32_t sum)
+{
+	while (len > 1) {
+		sum += (p[0] << 8) | p[1];
+		p += 2;
+		len -= 2;
+	}
+	if (len)
+		sum += p[0] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum & 0xffff;
+}
+
+/* CRC32c as used by SCTP (RFC 3309); only used at start-up, so no table */
+static u_int32_t pkt_crc32c(const u_char *p, size_t len)
+{
+	u_int32_t crc = 0xffffffff;
+	int i;
+
+	while (len--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static int pkt_icmp_cond(int cond, u_int8_t type)
+{
+	switch (cond) {
+	case PKT_C_NONE:
+		return 1;
+	case PKT_C_ECHO:
+		return (type == 0 || type == 8 || (type >= 13 && type <= 18));
+	case PKT_C_PARAM:
+		return (type == 12);
+	case PKT_C_UNUSED:
+		return (type == 3 || type == 4 || type == 10 || type == 11);
+	case PKT_C_GW:
+		return (type == 5);
+	}
+	return 0;
+}
+
+static void pkt_set_field(u_char *hdr, const pkt_arg_t *arg)
+{
+	const pkt_field_t *f = arg->field;
+	u_int32_t cur, v;
+	int shift = 0;
+
+	if (f->kind == PKT_F_ADDR) {
+		memcpy(hdr + f->off, &arg->addr, 4);
+		return;
+	}
+	if (f->mask == 0) {
+		pkt_put(hdr + f->off, f->len, arg->value);
+		return;
+	}
+	while (((f->mask >> shift) & 1) == 0)
+		shift++;
+	cur = pkt_get(hdr + f->off, f->len);
+	v = (cur & ~f->mask) | ((arg->value << shift) & f->mask);
+	pkt_put(hdr + f->off, f->len, v);
+}
+
+static const char *pkt_skip_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t')
+		p++;
+	return p;
+}
+
+/* parse a (scapy) string literal; returns pointer behind the closing quote */
+static const char *pkt_parse_str(const char *p, char *out, size_t outlen)
+{
+	size_t n = 0;
+
+	if (*p != '"')
+		return NULL;
+	for (p++; *p && *p != '"'; p++) {
+		if (n + 1 >= outlen)
+			return NULL;
+		out[n++] = *p;
+	}
+	if (*p != '"')
+		return NULL;
+	out[n] = '\0';
+	return p + 1;
+}
+
+static int pkt_tcpflags(const char *s, u_int32_t *v)
+{
+	const char *letters = "FSRPAUECN";
+	char *c;
+
+	*v = 0;
+	for (; *s; s++) {
+		if ((c = strchr(letters, *s)) == NULL)
+			return -1;
+		*v |= 1 << (c - letters);
+	}
+	return 0;
+}
+
+/* parse the argument list of a layer, e.g. `flags="S", urgptr=6363)' */
+static const char *pkt_parse_args(const char *p, const pkt_layer_t *layer,
+	pkt_arg_t *args, int *nargs, int *set)
+{
+	char name[32], str[64];
+	const pkt_field_t *f;
+	char *end;
+	size_t n;
+
+	*nargs = 0;
+	p = pkt_skip_ws(p);
+	while (*p != ')') {
+		for (n = 0; isalnum((unsigned char)*p) || *p == '_'; p++) {
+			if (n + 1 >= sizeof(name))
+				return NULL;
+			name[n++] = *p;
+		}
+		name[n] = '\0';
+		p = pkt_skip_ws(p);
+		if (*p++ != '=' || *nargs >= PKT_MAX_ARGS)
+			return NULL;
+		for (f = layer->fields; f->name != NULL; f++) {
+			if (strcmp(f->name, name) == 0)
+				break;
+		}
+		if (f->name == NULL)
+			return NULL; /* field unknown to the native engine */
+		args[*nargs].field = f;
+		p = pkt_skip_ws(p);
+		if (*p == '"') {
+			if ((p = pkt_parse_str(p, str, sizeof(str))) == NULL)
+				return NULL;
+			if (f->kind == PKT_F_ADDR) {
+				if (!inet_aton(str, &args[*nargs].addr))
+					return NULL;
+			} else if (f->kind == PKT_F_TCPFLAGS) {
+				if (pkt_tcpflags(str, &args[*nargs].value) != 0)
+					return NULL;
+			} else {
+				return NULL;
+			}
+		} else {
+			if (f->kind == PKT_F_ADDR)
+				return NULL;
+			args[*nargs].value = strtoul(p, &end, 0);
+			if (end == p)
+				return NULL;
+			p = end;
+		}
+		*set |= f->autoset;
+		(*nargs)++;
+		p = pkt_skip_ws(p);
+		if (*p == ',')
+			p = pkt_skip_ws(p + 1);
+		else if (*p != ')')
+			return NULL;
+	}
+	return p + 1;
+}
+
+/* compute all values scapy would fill in automatically (inner layers first) */
+static int pkt_finalize(u_char *pkt, size_t len, pkt_inst_t *l, int nl,
+	struct in_addr src, struct in_addr dst)
+{
+	u_int32_t pseudo;
+	u_char *h, *iph = NULL;
+	size_t rest;
+	int i;
+
+	for (i = 0; i < nl; i++) {
+		if (l[i].layer && l[i].layer->type == PKT_L_IP) {
+			h = pkt + l[i].off;
+			if (!(l[i].set & PKT_SET_SRC))
+				memcpy(h + 12, &src, 4);
+			memcpy(h + 16, &dst, 4); /* cf. `a.dst=...' */
+		}
+	}
+	for (i = nl - 1; i >= 0; i--) {
+		if (l[i].layer == NULL)
+			continue;
+		h = pkt + l[i].off;
+		rest = len - l[i].off;
+		/* TCP/UDP only get a checksum if they follow an IP header */
+		iph = (i > 0 && l[i - 1].layer && l[i - 1].layer->type == PKT_L_IP)
+			? pkt + l[i - 1].off : NULL;
+		switch (l[i].layer->type) {
+		case PKT_L_IP:
+			/* the kernel always overwrites the IP checksum of
+			 * packets sent over raw sockets */
+			if (l[i].set & PKT_SET_CHKSUM)
+				return -1;
+			if (!(l[i].set & PKT_SET_PROTO))
+				h[9] = (i + 1 < nl && l[i + 1].layer)
+					? l[i + 1].layer->proto : 0;
+			if (!(l[i].set & PKT_SET_LEN))
+				pkt_put(h + 2, 2, rest);
+			pkt_put(h + 10, 2, 0);
+			pkt_put(h + 10, 2, pkt_cksum(h, 20, 0));
+			break;
+		case PKT_L_TCP:
+		case PKT_L_UDP:
+			if (l[i].layer->type == PKT_L_UDP && !(l[i].set & PKT_SET_LEN))
+				pkt_put(h + 4, 2, rest);
+			if ((l[i].set & PKT_SET_CHKSUM) || l[i].layer->is_error
+			    || iph == NULL)
+				break;
+			pseudo = pkt_get(iph + 12, 2) + pkt_get(iph + 14, 2)
+			       + pkt_get(iph + 16, 2) + pkt_get(iph + 18, 2)
+			       + l[i].layer->proto + rest;
+			if (l[i].layer->type == PKT_L_TCP) {
+				pkt_put(h + 16, 2, 0);
+				pkt_put(h + 16, 2, pkt_cksum(h, rest, pseudo));
+			} else {
+				u_int16_t ck;
+
+				pkt_put(h + 6, 2, 0);
+				ck = pkt_cksum(h, rest, pseudo);
+				pkt_put(h + 6, 2, ck == 0 ? 0xffff : ck);
+			}
+			break;
+		case PKT_L_ICMP:
+			if (l[i].set & PKT_SET_CHKSUM)
+				break;
+			pkt_put(h + 2, 2, 0);
+			pkt_put(h + 2, 2, pkt_cksum(h, rest, 0));
+			break;
+		case PKT_L_SCTP:
+			if (l[i].set & PKT_SET_CHKSUM)
+				break;
+			{
+				u_int32_t crc;
+
+				pkt_put(h + 8, 4, 0);
+				crc = pkt_crc32c(h, rest);
+				/* CRC32c is transmitted in little endian order */
+				h[8] = crc & 0xff;
+				h[9] = (crc >> 8) & 0xff;
+				h[10] = (crc >> 16) & 0xff;
+				h[11] = (crc >> 24) & 0xff;
+			}
+			break;
+		case PKT_L_SCTPCHUNK:
+			if (!(l[i].set & PKT_SET_LEN))
+				pkt_put(h + 2, 2, rest);
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Build the packet described by a ruleset scapy command (e.g.
+ * `a=IP(ttl=255)/TCP(sport=9999)') into `pkt'. Returns the packet's length
+ * or -1 if the command uses scapy features unknown to the native engine. */
+int pkt_build(const char *scapy_cmd, u_char *pkt, size_t maxlen,
+	struct in_addr src, struct in_addr dst)
+{
+	pkt_inst_t l[PKT_MAX_LAYERS];
+	pkt_arg_t args[PKT_MAX_ARGS];
+	const pkt_layer_t *layer;
+	char name[32], str[PKT_MAX_LEN];
+	const char *p;
+	size_t len = 0, n;
+	int nl = 0, nargs, pass, i;
+
+	p = pkt_skip_ws(scapy_cmd);
+	if (strncmp(p, "a=", 2) != 0)
+		return -1;
+	p += 2;
+
+	while (1) {
+		p = pkt_skip_ws(p);
+		if (nl >= PKT_MAX_LAYERS)
+			return -1;
+		if (*p == '"') {
+			/* raw payload, e.g. IP()/ICMP()/"Covert.Channel" */
+			if ((p = pkt_parse_str(p, str, sizeof(str))) == NULL)
+				return -1;
+			n = strlen(str);
+			if (len + n > maxlen)
+				return -1;
+			memcpy(pkt + len, str, n);
+			l[nl].layer = NULL;
+			l[nl].off = len;
+			l[nl].set = 0;
+			len += n;
+		} else {
+			for (n = 0; isalnum((unsigned char)*p); p++) {
+				if (n + 1 >= sizeof(name))
+					return -1;
+				name[n++] = *p;
+			}
+			name[n] = '\0';
+			for (layer = pkt_layers; layer->name != NULL; layer++) {
+				if (strcmp(layer->name, name) == 0)
+					break;
+			}
+			if (layer->name == NULL || *p++ != '(')
+				return -1; /* layer unknown to the native engine */
+			if (len + layer->hdrlen > maxlen)
+				return -1;
+			memcpy(pkt + len, layer->defaults, layer->hdrlen);
+			l[nl].layer = layer;
+			l[nl].off = len;
+			l[nl].set = 0;
+			if ((p = pkt_parse_args(p, layer, args, &nargs, &l[nl].set)) == NULL)
+				return -1;
+			/* apply unconditional fields first since the ICMP type
+			 * decides which of the conditional fields exist */
+			for (pass = 0; pass < 2; pass++) {
+				for (i = 0; i < nargs; i++) {
+					if ((args[i].field->cond != PKT_C_NONE) != pass)
+						continue;
+					if (layer->type == PKT_L_ICMP
+					    && !pkt_icmp_cond(args[i].field->cond, pkt[len]))
+						continue; /* scapy ignores it, too */
+					pkt_set_field(pkt + len, &args[i]);
+				}
+			}
+			len += layer->hdrlen;
+		}
+		nl++;
+		p = pkt_skip_ws(p);
+		if (*p == '\0')
+			break;
+		if (*p++ != '/')
+			return -1;
+	}
+	if (nl == 0 || l[0].layer == NULL || l[0].layer->type != PKT_L_IP)
+		return -1;
+	if (pkt_finalize(pkt, len, l, nl, src, dst) != 0)
+		return -1;
+	return (int)len;
+}
+
+/* FNV-1a hash of a rule's scapy command, used as template cache key */
+static u_int64_t pkt_hash(const char *s)
+{
+	u_int64_t h = 0xcbf29ce484222325ULL;
+
+	while (*s) {
+		h ^= (u_char)*s++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* Read cache entries from `file' and append them to *ents. File format
+ * (host byte order, the cache is local to the NEL sender):
+ *   PKT_TMPL_MAGIC, u_int32_t number of entries, then per entry:
+ *   u_int64_t hash, 4 byte gen_src (network order), u_int16_t len, packet
+ * The same per-entry format is written by the scapy batch script. */
+static int pkt_cache_read(const char *file, int with_header,
+	pkt_cache_ent_t **ents, int *nents)
+{
+	FILE *fp;
+	char magic[sizeof(PKT_TMPL_MAGIC)];
+	u_int32_t cnt = 0xffffffff;
+	pkt_cache_ent_t e;
+
+	if ((fp = fopen(file, "r")) == NULL)
+		return -1;
+	if (with_header) {
+		if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic)
+		    || memcmp(magic, PKT_TMPL_MAGIC, sizeof(magic)) != 0
+		    || fread(&cnt, sizeof(cnt), 1, fp) != 1) {
+			fprintf(stderr, "template cache %s: invalid header, "
+				"ignoring it.\n", file);
+			fclose(fp);
+			return -1;
+		}
+	}
+	while (cnt-- > 0) {
+		if (fread(&e.hash, sizeof(e.hash), 1, fp) != 1
+		    || fread(&e.gen_src, sizeof(e.gen_src), 1, fp) != 1
+		    || fread(&e.len, sizeof(e.len), 1, fp) != 1)
+			break;
+		if (e.len > PKT_MAX_LEN || fread(e.buf, 1, e.len, fp) != e.len)
+			break;
+		*ents = realloc(*ents, (*nents + 1) * sizeof(pkt_cache_ent_t));
+		if (!*ents) {
+			fprintf(stderr, "ERR: memory alloc (realloc())\n");
+			exit(1);
+		}
+		memcpy(&(*ents)[(*nents)++], &e, sizeof(e));
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void pkt_cache_write(const char *file, pkt_cache_ent_t *ents, int nents)
+{
+	char tmpfile[256];
+	u_int32_t cnt = nents;
+	FILE *fp;
+	int i;
+
+	snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", file);
+	if ((fp = fopen(tmpfile, "w")) == NULL) {
+		perror("fopen(template cache)");
+		return;
+	}
+	fwrite(PKT_TMPL_MAGIC, 1, sizeof(PKT_TMPL_MAGIC), fp);
+	fwrite(&cnt, sizeof(cnt), 1, fp);
+	for (i = 0; i < nents; i++) {
+		fwrite(&ents[i].hash, sizeof(ents[i].hash), 1, fp);
+		fwrite(&ents[i].gen_src, sizeof(ents[i].gen_src), 1, fp);
+		fwrite(&ents[i].len, sizeof(ents[i].len), 1, fp);
+		fwrite(ents[i].buf, 1, ents[i].len, fp);
+	}
+	if (fclose(fp) != 0 || rename(tmpfile, file) != 0)
+		perror("writing template cache");
+}
+
+/* Let scapy generate the bytes of all given rules in one single run. */
+static void pkt_scapy_batch(int *rules, int nrules, const char *dst_ip,
+	pkt_cache_ent_t **ents, int *nents)
+{
+	char script[] = PKT_TMPL_CACHE_FILE ".py";
+	char outfile[] = PKT_TMPL_CACHE_FILE ".new";
+	char cmd[512];
+	FILE *fp;
+	int i;
+
+	if ((fp = fopen(script, "w")) == NULL) {
+		perror("fopen(scapy batch script)");
+		return;
+	}
+	/* one statement per line since scapy reads them interactively */
+	fprintf(fp, "import struct, socket\n");
+	fprintf(fp, "f=open(\"%s\",\"wb\")\n", outfile);
+	fprintf(fp, "s=socket.inet_aton(IP(dst=\"%s\").src)\n", dst_ip);
+	for (i = 0; i < nrules; i++) {
+		fprintf(fp, "%s;a.dst=\"%s\";b=bytes(a);"
+			"f.write(struct.pack(\"=Q4sH\",0x%" PRIx64 ",s,len(b))+b)\n",
+			nel_rules[rules[i]].tmpl, dst_ip, pkt_hash(nel_rules[rules[i]].tmpl));
+	}
+	fprintf(fp, "f.close()\n");
+	fclose(fp);
+
+	printf("generating %i packet templates with scapy ...\n", nrules);
+	snprintf(cmd, sizeof(cmd), "scapy <%s >scapy.log 2>&1", script);
+	/* this call not secure; code should be only be used for research
+	 * purposes, not in any productive environment! */
+	if (system(cmd) != 0) {
+		fprintf(stderr, "scapy batch run failed (see scapy.log), rules "
+			"without template will be sent via scapy.\n");
+	}
+	pkt_cache_read(outfile, 0, ents, nents);
+	unlink(outfile);
+	unlink(script);
+}
+
+/* Adjust a scapy-generated template to the current warden link: set dst
+ * (and src, unless the rule set it explicitly) and fix the checksums that
+ * depend on them. Returns -1 if the template cannot be sent over a raw
+ * socket (e.g. an intentionally invalid IP checksum). */
+static int pkt_retarget(u_char *pkt, int len, struct in_addr gen_src,
+	struct in_addr src, struct in_addr dst)
+{
+	u_char *l4;
+	u_int32_t pseudo;
+	int ihl, ckoff, l4len;
+	u_int8_t proto;
+
+	if (len < 20 || (pkt[0] >> 4) != 4)
+		return -1;
+	ihl = (pkt[0] & 0x0f) * 4;
+	if (ihl < 20 || ihl > len)
+		return -1;
+	/* the kernel would overwrite an invalid IP checksum */
+	if (pkt_cksum(pkt, ihl, 0) != 0)
+		return -1;
+
+	proto = pkt[9];
+	l4 = pkt + ihl;
+	l4len = len - ihl;
+	ckoff = (proto == 6 ? 16 : (proto == 17 ? 6 : -1));
+	/* recompute TCP/UDP checksums only if scapy computed them, i.e. if
+	 * they are valid for the old addresses */
+	if ((pkt_get(pkt + 6, 2) & 0x1fff) != 0 || ckoff + 2 > l4len
+	    || (proto == 17 && pkt_get(l4 + 6, 2) == 0))
+		ckoff = -1;
+	if (ckoff >= 0) {
+		pseudo = pkt_get(pkt + 12, 2) + pkt_get(pkt + 14, 2)
+		       + pkt_get(pkt + 16, 2) + pkt_get(pkt + 18, 2)
+		       + proto + l4len;
+		if (pkt_cksum(l4, l4len, pseudo) != 0)
+			ckoff = -1;
+	}
+
+	if (memcmp(pkt + 12, &gen_src, 4) == 0)
+		memcpy(pkt + 12, &src, 4);
+	memcpy(pkt + 16, &dst, 4);
+	pkt_put(pkt + 10, 2, 0);
+	pkt_put(pkt + 10, 2, pkt_cksum(pkt, ihl, 0));
+	if (ckoff >= 0) {
+		u_int16_t ck;
+
+		pseudo = pkt_get(pkt + 12, 2) + pkt_get(pkt + 14, 2)
+		       + pkt_get(pkt + 16, 2) + pkt_get(pkt + 18, 2)
+		       + proto + l4len;
+		pkt_put(l4 + ckoff, 2, 0);
+		ck = pkt_cksum(l4, l4len, pseudo);
+		pkt_put(l4 + ckoff, 2, (proto == 17 && ck == 0) ? 0xffff : ck);
+	}
+	return 0;
+}
+
+/* Fill the templates of all rules pkt_build() could not handle from the
+ * on-disk cache; scapy is only run (once) for rules missing in the cache. */
+static void pkt_tmpl_from_cache(const char *dst_ip, struct in_addr src)
+{
+	pkt_cache_ent_t *ents = NULL;
+	int nents = 0, nold;
+	int *missing = nel_calloc(nel_nrules, sizeof(int)), nmissing = 0;
+	int pass, i, j;
+
+	pkt_cache_read(PKT_TMPL_CACHE_FILE, 1, &ents, &nents);
+	nold = nents;
+	for (pass = 0; pass < 2; pass++) {
+		nmissing = 0;
+		for (i = 0; i < nel_nrules; i++) {
+			u_int64_t h;
+
+			if (pkt_tmpl[i].origin != PKT_TMPL_NONE)
+				continue;
+			h = pkt_hash(nel_rules[i].tmpl);
+			for (j = 0; j < nents && ents[j].hash != h; j++)
+				;
+			if (j == nents) {
+				missing[nmissing++] = i;
+				continue;
+			}
+			memcpy(pkt_tmpl[i].buf, ents[j].buf, ents[j].len);
+			pkt_tmpl[i].origin = PKT_TMPL_SCAPY;
+			if (pkt_retarget(pkt_tmpl[i].buf, ents[j].len,
+			    ents[j].gen_src, src, pkt_dst.sin_addr) == 0)
+				pkt_tmpl[i].len = ents[j].len;
+		}
+		if (nmissing == 0 || pass == 1)
+			break;
+		pkt_scapy_batch(missing, nmissing, dst_ip, &ents, &nents);
+	}
+	if (nents != nold)
+		pkt_cache_write(PKT_TMPL_CACHE_FILE, ents, nents);
+	free(ents);
+	free(missing);
+}
+
+/* Prepare the native packet engine: open the raw socket and pre-build one
+ * packet per rule. On failure, all rules are sent via scapy. */
+void pkt_engine_init(const char *dst_ip)
+{
+	struct in_addr src;
+	int i, native = 0, cached = 0;
+
+	bzero(&pkt_dst, sizeof(pkt_dst));
+	pkt_dst.sin_family = AF_INET;
+	if (!inet_aton(dst_ip, &pkt_dst.sin_addr)) {
+		fprintf(stderr, "native packet engine: invalid warden-link IP "
+			"'%s'\n", dst_ip);
+		exit(1);
+	}
+
+	/* determine the source address the kernel would choose for the
+	 * warden link (scapy does the same using the routing table) */
+	src = nel_route_src(pkt_dst.sin_addr);
+	if (nel_cfg.src_addr != 0)
+		src.s_addr = htonl(nel_cfg.src_addr);
+	pkt_src = src;
+	pkt_tmpl = nel_calloc(nel_nrules, sizeof(pkt_tmpl_t));
+
+	/* IPPROTO_RAW implies IP_HDRINCL */
+	if ((pkt_rawfd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) < 0) {
+		perror("socket(SOCK_RAW)");
+		fprintf(stderr, "native packet engine disabled, all packets "
+			"will be sent via scapy.\n");
+		return;
+	}
+
+	for (i = 0; i < nel_nrules; i++) {
+		pkt_tmpl[i].len = pkt_build(nel_rules[i].tmpl, pkt_tmpl[i].buf,
+			sizeof(pkt_tmpl[i].buf), src, pkt_dst.sin_addr);
+		if (pkt_tmpl[i].len < 0) {
+			pkt_tmpl[i].len = 0;
+			pkt_tmpl[i].origin = PKT_TMPL_NONE;
+		} else {
+			pkt_tmpl[i].origin = PKT_TMPL_NATIVE;
+			native++;
+		}
+	}
+#ifdef USE_PKT_TMPL_CACHE
+	pkt_tmpl_from_cache(dst_ip, src);
+#endif
+	for (i = 0; i < nel_nrules; i++) {
+		if (pkt_tmpl[i].origin == PKT_TMPL_SCAPY && pkt_tmpl[i].len > 0)
+			cached++;
+		pkt_tmpl[i].native = (pkt_tmpl[i].len > 0);
+#ifdef DEBUGMODE
+		if (pkt_tmpl[i].len == 0)
+			fprintf(stderr, "DEBUG: rule %u ('%s') needs scapy\n",
+				nel_rules[i].id, nel_rules[i].tmpl);
+#endif
+	}
+	printf("native packet engine: %i/%i rules crafted in-process, %i from "
+		"template cache (src=%s), remaining rules are sent via scapy.\n",
+		native, nel_nrules, cached, inet_ntoa(src));
+}
+
+/* can `announced_proto' be sent without scapy? */
+int pkt_is_native(u_int32_t announced_proto)
+{
+	return (pkt_rawfd >= 0
+	    && __atomic_load_n(&pkt_tmpl[announced_proto].native, __ATOMIC_RELAXED));
+}
+
+/* pause before the `try'th retry of a packet */
+static void pkt_backoff(int try)
+{
+	struct timespec ts = { 0, (PKT_BACKOFF_US * 1000L) << try };
+
+	nanosleep(&ts, NULL);
+}
+
+/* Send `len' bytes of `buf' over the raw socket, retrying after transient
+ * errors. Returns 0, or the errno of the last attempt. */
+static int pkt_sendto(const u_char *buf, int len)
+{
+	int try, err = 0;
+
+	for (try = 0; try < PKT_SEND_TRIES; try++) {
+		if (sendto(pkt_rawfd, buf, len, 0, (struct sockaddr *)&pkt_dst,
+		    sizeof(pkt_dst)) == len)
+			return 0;
+		err = errno;
+		if (PKT_ERR_PERSISTENT(err))
+			break;
+		if (err != EINTR && try + 1 < PKT_SEND_TRIES)
+			pkt_backoff(try);
+	}
+	return err;
+}
+
+/* Send one packet of `announced_proto' over the raw socket. Returns -1 if the
+ * packet must be sent via scapy instead. */
+int pkt_send_native(u_int32_t announced_proto)
+{
+	int err;
+
+	if (!pkt_is_native(announced_proto))
+		return -1;
+	/* the kernel copies the template, so NEL and COMM thread can send
+	 * from it concurrently */
+	if ((err = pkt_sendto(pkt_tmpl[announced_proto].buf,
+	    pkt_tmpl[announced_proto].len)) == 0)
+		return 0;
+	fprintf(stderr, "sendto(SOCK_RAW): %s\n", strerror(err));
+	/* only the thread that clears the flag reports it */
+	if (PKT_ERR_PERSISTENT(err)
+	    && __atomic_exchange_n(&pkt_tmpl[announced_proto].native, 0,
+	    __ATOMIC_RELAXED) == 1)
+		fprintf(stderr, "native sending of protocol %u failed, using "
+			"scapy for this protocol from now on.\n", announced_proto);
+	return -1;
+}
+
+/* the warden simulation's counterpart of pkt_send_native(): do what the
+ * kernel does for the sendto() of a template (copy the packet, compute its
+ * IP header checksum) without sending it, so that a blocked packet costs
+ * about as much as a sent one (as scapyw_pretend() for the worker) */
+static u_int16_t pkt_pretend_sum;
+
+void pkt_pretend_native(u_int32_t announced_proto)
+{
+	u_char buf[PKT_MAX_LEN];
+	int len = pkt_tmpl[announced_proto].len, hlen;
+
+	memcpy(buf, pkt_tmpl[announced_proto].buf, len);
+	hlen = (buf[0] & 0x0f) * 4;
+	__atomic_store_n(&pkt_pretend_sum, pkt_cksum(buf, min(hlen, len), 0),
+		__ATOMIC_RELAXED);
+}
+
+static int pkt_sendmmsg(struct mmsghdr *, int);
+
+/* Queue one packet of `announced_proto' for the next pkt_burst_flush().
+ * Returns -1 if the packet must be sent via scapy instead. */
+int pkt_burst_add(u_int32_t announced_proto)
+{
+	if (!pkt_is_native(announced_proto))
+		return -1;
+	if (pkt_burst_len == PKT_BURST_MAX) {
+		pkt_burst_sent += pkt_sendmmsg(pkt_burst_msg, pkt_burst_len);
+		pkt_burst_len = 0;
+	}
+	pkt_burst_iov[pkt_burst_len].iov_base = pkt_tmpl[announced_proto].buf;
+	pkt_burst_iov[pkt_burst_len].iov_len = pkt_tmpl[announced_proto].len;
+	bzero(&pkt_burst_msg[pkt_burst_len], sizeof(struct mmsghdr));
+	pkt_burst_msg[pkt_burst_len].msg_hdr.msg_name = &pkt_dst;
+	pkt_burst_msg[pkt_burst_len].msg_hdr.msg_namelen = sizeof(pkt_dst);
+	pkt_burst_msg[pkt_burst_len].msg_hdr.msg_iov = &pkt_burst_iov[pkt_burst_len];
+	pkt_burst_msg[pkt_burst_len].msg_hdr.msg_iovlen = 1;
+	pkt_burst_len++;
+	return 0;
+}
+
+/* send `n' messages with as few sendmmsg() calls as possible (usually
+ * one). A message the kernel refuses for good, or still refuses after
+ * PKT_SEND_TRIES tries with backoff, is dropped and counted in
+ * pkt_burst_dropped. Returns the number of packets sent. */
+static int pkt_sendmmsg(struct mmsghdr *msg, int n)
+{
+	int i = 0, sent = 0, dropped = 0, k, try = 0, err = 0;
+
+	while (i < n) {
+		if ((k = sendmmsg(pkt_rawfd, msg + i, n - i, 0)) > 0) {
+			i += k;
+			sent += k;
+			try = 0;
+			continue;
+		}
+		err = (k < 0 ? errno : EAGAIN);
+		if (err == EINTR)
+			continue;
+		if (!PKT_ERR_PERSISTENT(err) && try + 1 < PKT_SEND_TRIES) {
+			pkt_backoff(try++);
+			continue;
+		}
+		/* give up on the first message, go on with the others */
+		i++;
+		dropped++;
+		try = 0;
+	}
+	if (dropped > 0) {
+		fprintf(stderr, "sendmmsg(SOCK_RAW): %s, dropped %i of %i COMM "
+			"packets.\n", strerror(err), dropped, n);
+		__atomic_add_fetch(&pkt_burst_dropped, dropped, __ATOMIC_RELAXED);
+	}
+	return sent;
+}
+
+/* Send all queued packets. Returns the number of packets sent since the
+ * last call (incl. those of bursts pkt_burst_add() sent when full). */
+int pkt_burst_flush(void)
+{
+	int done = pkt_burst_sent + pkt_sendmmsg(pkt_burst_msg, pkt_burst_len);
+
+	pkt_burst_len = 0;
+	pkt_burst_sent = 0;
+	return done;
+}
+
+/* number of COMM packets dropped by all bursts so far */
+u_int64_t pkt_burst_drops(void)
+{
+	return __atomic_load_n(&pkt_burst_dropped, __ATOMIC_RELAXED);
+}
+
+/* Multi-flow sender (csflow.c): all flows share the templates, but every
+ * flow sends from its own source address. Copy the template of
+ * `announced_proto' into `buf' with source address `src' (rules that set
+ * their own source keep it). Returns the length, or -1 if the packet must
+ * be sent via scapy. */
+static int pkt_tmpl_copy_src(u_int32_t announced_proto, struct in_addr src,
+	u_char *buf)
+{
+	int len;
+
+	if (!pkt_is_native(announced_proto))
+		return -1;
+	len = pkt_tmpl[announced_proto].len;
+	memcpy(buf, pkt_tmpl[announced_proto].buf, len);
+	/* templates that cannot be retargeted are sent unchanged */
+	if (src.s_addr != pkt_src.s_addr)
+		(void) pkt_retarget(buf, len, pkt_src, src, pkt_dst.sin_addr);
+	return len;
+}
+
+/* pkt_send_native() from source address `src' */
+int pkt_send_native_src(u_int32_t announced_proto, struct in_addr src)
+{
+	u_char buf[PKT_MAX_LEN];
+	int len, err;
+
+	if ((len = pkt_tmpl_copy_src(announced_proto, src, buf)) < 0)
+		return -1;
+	if ((err = pkt_sendto(buf, len)) != 0) {
+		fprintf(stderr, "sendto(SOCK_RAW): %s\n", strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+/* pkt_burst_add() into the flow's burst `b', from source address `src' */
+int pkt_burst_add_src(pkt_burst_t *b, u_int32_t announced_proto,
+	struct in_addr src)
+{
+	int len;
+
+	if (!pkt_is_native(announced_proto))
+		return -1;
+	if (b->len == CS_FLOW_BURST) {
+		b->sent += pkt_sendmmsg(b->msg, b->len);
+		b->len = 0;
+	}
+	len = pkt_tmpl_copy_src(announced_proto, src, b->buf[b->len]);
+	b->iov[b->len].iov_base = b->buf[b->len];
+	b->iov[b->len].iov_len = len;
+	bzero(&b->msg[b->len], sizeof(struct mmsghdr));
+	b->msg[b->len].msg_hdr.msg_name = &pkt_dst;
+	b->msg[b->len].msg_hdr.msg_namelen = sizeof(pkt_dst);
+	b->msg[b->len].msg_hdr.msg_iov = &b->iov[b->len];
+	b->msg[b->len].msg_hdr.msg_iovlen = 1;
+	b->len++;
+	return 0;
+}
+
+/* pkt_burst_flush() of the flow's burst `b' */
+int pkt_burst_flush_src(pkt_burst_t *b)
+{
+	int done = b->sent + pkt_sendmmsg(b->msg, b->len);
+
+	b->len = 0;
+	b->sent = 0;
+	return done;
+}
@@ -0,0 +1,203 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+/* Probe scheduling: which protocols the NEL phase probes next. A policy
+ * fills a batch with distinct protocols. The verdicts of the CR are kept
+ * per protocol (nel_state_t.probe, NEL thread only) and lose their weight
+ * with the time constant `probe_decay', as a dynamic/adaptive warden may
+ * have reloaded its rules since. To add a policy, add a PROBE_POLICY_*
+ * value in nel.h and its name and function to probe_policies[]. */
+
+/* a uniformly distributed number in (0, 1) */
+static double probe_uniform(nel_state_t *st)
+{
+	return (rand_r(&st->seed) + 0.5) / ((double) RAND_MAX + 1.0);
+}
+
+/* a Gamma(k, 1) distributed number for k >= 1 (Marsaglia and Tsang, 2000) */
+static double probe_gamma(nel_state_t *st, double k)
+{
+	double d = k - 1.0 / 3.0, c = 1.0 / sqrt(9.0 * d), x, v, u;
+	
+	for (;;) {
+		/* a normal distributed x (Box-Muller) */
+		x = sqrt(-2.0 * log(probe_uniform(st)))
+			* cos(2.0 * M_PI * probe_uniform(st));
+		v = 1.0 + c * x;
+		if (v <= 0.0)
+			continue;
+		v = v * v * v;
+		u = probe_uniform(st);
+		if (log(u) < 0.5 * x * x + d - d * v + d * log(v))
+			return d * v;
+	}
+}
+
+/* the weight that the verdicts of `p' still have at `now' */
+static double probe_weight(nel_state_t *st, const nel_probe_stat_t *p, double now)
+{
+	if (st->cfg->probe_decay == 0 || p->last == 0.0)
+		return 1.0;
+	return exp(-(now - p->last) / st->cfg->probe_decay);
+}
+
+/* put the `n' protocols with the highest `score' into `protos' (min-heap
+ * of the best so far, i.e. O(N log n)) */
+static void probe_top(const double *score, u_int32_t *protos, int n)
+{
+	u_int32_t rule;
+	int i, c, len = 0;
+	
+	for (rule = 0; rule < nel_nrules; rule++) {
+		if (len < n) {
+			for (i = len++; i > 0 && score[rule] < score[protos[(i - 1) / 2]];
+			     i = (i - 1) / 2)
+				protos[i] = protos[(i - 1) / 2];
+			protos[i] = rule;
+			continue;
+		}
+		if (score[rule] <= score[protos[0]])
+			continue;
+		/* replace the worst one and sift it down */
+		for (i = 0; (c = 2 * i + 1) < n; i = c) {
+			if (c + 1 < n && score[protos[c + 1]] < score[protos[c]])
+				c++;
+			if (score[rule] <= score[protos[c]])
+				break;
+			protos[i] = protos[c];
+		}
+		protos[i] = rule;
+	}
+}
+
+/* PROBE_POLICY_RANDOM: `n' distinct protocols, uniformly at random */
+static void probe_random(nel_state_t *st, u_int32_t *protos, int n)
+{
+	int i, j;
+	
+	for (i = 0; i < n; i++) {
+		do {
+			protos[i] = rand_r(&st->seed) % nel_nrules;
+			for (j = 0; j < i && protos[j] != protos[i]; j++)
+				;
+		} while (j < i);
+	}
+}
+
+/* PROBE_POLICY_RR: the next `n' protocols */
+static void probe_rr(nel_state_t *st, u_int32_t *protos, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i++)
+		protos[i] = st->next_proto++ % nel_nrules;
+}
+
+/* PROBE_POLICY_STALE: the protocols without verdict, then the ones with
+ * the oldest verdicts; ties are broken randomly */
+static void probe_stale(nel_state_t *st, u_int32_t *protos, int n)
+{
+	double *score = st->score;
+	double now = st->now(st);
+	u_int32_t rule;
+	
+	for (rule = 0; rule < nel_nrules; rule++) {
+		score[rule] = (st->probe[rule].last == 0.0
+			? 1.0e9 : now - st->probe[rule].last)
+			+ probe_uniform(st) * 1.0e-3;
+	}
+	probe_top(score, protos, n);
+}
+
+/* PROBE_POLICY_THOMPSON: draw each protocol's chance to pass the warden
+ * from its Beta(1 + passed, 1 + blocked) posterior and probe the `n' most
+ * promising ones. Protocols without (recent) verdicts have a wide
+ * posterior and are drawn high often enough to be explored; protocols
+ * that passed are re-checked, so that a reload of the warden is noticed
+ * soon. */
+static void probe_thompson(nel_state_t *st, u_int32_t *protos, int n)
+{
+	double *score = st->score;
+	double now = st->now(st), w, a, b;
+	u_int32_t rule;
+	
+	for (rule = 0; rule < nel_nrules; rule++) {
+		w = probe_weight(st, &st->probe[rule], now);
+		a = probe_gamma(st, 1.0 + st->probe[rule].pass * w);
+		b = probe_gamma(st, 1.0 + st->probe[rule].fail * w);
+		score[rule] = a / (a + b);
+	}
+	probe_top(score, protos, n);
+}
+
+static const struct {
+	const char	*name;
+	void		(*select)(nel_state_t *, u_int32_t *, int);
+} probe_policies[PROBE_POLICIES] = {
+	[PROBE_POLICY_RANDOM]	= { "random",	probe_random },
+	[PROBE_POLICY_RR]	= { "rr",	probe_rr },
+	[PROBE_POLICY_STALE]	= { "stale",	probe_stale },
+	[PROBE_POLICY_THOMPSON]	= { "thompson",	probe_thompson }
+};
+
+/* the PROBE_POLICY_* value of the policy called `name', or -1 */
+int probe_policy_lookup(const char *name)
+{
+	int i;
+	
+	for (i = 0; i < PROBE_POLICIES; i++) {
+		if (strcmp(probe_policies[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+const char *probe_policy_name(u_int32_t policy)
+{
+	return (policy < PROBE_POLICIES ? probe_policies[policy].name : "?");
+}
+
+/* select the `n' distinct protocols of the next batch of probes */
+void probe_select(nel_state_t *st, u_int32_t *protos, int n)
+{
+	probe_policies[st->cfg->probe_policy].select(st, protos, n);
+}
+
+/* the CR's verdict for a probed protocol */
+void probe_verdict(nel_state_t *st, u_int32_t announced_proto, int passed)
+{
+	nel_probe_stat_t *p = &st->probe[announced_proto];
+	double now = st->now(st), w = probe_weight(st, p, now);
+	
+	/* all probe packets passed or none did: a verdict counts as one
+	 * observation per probe packet */
+	p->pass = p->pass * w + (passed ? st->cfg->nel_pkts_p_prot : 0);
+	p->fail = p->fail * w + (passed ? 0 : st->cfg->nel_pkts_p_prot);
+	p->last = now;
+}
@@ -0,0 +1,250 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+
+/* Rulesets: the rules the CS probes and the CR captures. By default these
+ * are the rules built into cs.c (`ruleset'); `-r file' loads a ruleset
+ * at run-time instead. A ruleset file has one rule per line with four
+ * fields separated by TABs; empty lines and lines starting with `#' are
+ * ignored:
+ *
+ *   id <TAB> name <TAB> scapy command (builds packet `a') <TAB> pcap filter
+ *
+ * The file is read into one arena and split in place, i.e. the rules point
+ * into the arena and loading costs one read() and one pass over the file.
+ * Rule ids are unique and looked up through a hash index. Both peers must
+ * use the same ruleset (announcements and results carry the rule id);
+ * the CS sends the number of rules and their digest with its configuration
+ * and the CR refuses senders with another ruleset. */
+
+extern char *ruleset[][3];
+
+nel_rule_t *nel_rules = NULL;
+u_int32_t nel_nrules = 0;
+u_int64_t nel_rules_digest = 0;
+
+static char *ruleset_arena = NULL;
+static int32_t *ruleset_index = NULL;	/* id -> rule, -1: empty */
+static u_int32_t ruleset_index_mask = 0;
+
+#define RULESET_FNV_OFFSET	0xcbf29ce484222325ULL
+#define RULESET_FNV_PRIME	0x100000001b3ULL
+
+static u_int64_t ruleset_fnv(u_int64_t h, const void *data, size_t len)
+{
+	const u_char *p = data;
+	
+	while (len-- > 0) {
+		h ^= *p++;
+		h *= RULESET_FNV_PRIME;
+	}
+	return h;
+}
+
+/* FNV-1a over the ids and the fields (incl. their terminating NULs) of all
+ * rules in their order */
+static u_int64_t ruleset_digest(void)
+{
+	u_int64_t h = RULESET_FNV_OFFSET;
+	u_int32_t i, id;
+	
+	for (i = 0; i < nel_nrules; i++) {
+		id = htonl(nel_rules[i].id);
+		h = ruleset_fnv(h, &id, sizeof(id));
+		h = ruleset_fnv(h, nel_rules[i].name, strlen(nel_rules[i].name) + 1);
+		h = ruleset_fnv(h, nel_rules[i].tmpl, strlen(nel_rules[i].tmpl) + 1);
+		h = ruleset_fnv(h, nel_rules[i].filter, strlen(nel_rules[i].filter) + 1);
+	}
+	return h;
+}
+
+static u_int32_t ruleset_hash(u_int32_t id)
+{
+	/* Knuth's multiplicative hash */
+	return (id * 2654435761U) & ruleset_index_mask;
+}
+
+/* build the hash index; returns the index of a rule whose id is already
+ * used by an earlier rule, or -1 */
+static int ruleset_build_index(void)
+{
+	u_int32_t size = 16, i, h;
+	
+	while (size < 2 * nel_nrules)
+		size <<= 1;
+	if ((ruleset_index = malloc(size * sizeof(int32_t))) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (malloc())\n");
+		exit(1);
+	}
+	memset(ruleset_index, 0xff, size * sizeof(int32_t));
+	ruleset_index_mask = size - 1;
+	for (i = 0; i < nel_nrules; i++) {
+		for (h = ruleset_hash(nel_rules[i].id); ruleset_index[h] != -1;
+		     h = (h + 1) & ruleset_index_mask) {
+			if (nel_rules[ruleset_index[h]].id == nel_rules[i].id)
+				return (int) i;
+		}
+		ruleset_index[h] = (int32_t) i;
+	}
+	return -1;
+}
+
+/* the index of the rule with id `id', or -1 */
+int ruleset_lookup(u_int32_t id)
+{
+	u_int32_t h;
+	
+	for (h = ruleset_hash(id); ruleset_index[h] != -1;
+	     h = (h + 1) & ruleset_index_mask) {
+		if (nel_rules[ruleset_index[h]].id == id)
+			return ruleset_index[h];
+	}
+	return -1;
+}
+
+/* the rules built into cs.c; their ids are their positions (1..) */
+static void ruleset_builtin(void)
+{
+	u_int32_t i;
+	
+	/* `ruleset' ends with a NULL entry */
+	for (i = 0; ruleset[i][0] != NULL; i++)
+		;
+	nel_nrules = i;
+	if ((nel_rules = calloc(nel_nrules, sizeof(nel_rule_t))) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (calloc())\n");
+		exit(1);
+	}
+	for (i = 0; i < nel_nrules; i++) {
+		nel_rules[i].id = i + 1;
+		nel_rules[i].name = ruleset[i][0];
+		nel_rules[i].tmpl = ruleset[i][1];
+		nel_rules[i].filter = ruleset[i][2];
+	}
+}
+
+static void ruleset_load(const char *path)
+{
+	struct stat sb;
+	char *p, *end, *line, *field[4], *idend;
+	u_int32_t lineno = 0, max = 1;
+	unsigned long id;
+	ssize_t n;
+	int fd, f;
+	
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+		perror(path);
+		exit(1);
+	}
+	if ((ruleset_arena = malloc(sb.st_size + 1)) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (malloc())\n");
+		exit(1);
+	}
+	if ((n = read(fd, ruleset_arena, sb.st_size)) != sb.st_size) {
+		perror(path);
+		exit(1);
+	}
+	close(fd);
+	end = ruleset_arena + n;
+	*end = '\0';
+	
+	/* upper bound of the number of rules */
+	for (p = ruleset_arena; (p = memchr(p, '\n', end - p)) != NULL; p++)
+		max++;
+	if ((nel_rules = calloc(max, sizeof(nel_rule_t))) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (calloc())\n");
+		exit(1);
+	}
+	
+	for (p = ruleset_arena; p < end; ) {
+		line = p;
+		lineno++;
+		if ((p = memchr(line, '\n', end - line)) == NULL)
+			p = end;
+		*p = '\0';
+		if (p > line && p[-1] == '\r')	/* DOS line end */
+			p[-1] = '\0';
+		p++;
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		/* split the line into its fields in place */
+		field[0] = line;
+		for (f = 1; f < 4; f++) {
+			if ((field[f] = strchr(field[f - 1], '\t')) == NULL)
+				break;
+			*field[f]++ = '\0';
+		}
+		if (f < 4 || strchr(field[3], '\t') != NULL) {
+			fprintf(stderr, "%s, line %u: four TAB-separated fields "
+				"expected.\n", path, lineno);
+			exit(1);
+		}
+		errno = 0;
+		id = strtoul(field[0], &idend, 10);
+		if (errno != 0 || *field[0] == '\0' || *idend != '\0'
+		    || id > UINT32_MAX) {
+			fprintf(stderr, "%s, line %u: invalid rule id `%s'.\n",
+				path, lineno, field[0]);
+			exit(1);
+		}
+		nel_rules[nel_nrules].id = (u_int32_t) id;
+		nel_rules[nel_nrules].name = field[1];
+		nel_rules[nel_nrules].tmpl = field[2];
+		nel_rules[nel_nrules].filter = field[3];
+		nel_nrules++;
+	}
+	if (nel_nrules == 0) {
+		fprintf(stderr, "%s: no rules.\n", path);
+		exit(1);
+	}
+}
+
+/* load the ruleset file `path', or use the built-in rules if it is NULL */
+void ruleset_init(const char *path)
+{
+	struct timespec t0, t1;
+	int dup;
+	
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (path == NULL)
+		ruleset_builtin();
+	else
+		ruleset_load(path);
+	if ((dup = ruleset_build_index()) >= 0) {
+		fprintf(stderr, "%s: rule id %u is used twice.\n",
+			path ? path : "built-in ruleset", nel_rules[dup].id);
+		exit(1);
+	}
+	nel_rules_digest = ruleset_digest();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	printf("ruleset: %u rules (%s), digest %016" PRIx64 ", loaded in "
+		"%.3f ms.\n", nel_nrules, path ? path : "built-in",
+		nel_rules_digest, (t1.tv_sec - t0.tv_sec) * 1.0e3
+		+ (t1.tv_nsec - t0.tv_nsec) / 1.0e6);
+}
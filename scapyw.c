@@ -0,0 +1,159 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+
+/* Persistent scapy worker: instead of running `echo ... | scapy' for every
+ * packet, one python process with scapy loaded is started on first use. It
+ * receives one command per line over a pipe and acknowledges each of them:
+ *
+ *   CS -> worker:  S <proto> <count> <scapy-cmd>   send <count> packets
+ *                  P <proto> <count> <scapy-cmd>   pretend sending (see below)
+ *                  Q                               quit
+ *   worker -> CS:  OK <proto>
+ *                  ERR <proto> <message>
+ *
+ * The worker builds the packet of a protocol once and re-uses it. It keeps
+ * an EWMA of the time needed to send one packet; `P' builds the packet but
+ * sleeps for that time instead of sending it, so that the warden simulation
+ * consumes the same amount of time as actual sending. */
+
+static const char *scapyw_script =
+	"import sys, time\n"
+	"from scapy.all import *\n"
+	"conf.verb = 0\n"
+	"dst = sys.argv[1]\n"
+	"pkts = {}\n"
+	"sock = conf.L3socket()\n"
+	"ewma = 0.0\n"
+	"for line in sys.stdin:\n"
+	"    op, _, rest = line.rstrip('\\n').partition(' ')\n"
+	"    if op == 'Q':\n"
+	"        break\n"
+	"    proto, cnt, cmd = rest.split(' ', 2)\n"
+	"    t = time.time()\n"
+	"    try:\n"
+	"        if proto not in pkts:\n"
+	"            ns = {}\n"
+	"            exec(cmd, globals(), ns)\n"
+	"            ns['a'].dst = dst\n"
+	"            pkts[proto] = ns['a']\n"
+	"        a = pkts[proto]\n"
+	"        for i in range(int(cnt)):\n"
+	"            if op == 'S':\n"
+	"                sock.send(a)\n"
+	"            else:\n"
+	"                bytes(a)\n"
+	"        d = time.time() - t\n"
+	"        if op == 'S':\n"
+	"            d /= int(cnt)\n"
+	"            ewma = d if ewma == 0.0 else 0.875 * ewma + 0.125 * d\n"
+	"        elif ewma * int(cnt) > d:\n"
+	"            time.sleep(ewma * int(cnt) - d)\n"
+	"        print('OK ' + proto, flush=True)\n"
+	"    except Exception as e:\n"
+	"        print('ERR ' + proto + ' ' + repr(e).replace('\\n', ' '), flush=True)\n";
+
+static pid_t scapyw_pid = -1;
+static FILE *scapyw_to = NULL;	/* commands to the worker */
+static FILE *scapyw_from = NULL;	/* acknowledgements from the worker */
+static pthread_mutex_t scapyw_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void scapyw_start(void)
+{
+	extern char *warden_link_ip;
+	int to[2], from[2], logfd;
+
+	if (pipe(to) != 0 || pipe(from) != 0) {
+		perror("pipe(scapy worker)");
+		exit(1);
+	}
+	if ((scapyw_pid = fork()) < 0) {
+		perror("fork(scapy worker)");
+		exit(1);
+	}
+	if (scapyw_pid == 0) {
+		dup2(to[0], STDIN_FILENO);
+		dup2(from[1], STDOUT_FILENO);
+		if ((logfd = open("scapy.log", O_WRONLY|O_CREAT|O_TRUNC, 0644)) >= 0)
+			dup2(logfd, STDERR_FILENO);
+		close(to[0]); close(to[1]);
+		close(from[0]); close(from[1]);
+		execlp(SCAPY_PYTHON, SCAPY_PYTHON, "-c", scapyw_script,
+			warden_link_ip, (char *)NULL);
+		perror("execlp(" SCAPY_PYTHON ")");
+		_exit(1);
+	}
+	close(to[0]);
+	close(from[1]);
+	/* a dying worker must not kill us via SIGPIPE; we detect it via the
+	 * missing acknowledgement instead */
+	signal(SIGPIPE, SIG_IGN);
+	if ((scapyw_to = fdopen(to[1], "w")) == NULL
+	    || (scapyw_from = fdopen(from[0], "r")) == NULL) {
+		perror("fdopen(scapy worker)");
+		exit(1);
+	}
+	printf("started scapy worker (pid %i)\n", (int)scapyw_pid);
+}
+
+/* send one command to the worker and wait for its acknowledgement */
+static void scapyw_cmd(char op, u_int32_t announced_proto, int cnt)
+{
+	char line[1024];
+
+	pthread_mutex_lock(&scapyw_mtx);
+	if (scapyw_pid < 0)
+		scapyw_start();
+	fprintf(scapyw_to, "%c %u %i %s\n", op, announced_proto, cnt,
+		nel_rules[announced_proto].tmpl);
+	fflush(scapyw_to);
+	if (fgets(line, sizeof(line), scapyw_from) == NULL) {
+		fprintf(stderr, "Fatal error: scapy worker terminated. Please "
+			"see scapy.log for details. Exiting.\n");
+		exit(1);
+	}
+	pthread_mutex_unlock(&scapyw_mtx);
+	if (strncmp(line, "OK ", 3) != 0) {
+		fprintf(stderr, "Fatal error: scapy worker failed for '%s': %s"
+			"Please see scapy.log for details (maybe the wrong "
+			"scapy-cmd was provided?). Exiting.\n",
+			nel_rules[announced_proto].tmpl, line);
+		exit(1);
+	}
+}
+
+void scapyw_send(u_int32_t announced_proto)
+{
+	scapyw_cmd('S', announced_proto, 1);
+}
+
+void scapyw_pretend(u_int32_t announced_proto)
+{
+	scapyw_cmd('P', announced_proto, 1);
+}
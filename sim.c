@@ -0,0 +1,435 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+#include "nel.h"
+
+/* Discrete-event simulation of a complete NEL run: the NEL, COMM and rule
+ * reloader threads of the sender as well as the receiver are modelled as
+ * processes that schedule events on a virtual clock. The decisions are made
+ * by the same functions the real sender uses (cs_NEL_send_probe(),
+ * cs_COMM_send_pkt(), cs_reload_rules(), ...), only time and sending are
+ * replaced by nel_state_t hooks. Waiting times (the idle COMM thread, the
+ * receiver's nel_wait alarm, reload_interval) thus cost nothing. */
+
+/* event types */
+#define EV_NEL_ANNOUNCE		0x01 /* CS announces the next probe */
+#define EV_NEL_PROBE		0x02 /* CS sends one probe packet */
+#define EV_NEL_VERDICT		0x03 /* CR's probe time-slot is over */
+#define EV_NEL_FEEDBACK		0x04 /* CS receives the CR's feedback */
+#define EV_COMM			0x05 /* CS COMM thread: next step */
+#define EV_RELOAD		0x06 /* CS rule reloader: next check */
+
+/* the virtual clock starts at a unix-time-like value, as ruleset_checked
+ * uses 0 for `not triggered' */
+#define SIM_EPOCH		1.0e9
+
+typedef struct {
+	double		t;
+	u_int64_t	seq;	/* FIFO order of simultaneous events */
+	int		type;
+} sim_ev_t;
+
+typedef struct {
+	nel_state_t	st;
+	double		clock;
+	double		cost;	/* virtual time consumed by the current event */
+	sim_ev_t	*heap;
+	int		nheap;
+	int		maxheap;
+	u_int64_t	seq;
+	u_int64_t	nevents;
+	/* CS: NEL thread */
+	u_int32_t	*nel_protos;	/* current batch */
+	int		nel_batch;
+	int		nel_probe;	/* next probe packet of the batch */
+	int		nel_pending;	/* results not received yet */
+	int		nel_collecting;	/* CS blocks in recv() for the results */
+	/* CS: COMM thread */
+	int		comm_proto;
+	int		comm_pkt;
+	int		comm_sent_in_pass;
+	int		comm_idle;	/* waits for nel_state_t.nb_found */
+	int		comm_pkts_sent;
+	/* CS: rule reloader */
+	time_t		reload_last;
+	/* CR: NEL handler + measurement */
+	int		measuring;
+	double		t_start;
+	int		recv_cnt;	/* cr_session_t.recvd */
+	double		slot_t0;	/* the batch's protocols are armed at once */
+	int		late;		/* probes that arrived after a timeout */
+	/* per rule: */
+	int		*native;	/* CS: crafted by the native engine */
+	int		*slot_open;
+	double		*slot_end;
+	u_int32_t	*slot_pos;	/* see cr.c: cr_probe_t */
+	int		*slot_sample;
+	int		*slot_late;
+	int		*test_cnt;	/* test_traffic_pkt_cnt */
+	u_int32_t	*slot_result;
+	int		*slot_unread;	/* result not read by CS */
+	nel_rtt_t	rtt[NEL_ENGINES];	/* CR_NEL_ADAPTIVE_WAIT */
+	int		done;		/* 1: completed, -1: failed */
+} sim_t;
+
+static void sim_schedule(sim_t *sim, double t, int type)
+{
+	sim_ev_t ev;
+	int i, parent;
+
+	if (sim->nheap == sim->maxheap) {
+		sim->maxheap = (sim->maxheap ? 2 * sim->maxheap : 16);
+		sim->heap = realloc(sim->heap, sim->maxheap * sizeof(sim_ev_t));
+		if (!sim->heap) {
+			fprintf(stderr, "ERR: memory alloc (realloc())\n");
+			exit(1);
+		}
+	}
+	ev.t = t;
+	ev.seq = sim->seq++;
+	ev.type = type;
+	/* sift up */
+	for (i = sim->nheap++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (sim->heap[parent].t < ev.t
+		    || (sim->heap[parent].t == ev.t && sim->heap[parent].seq < ev.seq))
+			break;
+		sim->heap[i] = sim->heap[parent];
+	}
+	sim->heap[i] = ev;
+}
+
+static sim_ev_t sim_next(sim_t *sim)
+{
+	sim_ev_t top = sim->heap[0], last;
+	int i, child;
+
+	last = sim->heap[--sim->nheap];
+	/* sift down */
+	for (i = 0; (child = 2 * i + 1) < sim->nheap; i = child) {
+		if (child + 1 < sim->nheap
+		    && (sim->heap[child + 1].t < sim->heap[child].t
+		        || (sim->heap[child + 1].t == sim->heap[child].t
+		            && sim->heap[child + 1].seq < sim->heap[child].seq)))
+			child++;
+		if (last.t < sim->heap[child].t
+		    || (last.t == sim->heap[child].t && last.seq < sim->heap[child].seq))
+			break;
+		sim->heap[i] = sim->heap[child];
+	}
+	if (sim->nheap > 0)
+		sim->heap[i] = last;
+	return top;
+}
+
+/* CS: received the result for `proto' */
+static void sim_feedback(sim_t *sim, u_int32_t proto)
+{
+	cs_NEL_feedback(&sim->st, proto, sim->slot_result[proto]);
+	if (--sim->nel_pending == 0) {
+		/* all results are in: announce the next batch */
+		sim->nel_collecting = 0;
+		sim_schedule(sim, sim->clock + sim->cost, EV_NEL_ANNOUNCE);
+	}
+}
+
+/* CR: the time-slot of the probe of `proto' is over */
+static void sim_verdict(sim_t *sim, u_int32_t proto)
+{
+	sim->slot_open[proto] = 0;
+	cr_NEL_account(sim->st.cfg, sim->test_cnt[proto], &sim->recv_cnt);
+	sim->slot_result[proto] = (sim->test_cnt[proto] ? RESULT_RECVD : RESULT_TIMEOUT);
+	/* the CS reads results only after it sent all probes of the batch */
+	if (sim->nel_collecting)
+		sim_feedback(sim, proto);
+	else
+		sim->slot_unread[proto] = 1;
+}
+
+/* nel_state_t hooks: virtual time and simulated transmission */
+static double sim_now(nel_state_t *st)
+{
+	sim_t *sim = st->priv;
+
+	return sim->clock + sim->cost;
+}
+
+/* virtual time to send one packet of `proto' */
+static double sim_tx_time(sim_t *sim, u_int32_t proto)
+{
+	return (sim->native[proto] ? SIM_PKT_TX_TIME : SIM_SCAPY_TX_TIME);
+}
+
+static void sim_send(nel_state_t *st, u_int32_t announced_proto, int phase)
+{
+	sim_t *sim = st->priv;
+
+	sim->cost += sim_tx_time(sim, announced_proto);
+	/* the probe's time-slot was over before its first packet arrived:
+	 * the CR reported a protocol the warden did not block as blocked */
+	if (phase == NEL_PHASE_NEL && !sim->slot_open[announced_proto]
+	    && sim->slot_result[announced_proto] == RESULT_TIMEOUT
+	    && !sim->slot_late[announced_proto]) {
+		sim->slot_late[announced_proto] = 1;
+		sim->late++;
+	}
+	/* the warden was simulated by the sender, so the packet arrives;
+	 * the CR's capture only counts after the first announcement */
+	if (sim->slot_open[announced_proto]
+	    && ++sim->test_cnt[announced_proto] >= st->cfg->nel_pkts_p_prot
+	    && st->cfg->adaptive_wait) {
+		/* CR: early completion */
+		sim->slot_end[announced_proto] = sim->clock + sim->cost;
+		if (sim->slot_sample[announced_proto])
+			cr_rtt_sample(sim->rtt, sim->slot_pos[announced_proto],
+				sim->slot_end[announced_proto] - sim->slot_t0);
+		sim_verdict(sim, announced_proto);
+	}
+	if (!sim->measuring)
+		return;
+	if (++sim->recv_cnt >= st->cfg->req_pkts && sim->done == 0)
+		sim->done = 1;
+}
+
+static void sim_pretend(nel_state_t *st, u_int32_t announced_proto)
+{
+	sim_t *sim = st->priv;
+
+	sim->cost += sim_tx_time(sim, announced_proto);
+}
+
+static int sim_native(nel_state_t *st, u_int32_t announced_proto)
+{
+	sim_t *sim = st->priv;
+
+	return sim->native[announced_proto];
+}
+
+/* the COMM thread waits until the NEL thread finds a protocol */
+static void sim_nb_found(nel_state_t *st)
+{
+	sim_t *sim = st->priv;
+
+	if (sim->comm_idle) {
+		sim->comm_idle = 0;
+		sim_schedule(sim, sim->clock, EV_COMM);
+	}
+}
+
+static void sim_handle(sim_t *sim, sim_ev_t *ev)
+{
+	nel_state_t *st = &sim->st;
+	double timeout;
+	u_int32_t p;
+	int i;
+
+	switch (ev->type) {
+	case EV_NEL_ANNOUNCE:
+		sim->nel_batch = (int) st->cfg->nel_batch;
+		probe_select(st, sim->nel_protos, sim->nel_batch);
+		/* CR: start measuring + open the probe time-slots */
+		if (!sim->measuring) {
+			sim->measuring = 1;
+			sim->t_start = sim->clock;
+		}
+		sim->slot_t0 = sim->clock;
+		for (i = 0; i < sim->nel_batch; i++) {
+			p = sim->nel_protos[i];
+			sim->slot_pos[p] = cs_NEL_announce_pos(st, sim->nel_protos, i);
+			timeout = cr_rtt_timeout(sim->rtt, sim->slot_pos[p], st->cfg);
+			sim->slot_open[p] = 1;
+			sim->slot_end[p] = sim->clock + timeout;
+			sim->slot_sample[p] = !nel_bit_test(&st->P_nb, p);
+			sim->slot_late[p] = 0;
+			sim->test_cnt[p] = 0;
+			sim->slot_unread[p] = 0;
+			sim_schedule(sim, sim->clock + timeout, EV_NEL_VERDICT);
+		}
+		/* CS: send the probes once the CR's `armed' messages arrived */
+		sim->nel_probe = 0;
+		sim->nel_pending = sim->nel_batch;
+		sim_schedule(sim, sim->clock + SIM_FEEDBACK_RTT, EV_NEL_PROBE);
+		break;
+	case EV_NEL_PROBE:
+		cs_NEL_send_probe(st, sim->nel_protos[sim->nel_probe / st->cfg->nel_pkts_p_prot]);
+		if (++sim->nel_probe < sim->nel_batch * (int) st->cfg->nel_pkts_p_prot)
+			sim_schedule(sim, sim->clock + sim->cost, EV_NEL_PROBE);
+		else
+			sim_schedule(sim, sim->clock + sim->cost, EV_NEL_FEEDBACK);
+		break;
+	case EV_NEL_VERDICT:
+		/* time-slots that completed early are already closed; the
+		 * timer of an earlier batch does not match later slots */
+		for (i = 0; i < sim->nel_batch; i++) {
+			p = sim->nel_protos[i];
+			if (sim->slot_open[p] && sim->slot_end[p] <= sim->clock)
+				sim_verdict(sim, p);
+		}
+		break;
+	case EV_NEL_FEEDBACK:
+		/* CS blocks in recv() until all results of the batch arrived;
+		 * first read those that are already there */
+		sim->nel_collecting = 1;
+		for (i = 0; i < sim->nel_batch && sim->nel_collecting; i++) {
+			p = sim->nel_protos[i];
+			if (sim->slot_unread[p]) {
+				sim->slot_unread[p] = 0;
+				sim_feedback(sim, p);
+			}
+		}
+		break;
+	case EV_COMM:
+		/* same iteration as cs_COMM_sender(), one packet per event */
+		if (sim->comm_pkt == 0) {
+			sim->comm_proto = nel_bits_next(&st->P_nb, sim->comm_proto);
+			if (sim->comm_proto < 0)
+				sim->comm_proto = nel_nrules;
+		}
+		if (sim->comm_proto == nel_nrules) {
+			sim->comm_proto = 0;
+			/* no non-blocked protocol found: wait for the NEL thread */
+			if (sim->comm_sent_in_pass || nel_bits_count(&st->P_nb) > 0)
+				sim_schedule(sim, sim->clock, EV_COMM);
+			else
+				sim->comm_idle = 1;
+			sim->comm_sent_in_pass = 0;
+			break;
+		}
+		cs_COMM_send_pkt(st, sim->comm_proto);
+		if (++sim->comm_pkt == st->cfg->comm_pkts_p_prot) {
+			sim->comm_pkt = 0;
+			sim->comm_proto++;
+			sim->comm_sent_in_pass = 1;
+			sim->comm_pkts_sent += st->cfg->comm_pkts_p_prot;
+			if (sim->comm_pkts_sent >= st->cfg->comm_pkts) {
+				/* the sender exits after comm_pkts */
+				if (sim->done == 0)
+					sim->done = -1;
+				break;
+			}
+		}
+		sim_schedule(sim, sim->clock + sim->cost, EV_COMM);
+		break;
+	case EV_RELOAD:
+		/* same (second-granular) check as cs_RuleReloader() */
+		if ((sim->reload_last + sim->st.cfg->reload_interval) < (time_t) sim->clock) {
+			sim->reload_last = (time_t) sim->clock;
+			cs_reload_rules(st);
+		}
+		sim_schedule(sim, sim->clock + 0.2, EV_RELOAD);
+		break;
+	}
+}
+
+/* Run one simulation of the warden configuration `cfg'. Returns 0 and the
+ * simulated time until the CR received req_pkts packets in *result, or -1
+ * if the run did not complete. `*late' (if not NULL) is set to the number
+ * of probes whose packets arrived only after the CR's time-slot was over. */
+int simulate(const nel_cfg_t *cfg, unsigned int seed, int verbose, double *result,
+	int *late)
+{
+	sim_t sim;
+	sim_ev_t ev;
+#ifdef USE_NATIVE_PKT_ENGINE
+	u_char pkt[PKT_MAX_LEN];
+	struct in_addr any = { 0 };
+	int i;
+#endif
+
+	bzero(&sim, sizeof(sim));
+	sim.clock = SIM_EPOCH;
+	sim.st.now = sim_now;
+	sim.st.send = sim_send;
+	sim.st.pretend = sim_pretend;
+	sim.st.native = sim_native;
+	sim.st.nb_found = sim_nb_found;
+	sim.st.priv = &sim;
+	sim.st.seed = seed;
+	sim.st.verbose = verbose;
+	sim.st.cfg = cfg;
+	cs_state_alloc(&sim.st);
+	cs_state_init(&sim.st);
+	sim.nel_protos = nel_calloc(nel_nrules, sizeof(u_int32_t));
+	sim.native = nel_calloc(nel_nrules, sizeof(int));
+	sim.slot_open = nel_calloc(nel_nrules, sizeof(int));
+	sim.slot_end = nel_calloc(nel_nrules, sizeof(double));
+	sim.slot_pos = nel_calloc(nel_nrules, sizeof(u_int32_t));
+	sim.slot_sample = nel_calloc(nel_nrules, sizeof(int));
+	sim.slot_late = nel_calloc(nel_nrules, sizeof(int));
+	sim.test_cnt = nel_calloc(nel_nrules, sizeof(int));
+	sim.slot_result = nel_calloc(nel_nrules, sizeof(u_int32_t));
+	sim.slot_unread = nel_calloc(nel_nrules, sizeof(int));
+#ifdef USE_NATIVE_PKT_ENGINE
+	/* the rules the native engine crafts (as pkt_engine_init() does);
+	 * the others take the time of a scapy run */
+	for (i = 0; i < nel_nrules; i++)
+		sim.native[i] = (pkt_build(nel_rules[i].tmpl, pkt, sizeof(pkt),
+			any, any) > 0);
+#endif
+
+	/* the three sender threads start at the same time */
+	sim_schedule(&sim, sim.clock, EV_NEL_ANNOUNCE);
+	sim_schedule(&sim, sim.clock, EV_COMM);
+	if (cfg->warden_mode == WARDEN_MODE_DYN_WARDEN
+	    || cfg->warden_mode == WARDEN_MODE_ADP_WARDEN)
+		sim_schedule(&sim, sim.clock, EV_RELOAD);
+
+	while (sim.done == 0 && sim.nheap > 0) {
+		ev = sim_next(&sim);
+		if (ev.t - SIM_EPOCH > SIM_MAX_TIME)
+			break;
+		sim.clock = ev.t;
+		sim.cost = 0;
+		sim.nevents++;
+		sim_handle(&sim, &ev);
+	}
+	free(sim.heap);
+	free(sim.nel_protos);
+	free(sim.native);
+	free(sim.slot_open);
+	free(sim.slot_end);
+	free(sim.slot_pos);
+	free(sim.slot_sample);
+	free(sim.slot_late);
+	free(sim.test_cnt);
+	free(sim.slot_result);
+	free(sim.slot_unread);
+	cs_state_free(&sim.st);
+
+	if (verbose) {
+		fprintf(stderr, "simulated %" PRIu64 " events, %.3f virtual seconds, "
+			"%d probes arrived after their time-slot\n",
+			sim.nevents, sim.clock - SIM_EPOCH, sim.late);
+	}
+	if (late != NULL)
+		*late = sim.late;
+	if (sim.done != 1)
+		return -1;
+	*result = sim.clock + sim.cost - sim.t_start;
+	return 0;
+}
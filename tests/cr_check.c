@@ -0,0 +1,370 @@
+/* Simple Implementation of a Network Environment Learning (NEL) Phase
+ * with a Feedback Channel.
+ *
+ * Keywords: Covert Channels, Network Steganography
+ *
+ * Copyright (C) 2017-2021 Steffen Wendzel, steffen (at) wendzel (dot) de
+ *					https://www.wendzel.de
+ *
+ * Please have a look at our academic publications on the NEL phase
+ * (see ./documentation/).
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Cf. `LICENSE' file.
+ *
+ */
+
+/* Randomized checks of the CR's packet classification, run by `make check'
+ * (tests/cr_check [ruleset-file|- [seed]], `-': the built-in ruleset):
+ *
+ * filter: the factored combined filter of cr_filter_build() and the flat OR
+ *   of the rules' filters are compiled with pcap_compile() and must give
+ *   the same verdict on every generated packet, for the whole ruleset and
+ *   for random subsets of it.
+ *
+ * ebpf: the programs of cr_ebpf.c (the filters translated by
+ *   cr_translate(), run as a chain of tail-called stages) are run on the
+ *   generated packets with BPF_PROG_TEST_RUN; they must count a packet
+ *   for exactly the rules whose filters accept it by pcap_offline_filter().
+ *   Skipped if the kernel refuses the programs (e.g. without CAP_BPF).
+ *
+ * adaptive wait: simulations (sim.c) of a dynamic warden, whose batches mix
+ *   natively sent and scapy-sent probes; the CR's adaptive time-slots must
+ *   not be over before the probe packets of a non-blocked protocol arrive.
+ *
+ * The generated packets are Ethernet/IPv4 packets whose bytes are random
+ * or taken from the numbers in the rules' filters, so that the packets
+ * pass the filters' tests often enough. They have CR_SNAPLEN bytes: on a
+ * packet that ends before a test's offset, a BPF program stops at the
+ * first such test, so the verdict would depend on the order of the tests. */
+
+#include "../nel.h"
+
+char *net_if = NULL;		/* see nel.c */
+char *warden_link_ip = NULL;
+
+#define CHECK_ROUNDS		50	/* rule subsets */
+#define CHECK_PKTS		20000	/* packets per subset */
+#define CHECK_MAX_VALS		1024
+#define CHECK_SIMS		20	/* simulations */
+
+static u_int32_t check_val[CHECK_MAX_VALS];	/* numbers of the filters */
+static int check_nvals = 0;
+static int check_failed = 0;
+
+/* collect the numbers in the rules' filters (ports, offsets, values) */
+static void check_values(void)
+{
+	const char *f, *p;
+	char *end;
+	int i;
+	
+	for (i = 0; i < nel_nrules; i++) {
+		f = nel_rules[i].filter;
+		for (p = f; *p != '\0'; p++) {
+			if (!isdigit((unsigned char) *p)
+			    || (p > f && (isalnum((unsigned char) p[-1]) || p[-1] == '.')))
+				continue;
+			if (check_nvals < CHECK_MAX_VALS)
+				check_val[check_nvals++] = strtoul(p, &end, 0);
+			else
+				strtoul(p, &end, 0);
+			p = end - 1;
+		}
+	}
+}
+
+/* a random 16 bit value: random, or one of the filters' numbers */
+static u_int16_t check_u16(void)
+{
+	if (check_nvals == 0 || random() % 2)
+		return random();
+	return check_val[random() % check_nvals];
+}
+
+/* a generated packet of CR_SNAPLEN bytes */
+static void check_packet(u_char *pkt)
+{
+	u_int32_t w;
+	u_int16_t v;
+	int i, ihl;
+	
+	for (i = 0; i < CR_SNAPLEN; i++) {
+		v = check_u16();
+		pkt[i] = (random() % 2 ? v : v >> 8);
+	}
+	/* 16 and 32 bit fields (ports, ids, sequence numbers, ...) */
+	for (i = 0; i + 1 < CR_SNAPLEN; i += 2) {
+		if (random() % 4 == 0) {
+			v = check_u16();
+			pkt[i] = v >> 8;
+			pkt[i + 1] = v;
+		}
+	}
+	for (i = 0; i + 3 < CR_SNAPLEN && check_nvals > 0; i += 2) {
+		if (random() % 16 == 0) {
+			w = check_val[random() % check_nvals];
+			pkt[i] = w >> 24;
+			pkt[i + 1] = w >> 16;
+			pkt[i + 2] = w >> 8;
+			pkt[i + 3] = w;
+		}
+	}
+	/* mostly IPv4 with a plain header, fragment offset 0 */
+	if (random() % 16) {
+		pkt[12] = 0x08;
+		pkt[13] = 0x00;
+	}
+	ihl = (random() % 8 ? 5 : 5 + random() % 3);
+	if (random() % 16)
+		pkt[14] = 0x40 | ihl;
+	if (random() % 4) {
+		pkt[14 + 6] &= 0xe0;
+		pkt[14 + 7] = 0;
+	}
+	switch (random() % 4) {
+	case 0:
+		pkt[14 + 9] = IPPROTO_TCP;
+		break;
+	case 1:
+		pkt[14 + 9] = IPPROTO_UDP;
+		break;
+	case 2:
+		pkt[14 + 9] = IPPROTO_ICMP;
+		break;
+	}
+}
+
+static void check_dump(const u_char *pkt, u_int32_t len)
+{
+	u_int32_t i;
+	
+	for (i = 0; i < len; i++)
+		fprintf(stderr, "%02x%s", pkt[i], (i % 16 == 15 ? "\n" : " "));
+	fprintf(stderr, "\n");
+}
+
+static void check_compile(pcap_t *dead, struct bpf_program *prog, const char *expr,
+	const char *what)
+{
+	if (pcap_compile(dead, prog, expr, 1, PCAP_NETMASK_UNKNOWN) != 0) {
+		fprintf(stderr, "FAIL: the %s filter does not compile: %s\n`%s'\n",
+			what, pcap_geterr(dead), expr);
+		exit(1);
+	}
+}
+
+/* the flat OR of the rules' filters (to be freed by the caller) */
+static char *check_flat_or(void)
+{
+	size_t len = 1;
+	char *s;
+	int i;
+	
+	for (i = 0; i < nel_nrules; i++) {
+		/* a rule without a filter takes every packet */
+		if (nel_rules[i].filter[0] == '\0')
+			return strdup("");
+		len += strlen(nel_rules[i].filter) + sizeof(" or ()");
+	}
+	if ((s = calloc(1, len)) == NULL) {
+		fprintf(stderr, "ERR: memory alloc (calloc())\n");
+		exit(1);
+	}
+	for (i = 0; i < nel_nrules; i++) {
+		if (i > 0)
+			strcat(s, " or ");
+		strcat(s, "(");
+		strcat(s, nel_rules[i].filter);
+		strcat(s, ")");
+	}
+	return s;
+}
+
+/* factored vs. flat OR filter of the current nel_rules */
+static void check_filter(pcap_t *dead, int round)
+{
+	struct bpf_program factored, flat;
+	struct pcap_pkthdr h;
+	u_char pkt[CR_SNAPLEN];
+	char *expr;
+	int i, v1, v2, accepted = 0, mismatches = 0;
+	
+	expr = cr_filter_build();
+	check_compile(dead, &factored, expr, "factored");
+	free(expr);
+	expr = check_flat_or();
+	check_compile(dead, &flat, expr, "flat OR");
+	free(expr);
+	bzero(&h, sizeof(h));
+	for (i = 0; i < CHECK_PKTS; i++) {
+		check_packet(pkt);
+		h.caplen = CR_SNAPLEN;
+		h.len = CR_SNAPLEN + random() % 1400;
+		v1 = (pcap_offline_filter(&factored, &h, pkt) != 0);
+		v2 = (pcap_offline_filter(&flat, &h, pkt) != 0);
+		accepted += v2;
+		if (v1 != v2 && mismatches++ < 3) {
+			fprintf(stderr, "FAIL: filter round %d: factored filter %s, flat "
+				"OR %s the packet:\n", round, v1 ? "accepts" : "rejects",
+				v2 ? "accepts" : "rejects");
+			check_dump(pkt, h.caplen);
+		}
+	}
+	printf("filter round %d: %u rules, %d packets, %d accepted: %s\n", round,
+		nel_nrules, CHECK_PKTS, accepted, mismatches ? "FAIL" : "ok");
+	if (mismatches)
+		check_failed = 1;
+	pcap_freecode(&factored);
+	pcap_freecode(&flat);
+}
+
+/* the eBPF programs vs. pcap_offline_filter() on the whole ruleset */
+static void check_ebpf(void)
+{
+	const struct bpf_program *f;
+	struct pcap_pkthdr h;
+	u_char pkt[CR_SNAPLEN], *hit;
+	pcap_t *dead;
+	int i, j, want, any, accepted = 0, mismatches = 0;
+	
+	if (cr_ebpf_check_init() != 0) {
+		printf("ebpf: skipped (the kernel refused the programs).\n");
+		return;
+	}
+	/* the filters the programs were translated from */
+	if ((dead = pcap_open_dead(DLT_RAW, CR_SNAPLEN)) == NULL) {
+		fprintf(stderr, "pcap_open_dead() error\n");
+		exit(1);
+	}
+	cr_pcap_compile(dead);
+	hit = nel_calloc(nel_nrules + 1, sizeof(u_char));
+	bzero(&h, sizeof(h));
+	for (i = 0; i < CHECK_PKTS; i++) {
+		check_packet(pkt);
+		if (cr_ebpf_check_run(pkt, CR_SNAPLEN, hit) != 0) {
+			check_failed = 1;
+			break;
+		}
+		/* the programs see the packet from the IPv4 header on */
+		h.caplen = h.len = CR_SNAPLEN - 14;
+		for (j = any = 0; j <= nel_nrules; j++) {
+			if (j < nel_nrules) {
+				f = cr_rule_filter(j);
+				want = (pcap_offline_filter(f, &h, pkt + 14) != 0);
+				any |= want;
+			} else {
+				want = any;
+			}
+			if (hit[j] != want && mismatches++ < 3) {
+				if (j < nel_nrules)
+					fprintf(stderr, "FAIL: ebpf: rule %u", nel_rules[j].id);
+				else
+					fprintf(stderr, "FAIL: ebpf: `any rule'");
+				fprintf(stderr, " %s the packet, its filter %s it:\n",
+					hit[j] ? "counted" : "did not count",
+					want ? "accepts" : "rejects");
+				check_dump(pkt, CR_SNAPLEN);
+			}
+		}
+		accepted += any;
+	}
+	printf("ebpf: %u rules, %d packets, %d accepted: %s\n", nel_nrules,
+		CHECK_PKTS, accepted, mismatches ? "FAIL" : "ok");
+	if (mismatches)
+		check_failed = 1;
+	free(hit);
+	pcap_close(dead);
+}
+
+/* the CR's adaptive time-slots in simulated runs of the whole ruleset */
+static void check_adaptive_wait(void)
+{
+	nel_cfg_t cfg = nel_cfg;
+	u_char pkt[PKT_MAX_LEN];
+	struct in_addr any = { 0 };
+	double t;
+	int i, native, late, sum = 0;
+	
+	for (i = native = 0; i < nel_nrules; i++)
+		native += (pkt_build(nel_rules[i].tmpl, pkt, sizeof(pkt), any, any) > 0);
+	cfg.warden_mode = WARDEN_MODE_DYN_WARDEN;
+	cfg.adaptive_wait = 1;
+	cfg.req_pkts = 20000;
+	cfg.comm_pkts = 1000000;
+	for (i = 0; i < CHECK_SIMS; i++) {
+		if (simulate(&cfg, (unsigned int) random(), 0, &t, &late) != 0) {
+			fprintf(stderr, "FAIL: adaptive wait: simulation %d did "
+				"not complete\n", i);
+			check_failed = 1;
+		}
+		sum += late;
+	}
+	printf("adaptive wait: %d simulations, %d native + %d scapy rules, "
+		"%d probes after their time-slot: %s\n", CHECK_SIMS, native,
+		nel_nrules - native, sum, sum ? "FAIL" : "ok");
+	if (sum)
+		check_failed = 1;
+}
+
+int main(int argc, char *argv[])
+{
+	nel_rule_t *all, *sub;
+	u_int32_t nall, seed;
+	pcap_t *dead;
+	int round, i;
+	
+	seed = (argc > 2 ? strtoul(argv[2], NULL, 0) : time(NULL));
+	printf("seed %u\n", seed);
+	srandom(seed);
+	ruleset_init(argc > 1 && strcmp(argv[1], "-") != 0 ? argv[1] : NULL);
+	check_values();
+	if ((dead = pcap_open_dead(DLT_EN10MB, CR_SNAPLEN)) == NULL) {
+		fprintf(stderr, "pcap_open_dead() error\n");
+		exit(1);
+	}
+	
+	/* the whole ruleset, then random subsets of it */
+	all = nel_rules;
+	nall = nel_nrules;
+	sub = nel_calloc(nall, sizeof(nel_rule_t));
+	for (round = 0; round < CHECK_ROUNDS; round++) {
+		nel_rules = (round == 0 ? all : sub);
+		if (round > 0) {
+			nel_nrules = 0;
+			for (i = 0; i < nall; i++) {
+				if (random() % 2)
+					sub[nel_nrules++] = all[i];
+			}
+			if (nel_nrules == 0)
+				sub[nel_nrules++] = all[random() % nall];
+		}
+		check_filter(dead, round);
+	}
+	nel_rules = all;
+	nel_nrules = nall;
+	free(sub);
+	pcap_close(dead);
+	
+	check_ebpf();
+	check_adaptive_wait();
+	
+	if (check_failed) {
+		printf("FAILED (seed %u)\n", seed);
+		return 1;
+	}
+	printf("all checks passed.\n");
+	return 0;
+}